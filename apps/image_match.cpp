@@ -1,15 +1,31 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <sys/resource.h>
+#include <unistd.h>
+
 #ifndef NDEBUG
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #endif
@@ -21,10 +37,18 @@
 #include <rapidjson/document.h>
 #include <rapidjson/istreamwrapper.h>
 #include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/writer.h>
 
 #include "image_match/csd.hpp"
+#include "image_match/hnsw.hpp"
 #include "image_match/image.hpp"
+#include "image_match/index.hpp"
+#include "image_match/ivf.hpp"
+#include "image_match/pivots.hpp"
+#include "image_match/pq.hpp"
+#include "image_match/stats.hpp"
+#include "image_match/thread_pool.hpp"
 
 using namespace std::filesystem;
 using namespace rapidjson;
@@ -32,12 +56,6 @@ using namespace rapidjson;
 /// List of available Color Structure Desriptor types.
 const std::vector<std::string> CSD_TYPES = { "32", "64", "128", "256" };
 
-/// List of valid Database filenames.
-const std::vector<std::string> DB_FILES = { "csd_32.json",
-                                            "csd_64.json",
-                                            "csd_128.json",
-                                            "csd_256.json" };
-
 /// Global configuration for the application
 struct config
 {
@@ -45,9 +63,53 @@ struct config
     path input_image_path;
     int matches_num{ 10 };
     unsigned int type;
+    std::string generate_type;
+    unsigned int convert_type;
+    image_match::bin_merge merge{ image_match::bin_merge::sum };
     bool quiet_mode{ false };
     bool output_json{ false };
     bool force_regenerate{ false };
+    unsigned int jobs{ std::max(1u, std::thread::hardware_concurrency()) };
+    size_t max_pixels{ 0 };
+    std::uint64_t max_memory{ 0 };
+    path output_path;
+    size_t tile_columns{ 2 };
+    size_t tile_rows{ 2 };
+    std::vector<size_t> tiles;
+    bool write_crops{ false };
+    bool from_crop{ false };
+    std::vector<path> partial_paths;
+    size_t grid{ 0 };
+    bool align{ false };
+    path template_path;
+    size_t step{ 1 };
+    size_t stride{ 1 };
+    double sampling{ 1.0 };
+    std::uint64_t seed{ 0 };
+    std::string stats_format;
+    size_t replicate{ 0 };
+    size_t queries{ 100 };
+    bool hnsw{ false };
+    bool exact{ false };
+    size_t links{ 16 };
+    size_t ef_construction{ 200 };
+    size_t ef{ 100 };
+    std::vector<size_t> ef_values{ 10, 20, 40, 80, 160, 320 };
+    bool ivf{ false };
+    size_t lists{ 0 };
+    size_t iterations{ 10 };
+    std::string storage{ "float" };
+    size_t nprobe{ 8 };
+    std::vector<size_t> nprobe_values{ 1, 2, 4, 8, 16, 32 };
+    bool pq{ false };
+    size_t subspaces{ 16 };
+    size_t rerank{ 0 };
+    std::vector<size_t> rerank_values{ 0, 10, 50, 100, 200 };
+    bool laesa{ false };
+    size_t pivots{ 16 };
+    bool cascade{ false };
+    size_t cascade_pool{ 100 };
+    std::vector<size_t> cascade_pools{ 10, 20, 50, 100, 200, 500 };
 };
 
 config app;
@@ -73,10 +135,13 @@ load_databse(path& db_file, Document& doc)
 }
 
 path
-database_filename()
+database_filename(unsigned int type)
 {
     std::ostringstream oss;
-    oss << "csd_" << app.type << ".json";
+    oss << "csd_" << type;
+    if (app.grid)
+        oss << "_grid" << app.grid;
+    oss << ".json";
     auto filename = absolute(app.dataset / oss.str()).lexically_normal();
 
     SPDLOG_DEBUG("Database filename: {}", filename.string());
@@ -100,52 +165,443 @@ already_generated_descriptors(const Document& doc)
     return already_generated;
 }
 
-std::vector<path>
-get_new_images(const std::unordered_set<std::string>& generated)
+/// Descriptor database of a single CSD type.
+struct database
+{
+    unsigned int type;
+    path file;
+    Document doc;
+    std::unordered_set<std::string> generated;
+};
+
+/// Image missing in some of the databases.
+struct new_image
+{
+    path image_path;
+    std::vector<size_t> databases; ///< Indices of the databases to update.
+};
+
+std::vector<new_image>
+get_new_images(const std::vector<database>& dbs)
 {
-    std::vector<path> image_paths;
+    std::vector<new_image> images;
     for (auto&& ip : image_match::get_image_paths(app.dataset)) {
         auto norm = absolute(ip).lexically_normal();
-        if (generated.find(norm.string()) == generated.end()) {
-            image_paths.push_back(norm);
-        }
+
+        new_image img{ norm, {} };
+        for (size_t i = 0; i < dbs.size(); ++i)
+            if (dbs[i].generated.find(norm.string()) == dbs[i].generated.end())
+                img.databases.push_back(i);
+
+        if (!img.databases.empty())
+            images.push_back(img);
     }
 
-    return image_paths;
+    return images;
 }
 
-void
-generate_descriptors(const std::vector<path>& ips, Document& doc)
+/// Size and modification time identifying a version of a file.
+struct file_stamp
 {
-    spdlog::info("Generating descriptors...");
+    std::uintmax_t size{ 0 };
+    std::int64_t mtime{ 0 };
+
+    bool operator==(const file_stamp& other) const
+    {
+        return size == other.size && mtime == other.mtime;
+    }
+};
 
-    Document::AllocatorType& alloc = doc.GetAllocator();
-    size_t count = 0;
-    size_t image_count = ips.size();
-    for (auto&& ip : ips) {
-        spdlog::info("({}/{}) {}", count, image_count, ip.string());
+/// Return the stamp of the file, if it can be read.
+std::optional<file_stamp>
+stamp_file(const path& file)
+{
+    std::error_code ec;
+    file_stamp stamp;
+    stamp.size = file_size(file, ec);
+    if (ec)
+        return std::nullopt;
+    stamp.mtime = last_write_time(file, ec).time_since_epoch().count();
+    if (ec)
+        return std::nullopt;
+
+    return stamp;
+}
 
-        image_match::image im{ ip };
-        if (!im) {
-            spdlog::warn(
-              "Error reading {}! {}. Skipping.", ip.string(), im.fail_msg());
+/// Image scheduled for descriptor generation.
+struct generate_job
+{
+    path image_path;
+    image_match::image_info info;
+    std::vector<size_t> databases; ///< Indices of the databases to update.
+    file_stamp stamp;              ///< Version of the image probed.
+};
+
+/// Image dimensions stored in a database with the version of the image.
+struct cached_info
+{
+    image_match::image_info info;
+    file_stamp stamp;
+};
+
+using image_info_cache = std::unordered_map<std::string, cached_info>;
+
+image_info_cache
+cached_image_info(const Document& doc)
+{
+    image_info_cache cache;
+    if (!doc.IsArray())
+        return cache;
+
+    for (auto&& v : doc.GetArray()) {
+        if (!v.IsObject() || !v.HasMember("path") || !v["path"].IsString() ||
+            !v.HasMember("width") || !v["width"].IsUint64() ||
+            !v.HasMember("height") || !v["height"].IsUint64() ||
+            !v.HasMember("channels") || !v["channels"].IsUint64() ||
+            !v.HasMember("size") || !v["size"].IsUint64() ||
+            !v.HasMember("mtime") || !v["mtime"].IsInt64())
+            continue;
+
+        cached_info cached;
+        cached.info.width = v["width"].GetUint64();
+        cached.info.height = v["height"].GetUint64();
+        cached.info.channels = v["channels"].GetUint64();
+        cached.stamp.size = v["size"].GetUint64();
+        cached.stamp.mtime = v["mtime"].GetInt64();
+        cache.insert({ v["path"].GetString(), cached });
+    }
+
+    return cache;
+}
+
+std::vector<generate_job>
+plan_generate_jobs(const std::vector<new_image>& images,
+                   const image_info_cache& cache)
+{
+    spdlog::info("Probing images...");
+
+    std::vector<generate_job> jobs;
+    for (auto&& [ip, dbs] : images) {
+        std::optional<image_match::image_info> info;
+
+        // The cached dimensions are trusted only while the image is unchanged
+        auto stamp = stamp_file(ip);
+        auto cached = cache.find(ip.string());
+        if (stamp && cached != cache.end() && cached->second.stamp == *stamp)
+            info = cached->second.info;
+        else if (stamp)
+            info = image_match::probe_image(ip);
+
+        if (!info) {
+            spdlog::warn("Error probing {}! Skipping.", ip.string());
+            continue;
+        }
+
+        if (app.max_pixels && info->pixels() > app.max_pixels) {
+            spdlog::warn("Image {} has {}x{} pixels, which exceeds the pixel "
+                         "budget of {}. Skipping.",
+                         ip.string(),
+                         info->width,
+                         info->height,
+                         app.max_pixels);
             continue;
         }
 
-        auto descriptor =
-          image_match::CSD(im, image_match::csd_from_int(app.type));
+        jobs.push_back({ ip, *info, dbs, *stamp });
+    }
+
+    // Process the largest images first so that the workers do not end up
+    // waiting for a single huge image at the end of the run.
+    std::stable_sort(
+      jobs.begin(), jobs.end(), [](const auto& lhs, const auto& rhs) {
+          return lhs.info.pixels() > rhs.info.pixels();
+      });
+
+    return jobs;
+}
+
+/// Estimated number of bytes needed to hold the decoded image.
+size_t
+decode_cost(const generate_job& job)
+{
+    // Grayscale images are decoded with a single channel
+    bool gray = job.info.channels == 1 || job.info.channels == 2;
+    return job.info.pixels() * (gray ? 1 : 3);
+}
+
+/**
+ * @brief Hands out generate jobs so that the decoded images fit into memory.
+ *
+ * Every job is admitted only if the estimated size of its decoded image fits
+ * into the remaining memory budget. The largest job that fits is admitted
+ * first, so small images keep all the workers busy while huge images are
+ * throttled. A job larger than the whole budget is admitted only when no
+ * other job is in flight. A budget of 0 disables the limit.
+ */
+class decode_scheduler
+{
+  public:
+    decode_scheduler(const std::vector<generate_job>& jobs,
+                     std::uint64_t budget)
+      : budget_{ budget }
+    {
+        for (size_t i = 0; i < jobs.size(); ++i)
+            pending_.insert({ decode_cost(jobs[i]), i });
+    }
+
+    /**
+     * @brief Wait until a job can be admitted and return its index.
+     *
+     * Returns an empty optional once all jobs have been handed out or the
+     * scheduler was cancelled.
+     *
+     * @param[out] cost - Set to the memory cost of the admitted job.
+     */
+    std::optional<size_t> acquire(size_t& cost)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::optional<size_t> job;
+        admitted_.wait(lock, [&]() {
+            if (cancelled_ || pending_.empty())
+                return true;
+
+            auto it = pending_.begin();
+            if (budget_ && in_use_) {
+                // Largest pending job fitting into the remaining budget
+                it = pending_.lower_bound(budget_ - std::min(budget_, in_use_));
+                if (it == pending_.end())
+                    return false;
+            }
+
+            cost = it->first;
+            job = it->second;
+            pending_.erase(it);
+            return true;
+        });
+
+        if (!job)
+            return job;
+
+        in_use_ += cost;
+        peak_ = std::max(peak_, in_use_);
+
+        auto waited = std::chrono::steady_clock::now() - start;
+        wait_time_ += waited;
+        max_wait_time_ = std::max(max_wait_time_, waited);
+
+        SPDLOG_DEBUG("Admitted job {} ({} B), memory budget use {}/{} B, "
+                     "waited {} ms",
+                     *job,
+                     cost,
+                     in_use_,
+                     budget_,
+                     std::chrono::duration<double, std::milli>(waited).count());
+
+        return job;
+    }
+
+    /// Return the memory of a finished job to the budget.
+    void release(size_t cost)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_use_ -= cost;
+        }
+        admitted_.notify_all();
+    }
+
+    /// Stop handing out new jobs.
+    void cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ = true;
+        }
+        admitted_.notify_all();
+    }
+
+    /// Currently used memory budget in bytes.
+    std::uint64_t in_use() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return in_use_;
+    }
+
+    /// Maximum of the used memory budget in bytes.
+    std::uint64_t peak() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return peak_;
+    }
+
+    /// Total time the jobs spent waiting for admission.
+    std::chrono::steady_clock::duration wait_time() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return wait_time_;
+    }
+
+    /// Longest time a single job spent waiting for admission.
+    std::chrono::steady_clock::duration max_wait_time() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_wait_time_;
+    }
+
+  private:
+    /// Pending jobs ordered by decreasing cost.
+    std::multimap<size_t, size_t, std::greater<size_t>> pending_;
+
+    std::uint64_t budget_;
+    std::uint64_t in_use_{ 0 };
+    std::uint64_t peak_{ 0 };
+    bool cancelled_{ false };
+
+    std::chrono::steady_clock::duration wait_time_{ 0 };
+    std::chrono::steady_clock::duration max_wait_time_{ 0 };
+
+    mutable std::mutex mutex_;
+    std::condition_variable admitted_;
+};
+
+void
+generate_descriptors(const std::vector<generate_job>& jobs,
+                     std::vector<database>& dbs)
+{
+    spdlog::info("Generating descriptors...");
+
+    std::vector<std::vector<image_match::CSD>> results(jobs.size());
+    std::vector<std::vector<image_match::grid_descriptor>> grid_results(
+      jobs.size());
+
+    // Threads left over when there are fewer images than jobs split the
+    // images into bands, the workers waiting for their bands don't count
+    size_t threads_num = std::min<size_t>(app.jobs, jobs.size());
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    options.stride = app.stride;
+    options.sampling = app.sampling;
+    options.seed = app.seed;
+    if (threads_num < app.jobs) {
+        pool.emplace(app.jobs - threads_num);
+        options.pool = &*pool;
+    }
 
-        // Add descriptor to DOM
-        Value new_desc(kObjectType);
-        new_desc.AddMember("path", absolute(ip).string(), alloc);
-        new_desc.AddMember("descriptor", Value().SetArray(), alloc);
+    decode_scheduler scheduler(jobs, app.max_memory);
+    std::atomic<size_t> count{ 0 };
+    auto worker = [&]() {
+        size_t cost;
+        while (auto i = scheduler.acquire(cost)) {
+            const auto& ip = jobs[*i].image_path;
+            spdlog::info("({}/{}) {}", count++, jobs.size(), ip.string());
+
+            try {
+                std::vector<image_match::CSDType> types;
+                for (auto&& db : jobs[*i].databases)
+                    types.push_back(image_match::csd_from_int(dbs[db].type));
+
+                image_match::image im{ ip };
+                if (im && app.grid)
+                    grid_results[*i] = image_match::compute_grid_descriptors(
+                      im.view(), types, app.grid, app.grid, options);
+                else if (im)
+                    results[*i] = image_match::compute_descriptors(
+                      im.view(), types, options);
+                else
+                    spdlog::warn("Error reading {}! {}. Skipping.",
+                                 ip.string(),
+                                 im.fail_msg());
+            } catch (...) {
+                scheduler.release(cost);
+                throw;
+            }
 
-        for (auto&& v : descriptor.data)
-            new_desc["descriptor"].PushBack(v, alloc);
+            scheduler.release(cost);
+        }
+    };
 
-        doc.PushBack(new_desc, alloc);
+    // Run the workers, the calling thread acts as one of them
+    std::vector<std::exception_ptr> errors(threads_num);
+    auto guarded_worker = [&](size_t id) {
+        try {
+            worker();
+        } catch (...) {
+            errors[id] = std::current_exception();
+            scheduler.cancel();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t id = 1; id < threads_num; ++id)
+        workers.emplace_back(guarded_worker, id);
+    if (threads_num)
+        guarded_worker(0);
+    for (auto&& w : workers)
+        w.join();
+
+    for (auto&& e : errors)
+        if (e)
+            std::rethrow_exception(e);
+
+    using ms = std::chrono::duration<double, std::milli>;
+    spdlog::info("Peak memory budget use {} B of {} B, jobs waited {:.1f} ms "
+                 "for admission in total (at most {:.1f} ms)",
+                 scheduler.peak(),
+                 app.max_memory,
+                 ms(scheduler.wait_time()).count(),
+                 ms(scheduler.max_wait_time()).count());
+
+    // Add descriptors to DOM
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        size_t generated = std::max(results[i].size(), grid_results[i].size());
+        for (size_t j = 0; j < generated; ++j) {
+            Document& doc = dbs[jobs[i].databases[j]].doc;
+            Document::AllocatorType& alloc = doc.GetAllocator();
+
+            const auto& info = jobs[i].info;
+            Value new_desc(kObjectType);
+            new_desc.AddMember(
+              "path", absolute(jobs[i].image_path).string(), alloc);
+            new_desc.AddMember("width", Value().SetUint64(info.width), alloc);
+            new_desc.AddMember(
+              "height", Value().SetUint64(info.height), alloc);
+            new_desc.AddMember(
+              "channels", Value().SetUint64(info.channels), alloc);
+            new_desc.AddMember(
+              "size", Value().SetUint64(jobs[i].stamp.size), alloc);
+            new_desc.AddMember(
+              "mtime", Value().SetInt64(jobs[i].stamp.mtime), alloc);
+
+            // The extraction tells the approximate descriptors apart
+            new_desc.AddMember("stride", Value().SetUint64(app.stride), alloc);
+            new_desc.AddMember(
+              "sampling", Value().SetDouble(app.sampling), alloc);
+            new_desc.AddMember("seed", Value().SetUint64(app.seed), alloc);
+
+            if (app.grid) {
+                // The window counts let the cells be merged again
+                new_desc.AddMember("grid", Value().SetUint64(app.grid), alloc);
+                Value cells(kArrayType);
+                for (auto&& cell : grid_results[i][j].cells) {
+                    Value c(kObjectType);
+                    c.AddMember(
+                      "windows", Value().SetUint64(cell.windows), alloc);
+                    c.AddMember("descriptor", Value().SetArray(), alloc);
+                    for (auto&& v : cell.data)
+                        c["descriptor"].PushBack(v, alloc);
+                    cells.PushBack(c, alloc);
+                }
+                new_desc.AddMember("cells", cells, alloc);
+            } else {
+                new_desc.AddMember("descriptor", Value().SetArray(), alloc);
+                for (auto&& v : results[i][j].data)
+                    new_desc["descriptor"].PushBack(v, alloc);
+            }
 
-        ++count;
+            doc.PushBack(new_desc, alloc);
+        }
     }
 
     spdlog::info("Descriptors generated");
@@ -155,6 +611,7 @@ void
 write_descriptors(const path& db_file, Document& doc)
 {
     spdlog::info("Writing database...");
+    IMAGE_MATCH_TIME_STAGE(write);
 
     std::ofstream ofs{ db_file };
     if (!ofs) {
@@ -169,24 +626,106 @@ write_descriptors(const path& db_file, Document& doc)
     spdlog::info("Database saved successfully.");
 }
 
-void
-run_generate_subcommand()
+/// Positions of the structuring element the descriptors were computed at.
+struct extraction_setting
 {
-    SPDLOG_DEBUG("Running generate subcommand.");
+    size_t stride{ 1 };
+    double sampling{ 1.0 };
+    std::uint64_t seed{ 0 };
+
+    bool exact() const { return stride == 1 && sampling == 1.0; }
+
+    /// The seed matters only when sampling.
+    bool operator==(const extraction_setting& other) const
+    {
+        return stride == other.stride && sampling == other.sampling &&
+               (sampling == 1.0 || seed == other.seed);
+    }
+
+    bool operator!=(const extraction_setting& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/// Return the extraction requested by the command line.
+extraction_setting
+requested_extraction()
+{
+    return { app.stride, app.sampling, app.seed };
+}
+
+std::string
+describe(const extraction_setting& setting)
+{
+    if (setting.exact())
+        return "the exact extraction";
+
+    std::ostringstream oss;
+    if (setting.stride != 1)
+        oss << "stride " << setting.stride;
+    if (setting.stride != 1 && setting.sampling != 1.0)
+        oss << ", ";
+    if (setting.sampling != 1.0)
+        oss << "sampling " << setting.sampling << ", seed " << setting.seed;
+
+    return oss.str();
+}
+
+/**
+ * @brief Return the extraction of the descriptors of the database.
+ *
+ * The entries generated before the extraction was recorded are exact. Throws
+ * std::runtime_error if the entries differ, their descriptors can't be
+ * compared to each other. Empty databases have no extraction.
+ */
+std::optional<extraction_setting>
+database_extraction(const Document& doc)
+{
+    if (!doc.IsArray())
+        throw std::runtime_error("Invalid database file! (not an array)");
 
-    path db_file = database_filename();
+    std::optional<extraction_setting> ans;
+    for (auto&& entry : doc.GetArray()) {
+        if (!entry.IsObject())
+            throw std::runtime_error("Invalid database file! (invalid entry)");
 
-    Document descriptors;
-    descriptors.SetArray();
+        extraction_setting setting;
+        if (entry.HasMember("stride") || entry.HasMember("sampling") ||
+            entry.HasMember("seed")) {
+            if (!entry.HasMember("stride") || !entry["stride"].IsUint64() ||
+                !entry.HasMember("sampling") ||
+                !entry["sampling"].IsNumber() || !entry.HasMember("seed") ||
+                !entry["seed"].IsUint64())
+                throw std::runtime_error(
+                  "Invalid database file! (invalid entry)");
+
+            setting.stride = entry["stride"].GetUint64();
+            setting.sampling = entry["sampling"].GetDouble();
+            setting.seed = entry["seed"].GetUint64();
+        }
 
-    if (!app.force_regenerate)
-        load_databse(db_file, descriptors);
+        if (ans && *ans != setting)
+            throw std::runtime_error(
+              "Invalid database file! (descriptors of different extractions, "
+              "regenerate it with -f)");
+        ans = setting;
+    }
 
-    auto already_generated = already_generated_descriptors(descriptors);
-    auto image_paths = get_new_images(already_generated);
+    return ans;
+}
 
-    generate_descriptors(image_paths, descriptors);
-    write_descriptors(db_file, descriptors);
+/// Warn that the distances to the approximate descriptors are approximate.
+void
+warn_approximate(const Document& doc, const path& db_file)
+{
+    auto extraction = database_extraction(doc);
+    if (extraction && !extraction->exact())
+        spdlog::warn("The descriptors of {} were extracted with {}, the "
+                     "distances to the exact descriptor of the image are "
+                     "approximate.",
+                     db_file.string(),
+                     describe(*extraction));
 }
 
 bool
@@ -207,8 +746,7 @@ load_descriptors(const Document& doc)
     SPDLOG_DEBUG("Loading descriptors from databse...");
 
     std::vector<std::pair<path, image_match::CSD>> descriptors;
-    if (!doc.IsArray())
-        throw std::runtime_error("Invalid database file! (not an array)");
+    database_extraction(doc);
 
     auto arr = doc.GetArray();
     for (auto&& val : arr) {
@@ -228,14 +766,70 @@ load_descriptors(const Document& doc)
     return descriptors;
 }
 
+bool
+is_grid_entry_valid(const Value& entry)
+{
+    if (!entry.IsObject() || !entry.HasMember("path") ||
+        !entry["path"].IsString() || !entry.HasMember("grid") ||
+        !entry["grid"].IsUint64() || entry["grid"].GetUint64() != app.grid ||
+        !entry.HasMember("cells") || !entry["cells"].IsArray() ||
+        entry["cells"].Size() != app.grid * app.grid)
+        return false;
+
+    for (auto&& cell : entry["cells"].GetArray())
+        if (!cell.IsObject() || !cell.HasMember("windows") ||
+            !cell["windows"].IsUint64() || !cell.HasMember("descriptor") ||
+            !cell["descriptor"].IsArray() ||
+            cell["descriptor"].Size() != app.type)
+            return false;
+
+    return true;
+}
+
+using image_grids = std::vector<std::pair<path, image_match::grid_descriptor>>;
+
+image_grids
+load_grid_descriptors(const Document& doc)
+{
+    SPDLOG_DEBUG("Loading grid descriptors from databse...");
+
+    image_grids grids;
+    database_extraction(doc);
+
+    auto type = image_match::csd_from_int(app.type);
+    for (auto&& val : doc.GetArray()) {
+        if (!is_grid_entry_valid(val))
+            throw std::runtime_error("Invalid database file! (invalid entry)");
+
+        image_match::grid_descriptor grid{ app.grid, app.grid, {} };
+        for (auto&& cell : val["cells"].GetArray()) {
+            image_match::CSD::descriptor descriptor;
+            for (auto&& num : cell["descriptor"].GetArray())
+                descriptor.push_back(num.GetFloat());
+
+            // Restore the counts for merging the cells when aligning
+            grid.cells.push_back(image_match::denormalize(
+              descriptor, cell["windows"].GetUint64(), type));
+        }
+
+        grids.push_back({ val["path"].GetString(), std::move(grid) });
+    }
+
+    return grids;
+}
+
 bool
 is_db_file(const path& file)
 {
     if (!is_regular_file(file))
         return false;
 
-    return find(DB_FILES.begin(), DB_FILES.end(), file.filename().string()) !=
-           DB_FILES.end();
+    auto normalized = absolute(file).lexically_normal();
+    for (auto&& type : CSD_TYPES)
+        if (normalized == database_filename(std::stoi(type)))
+            return true;
+
+    return false;
 }
 
 std::vector<path>
@@ -247,7 +841,7 @@ find_database_file()
     for (auto&& dir_entry : directory_iterator(app.dataset)) {
         if (app.type) {
             if (absolute(dir_entry.path()).lexically_normal() ==
-                database_filename()) {
+                database_filename(app.type)) {
                 ans.push_back(dir_entry.path());
                 return ans;
             }
@@ -281,8 +875,8 @@ struct similarity_pair_less
     }
 };
 
-image_match::CSD
-generate_descriptor_for_input_image()
+image_match::image
+load_input_image()
 {
     image_match::image im{ app.input_image_path };
     if (!im) {
@@ -294,16 +888,19 @@ generate_descriptor_for_input_image()
 
     spdlog::info("Generating descriptor for: {}",
                  absolute(app.input_image_path).lexically_normal().string());
-    return image_match::CSD(im, image_match::csd_from_int(app.type));
+
+    return im;
 }
 
 using matches = std::priority_queue<std::pair<float, path>,
                                     std::vector<std::pair<float, path>>,
                                     similarity_pair_less>;
 
+/// Keep the given number of descriptors closest to the image.
+template<typename D, typename F>
 matches
-find_best_matches(const image_descriptors& descriptors,
-                  const image_match::CSD& base_descriptor)
+find_best_matches(const std::vector<std::pair<path, D>>& descriptors,
+                  F distance)
 {
     matches matches;
 
@@ -312,8 +909,7 @@ find_best_matches(const image_descriptors& descriptors,
 
     size_t matches_num = app.matches_num;
     for (auto&& [p, descriptor] : descriptors) {
-        auto similarity_index =
-          image_match::compare(base_descriptor, descriptor);
+        auto similarity_index = distance(descriptor);
 
         if (matches.size() < matches_num) {
             matches.push({ similarity_index, p });
@@ -339,90 +935,2088 @@ print_matches(matches& ms)
     }
 }
 
-void
-run_match_subcommand()
+/// Descriptors of a database loaded for matching, global or of a grid.
+struct match_database
 {
-    SPDLOG_DEBUG("Running match subcommand.");
+    image_descriptors descriptors;
+    image_grids grids;
+    /// Indexes of the global descriptors, if built for the database.
+    std::optional<image_match::vp_tree> tree;
+    std::optional<image_match::pivot_table> pivots;
+    std::optional<image_match::hnsw> graph;
+    std::optional<image_match::ivf> inverted;
+};
 
-    if (app.matches_num == 0)
-        return;
+match_database
+load_match_database(const Document& doc)
+{
+    match_database db;
+    if (app.grid)
+        db.grids = load_grid_descriptors(doc);
+    else
+        db.descriptors = load_descriptors(doc);
 
-    auto db_files = find_database_file();
-    if (db_files.empty()) {
-        throw std::runtime_error("Database file not found or invalid! Please "
-                                 "run the `generate` subcommand first.");
-    }
+    return db;
+}
 
-    if (db_files.size() != 1) {
-        throw std::runtime_error(
-          "Multiple database files found, please use the -t argument to chose "
-          "the descriptor type you want to use.");
-    }
+/// Return the file of the index of a global database, next to it.
+path
+index_filename(const path& db_file)
+{
+    return path{ db_file }.replace_extension(".vpt");
+}
 
-    auto db_file = db_files[0];
-    app.type = db_type(db_file);
+/// Return the file of the pivot table of a global database, next to it.
+path
+pivots_filename(const path& db_file)
+{
+    return path{ db_file }.replace_extension(".pivots");
+}
 
-    Document database;
-    load_databse(db_file, database);
-    auto descriptors = load_descriptors(database);
-    auto base_descriptor = generate_descriptor_for_input_image();
-    auto matches = find_best_matches(descriptors, base_descriptor);
-    print_matches(matches);
+/// Return the file of the hnsw graph of a global database, next to it.
+path
+graph_filename(const path& db_file)
+{
+    return path{ db_file }.replace_extension(".hnsw");
 }
 
-std::string
-check_type(const std::string& opt)
+/// Return the file of the inverted file of a global database, next to it.
+path
+inverted_filename(const path& db_file)
 {
-    if (std::find(CSD_TYPES.begin(), CSD_TYPES.end(), opt) == CSD_TYPES.end()) {
-        std::ostringstream msg{};
-        msg << opt << " is not a valid type.";
-        throw CLI::ValidationError(msg.str());
-    }
+    return path{ db_file }.replace_extension(".ivf");
+}
 
-    return std::string();
+/// Return the file of the product quantizer of a global database, next to it.
+path
+quantized_filename(const path& db_file)
+{
+    return path{ db_file }.replace_extension(".pq");
 }
 
-int
-main(int argc, char* argv[])
+image_match::descriptor_refs
+database_refs(const image_descriptors& descriptors)
 {
-    // Set the default global log level to debug
-    spdlog::set_level(spdlog::level::debug);
+    image_match::descriptor_refs refs;
+    for (auto&& [p, descriptor] : descriptors)
+        refs.push_back(&descriptor);
 
-    // Parse command line arguments
-    CLI::App args("Simple image matching utility.");
-    args.require_subcommand(1);
+    return refs;
+}
 
-    auto generate_sub =
-      args.add_subcommand("generate", "Generate descriptor database.");
-    auto match_sub =
-      args.add_subcommand("match", "Match an image against database.");
+/// Return true if the graph holds the descriptors of the database.
+bool
+graph_matches(const image_match::hnsw& graph,
+              const image_match::descriptor_refs& refs)
+{
+    return graph.size() == refs.size() &&
+           graph.type() == image_match::csd_from_int(app.type) &&
+           graph.fingerprint() == image_match::descriptor_fingerprint(refs);
+}
 
-    // Arguments for the generate subcommand
-    generate_sub
-      ->add_option(
-        "type", app.type, "Type of descriptor to generate (32, 64, 128 or 256)")
-      ->required(true)
-      ->check(check_type);
+/**
+ * @brief Load the index of the database if there is one and it is up to date.
+ *
+ * Unless exact matches are requested, the hnsw graph is preferred to the
+ * inverted file and both of them to the exact indexes, of which the pivot
+ * table is preferred to the vp_tree. The product quantizer is used by
+ * `match --pq` only, without the database.
+ */
+void
+load_index(match_database& db, const path& db_file)
+{
+    if (app.grid)
+        return;
 
-    generate_sub
-      ->add_option(
-        "dataset", app.dataset, "Path to the directory containing images.")
-      ->required()
-      ->check(CLI::ExistingDirectory);
+    auto graph_file = graph_filename(db_file);
+    if (!app.exact && is_regular_file(graph_file)) {
+        try {
+            auto graph = image_match::hnsw::open(graph_file);
+            if (!graph_matches(graph, database_refs(db.descriptors)))
+                throw std::runtime_error("Index " + graph_file.string() +
+                                         " does not match the database!");
+            db.graph = std::move(graph);
+            spdlog::info("Using index {}", graph_file.string());
+            return;
+        } catch (std::runtime_error& e) {
+            spdlog::warn("{} Run the `index` subcommand to rebuild it.",
+                         e.what());
+        }
+    }
 
-    generate_sub->add_flag("-f,--force-regenerate",
-                           app.force_regenerate,
-                           "Force regenerate all descriptors.");
+    auto inverted_file = inverted_filename(db_file);
+    if (!app.exact && is_regular_file(inverted_file)) {
+        try {
+            auto inverted = image_match::ivf::load(inverted_file);
+            auto refs = database_refs(db.descriptors);
+            if (inverted.size() != refs.size() ||
+                inverted.type() != image_match::csd_from_int(app.type) ||
+                inverted.fingerprint() !=
+                  image_match::descriptor_fingerprint(refs))
+                throw std::runtime_error("Index " + inverted_file.string() +
+                                         " does not match the database!");
+            db.inverted = std::move(inverted);
+            spdlog::info("Using index {}", inverted_file.string());
+            return;
+        } catch (std::runtime_error& e) {
+            spdlog::warn("{} Run the `index` subcommand to rebuild it.",
+                         e.what());
+        }
+    }
 
-    // Arguments for the match subcommand
-    match_sub
-      ->add_option(
-        "image_path", app.input_image_path, "Path of image to compare.")
-      ->required()
-      ->check(CLI::ExistingFile);
+    auto pivots_file = pivots_filename(db_file);
+    if (is_regular_file(pivots_file)) {
+        try {
+            db.pivots = image_match::pivot_table::load(
+              pivots_file, database_refs(db.descriptors));
+            spdlog::info("Using index {}", pivots_file.string());
+            return;
+        } catch (std::runtime_error& e) {
+            spdlog::warn("{} Run the `index` subcommand to rebuild it.",
+                         e.what());
+        }
+    }
 
-    match_sub
-      ->add_option(
+    auto index_file = index_filename(db_file);
+    if (!is_regular_file(index_file))
+        return;
+
+    try {
+        db.tree = image_match::vp_tree::load(
+          index_file, database_refs(db.descriptors));
+        spdlog::info("Using index {}", index_file.string());
+    } catch (std::runtime_error& e) {
+        spdlog::warn("{} Run the `index` subcommand to rebuild it, matching "
+                     "without the index.",
+                     e.what());
+    }
+}
+
+/// Find the best matches of the descriptor using the index of the database.
+matches
+find_indexed_matches(const image_match::CSD& base, const match_database& db)
+{
+    if (app.matches_num == -1)
+        app.matches_num = db.descriptors.size();
+
+    image_match::search_stats stats;
+    std::vector<image_match::neighbor> neighbors;
+    if (db.graph)
+        neighbors = db.graph->search(base, app.matches_num, app.ef, &stats);
+    else if (db.inverted)
+        neighbors =
+          db.inverted->search(base, app.matches_num, app.nprobe, &stats);
+    else if (db.pivots)
+        neighbors = db.pivots->search(base, app.matches_num, &stats);
+    else
+        neighbors = db.tree->search(base, app.matches_num, &stats);
+    spdlog::info("Computed {} distances for {} descriptors",
+                 stats.distances,
+                 db.descriptors.size());
+
+    matches matches;
+    for (auto&& n : neighbors)
+        matches.push({ n.distance, db.descriptors[n.id].first });
+
+    return matches;
+}
+
+/// Insert the descriptors added to a global database into its hnsw graph.
+void
+update_graph(const database& db)
+{
+    auto graph_file = graph_filename(db.file);
+    if (app.grid || !is_regular_file(graph_file))
+        return;
+
+    app.type = db.type;
+    auto descriptors = load_descriptors(db.doc);
+    auto refs = database_refs(descriptors);
+    try {
+        auto graph = image_match::hnsw::load(graph_file);
+
+        // The database only grows by appending, unless regenerated
+        auto indexed = std::min(graph.size(), refs.size());
+        image_match::descriptor_refs old(refs.begin(), refs.begin() + indexed);
+        if (!graph_matches(graph, old))
+            throw std::runtime_error("Index " + graph_file.string() +
+                                     " does not match the database!");
+        if (indexed == refs.size())
+            return;
+
+        spdlog::info("Inserting {} descriptors into {} ...",
+                     refs.size() - indexed,
+                     graph_file.string());
+        std::optional<image_match::thread_pool> pool;
+        if (app.jobs > 1)
+            pool.emplace(app.jobs);
+        graph.insert({ refs.begin() + indexed, refs.end() },
+                     pool ? &*pool : nullptr);
+        graph.save(graph_file);
+    } catch (std::runtime_error& e) {
+        spdlog::warn("{} Run the `index` subcommand to rebuild it.", e.what());
+    }
+}
+
+void
+run_generate_subcommand()
+{
+    SPDLOG_DEBUG("Running generate subcommand.");
+
+    // Generate all the types in a single run, every image is decoded once
+    std::vector<std::string> types{ app.generate_type };
+    if (app.generate_type == "all")
+        types = CSD_TYPES;
+
+    std::vector<database> dbs(types.size());
+    image_info_cache info_cache;
+    for (size_t i = 0; i < types.size(); ++i) {
+        auto& db = dbs[i];
+        db.type = std::stoi(types[i]);
+        db.file = database_filename(db.type);
+
+        db.doc.SetArray();
+        load_databse(db.file, db.doc);
+
+        // Image dimensions stored in the database spare us probing the
+        // unchanged images again, even when the descriptors themselves are
+        // regenerated.
+        info_cache.merge(cached_image_info(db.doc));
+        if (app.force_regenerate)
+            db.doc.SetArray();
+
+        // Descriptors of another extraction can't be compared to the new ones
+        auto extraction = database_extraction(db.doc);
+        if (extraction && *extraction != requested_extraction())
+            throw std::runtime_error(
+              "Database " + db.file.string() + " was generated with " +
+              describe(*extraction) + ", not " +
+              describe(requested_extraction()) +
+              "! Use the same options or -f to regenerate it.");
+
+        db.generated = already_generated_descriptors(db.doc);
+    }
+
+    auto images = get_new_images(dbs);
+    auto jobs = plan_generate_jobs(images, info_cache);
+
+    generate_descriptors(jobs, dbs);
+    for (auto&& db : dbs) {
+        write_descriptors(db.file, db.doc);
+        update_graph(db);
+    }
+}
+
+/// Find the best matches of the image in a database of the type app.type.
+matches
+match_image(const image_match::image_view& im,
+            const match_database& db,
+            const image_match::extraction_options& options)
+{
+    auto type = image_match::csd_from_int(app.type);
+
+    if (!app.grid) {
+        image_match::CSD base(im, type, options);
+        if (db.graph || db.inverted || db.pivots || db.tree)
+            return find_indexed_matches(base, db);
+        return find_best_matches(db.descriptors, [&](const auto& d) {
+            return image_match::compare(base, d);
+        });
+    }
+
+    if (app.align) {
+        // The image may be a crop, find the part of each grid matching it
+        image_match::CSD base(im, type, options);
+        return find_best_matches(db.grids, [&](const auto& g) {
+            return image_match::compare_subgrids(base, g).distance;
+        });
+    }
+
+    auto base = image_match::compute_grid_descriptors(
+                  im, { type }, app.grid, app.grid, options)
+                  .front();
+    return find_best_matches(db.grids, [&](const auto& g) {
+        return image_match::compare(base, g);
+    });
+}
+
+/// Global databases of the coarsest and the finest type of the dataset.
+struct cascade_databases
+{
+    image_match::CSDType coarse_type;
+    image_match::CSDType fine_type;
+    image_descriptors fine;
+    /// Coarse descriptors of the images, in the order of the fine ones.
+    std::vector<image_match::CSD> coarse;
+};
+
+/**
+ * @brief Load the databases searched by the cascade.
+ *
+ * The coarse database is the one of the fewest bins, the fine one is of the
+ * type given by -t or else of the most bins. Throws std::runtime_error
+ * unless both exist and hold the same images.
+ */
+cascade_databases
+load_cascade_databases()
+{
+    std::vector<int> types;
+    for (auto&& type : CSD_TYPES)
+        if (is_regular_file(database_filename(std::stoi(type))))
+            types.push_back(std::stoi(type));
+
+    int fine_type = app.type ? app.type : types.empty() ? 0 : types.back();
+    if (types.empty() || types.front() >= fine_type ||
+        !is_regular_file(database_filename(fine_type)))
+        throw std::runtime_error(
+          "The cascade needs databases of two types, please run the "
+          "`generate` subcommand for both of them first.");
+
+    cascade_databases dbs{ image_match::csd_from_int(types.front()),
+                           image_match::csd_from_int(fine_type),
+                           {},
+                           {} };
+
+    Document database;
+    app.type = types.front();
+    auto coarse_file = database_filename(app.type);
+    load_databse(coarse_file, database);
+    std::map<path, image_match::CSD> coarse;
+    for (auto&& [p, descriptor] : load_descriptors(database))
+        coarse.emplace(p, std::move(descriptor));
+
+    app.type = fine_type;
+    auto fine_file = database_filename(app.type);
+    load_databse(fine_file, database);
+    dbs.fine = load_descriptors(database);
+    warn_approximate(database, fine_file);
+    for (auto&& [p, descriptor] : dbs.fine) {
+        auto it = coarse.find(p);
+        if (it == coarse.end())
+            throw std::runtime_error(
+              "Database " + coarse_file.string() + " does not hold " +
+              p.string() + "! Run the `generate` subcommand for both types.");
+        dbs.coarse.push_back(std::move(it->second));
+    }
+
+    return dbs;
+}
+
+/// Return the references to the coarse and to the fine descriptors.
+std::pair<image_match::descriptor_refs, image_match::descriptor_refs>
+cascade_refs(const cascade_databases& dbs)
+{
+    image_match::descriptor_refs coarse;
+    for (auto&& descriptor : dbs.coarse)
+        coarse.push_back(&descriptor);
+
+    return { coarse, database_refs(dbs.fine) };
+}
+
+/// Match the image by the cascade of the coarse and the fine database.
+void
+run_cascade_match()
+{
+    auto dbs = load_cascade_databases();
+    auto [coarse, fine] = cascade_refs(dbs);
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    // Both the descriptors of the image are computed in a single scan
+    auto im = load_input_image();
+    auto queries = image_match::compute_descriptors(
+      im.view(), { dbs.coarse_type, dbs.fine_type }, options);
+
+    if (app.matches_num == -1)
+        app.matches_num = fine.size();
+
+    image_match::search_stats stats;
+    auto neighbors = image_match::cascade_search(coarse,
+                                                 fine,
+                                                 queries[0],
+                                                 queries[1],
+                                                 app.matches_num,
+                                                 app.cascade_pool,
+                                                 &stats);
+    spdlog::info("Computed {} distances for {} descriptors",
+                 stats.distances,
+                 fine.size());
+
+    matches matches;
+    for (auto&& n : neighbors)
+        matches.push({ n.distance, dbs.fine[n.id].first });
+    print_matches(matches);
+}
+
+/**
+ * @brief Match the input image by the product quantizer alone.
+ *
+ * The matches are answered from the codes and the paths stored in the
+ * quantizer, the database is loaded only to re-rank the candidates.
+ */
+void
+run_quantized_match(path& db_file)
+{
+    if (app.grid)
+        throw std::runtime_error(
+          "The product quantizer indexes global databases only.");
+
+    auto quantized_file = quantized_filename(db_file);
+    if (!is_regular_file(quantized_file))
+        throw std::runtime_error("Index " + quantized_file.string() +
+                                 " not found! Please run the `index` "
+                                 "subcommand with --pq first.");
+
+    auto quantizer = image_match::product_quantizer::load(quantized_file);
+    if (!quantizer.labeled() ||
+        quantizer.type() != image_match::csd_from_int(app.type))
+        throw std::runtime_error("Index " + quantized_file.string() +
+                                 " does not match the database!");
+
+    // Without the database only the age of the index can be checked
+    if (last_write_time(quantized_file) < last_write_time(db_file))
+        spdlog::warn("Index {} is older than the database. Run the `index` "
+                     "subcommand to rebuild it.",
+                     quantized_file.string());
+    spdlog::info("Using index {}", quantized_file.string());
+
+    image_descriptors store;
+    image_match::descriptor_refs refs;
+    if (app.rerank) {
+        Document database;
+        load_databse(db_file, database);
+        store = load_descriptors(database);
+        warn_approximate(database, db_file);
+        refs = database_refs(store);
+        if (refs.size() != quantizer.size() ||
+            image_match::descriptor_fingerprint(refs) !=
+              quantizer.fingerprint())
+            throw std::runtime_error("Index " + quantized_file.string() +
+                                     " does not match the database!");
+    }
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    auto im = load_input_image();
+    image_match::CSD base(
+      im.view(), image_match::csd_from_int(app.type), options);
+
+    size_t k = app.matches_num == -1 ? quantizer.size() : app.matches_num;
+    image_match::search_stats stats;
+    auto neighbors = quantizer.search(
+      base, k, app.rerank, app.rerank ? &refs : nullptr, &stats);
+    spdlog::info("Computed {} distances for {} descriptors",
+                 stats.distances,
+                 quantizer.size());
+
+    matches matches;
+    for (auto&& n : neighbors)
+        matches.push({ n.distance, path{ quantizer.label(n.id) } });
+    print_matches(matches);
+}
+
+void
+run_match_subcommand()
+{
+    SPDLOG_DEBUG("Running match subcommand.");
+
+    if (app.matches_num == 0)
+        return;
+
+    if (app.cascade) {
+        run_cascade_match();
+        return;
+    }
+
+    auto db_files = find_database_file();
+    if (db_files.empty()) {
+        throw std::runtime_error("Database file not found or invalid! Please "
+                                 "run the `generate` subcommand first.");
+    }
+
+    if (db_files.size() != 1) {
+        throw std::runtime_error(
+          "Multiple database files found, please use the -t argument to chose "
+          "the descriptor type you want to use.");
+    }
+
+    auto db_file = db_files[0];
+    app.type = db_type(db_file);
+
+    if (app.pq) {
+        run_quantized_match(db_file);
+        return;
+    }
+
+    Document database;
+    load_databse(db_file, database);
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    auto descriptors = load_match_database(database);
+    warn_approximate(database, db_file);
+    load_index(descriptors, db_file);
+    auto im = load_input_image();
+    auto matches = match_image(im.view(), descriptors, options);
+    print_matches(matches);
+}
+
+/// Return true if the neighbours found by two searches are the same.
+bool
+same_neighbors(const std::vector<image_match::neighbor>& ns1,
+               const std::vector<image_match::neighbor>& ns2)
+{
+    return std::equal(
+      ns1.begin(), ns1.end(), ns2.begin(), ns2.end(), [](auto& n1, auto& n2) {
+          return n1.distance == n2.distance && n1.id == n2.id;
+      });
+}
+
+/**
+ * @brief Compare an exact index to the linear scan.
+ *
+ * The descriptors of the database, spread evenly over it, are the queries.
+ * Throws std::runtime_error if the index finds different neighbours.
+ */
+template<typename S>
+void
+report_exact(const image_match::descriptor_refs& refs, S search)
+{
+    using seconds = std::chrono::duration<double>;
+
+    size_t k = app.matches_num == -1 ? refs.size() : app.matches_num;
+    size_t queries = std::min(app.queries, refs.size());
+    image_match::search_stats index_stats, scan_stats;
+    double index_time = 0, scan_time = 0;
+    for (size_t q = 0; q < queries; ++q) {
+        const auto& query = *refs[q * refs.size() / queries];
+
+        auto start = std::chrono::steady_clock::now();
+        auto found = search(query, k, &index_stats);
+        auto mid = std::chrono::steady_clock::now();
+        auto expected =
+          image_match::brute_force_search(refs, query, k, &scan_stats);
+        auto end = std::chrono::steady_clock::now();
+
+        index_time += seconds(mid - start).count();
+        scan_time += seconds(end - mid).count();
+        if (!same_neighbors(found, expected))
+            throw std::runtime_error(
+              "The index returned different neighbours than the linear scan!");
+    }
+
+    if (queries == 0)
+        return;
+
+    double index_distances = double(index_stats.distances) / queries;
+    double scan_distances = double(scan_stats.distances) / queries;
+    std::printf("%zu queries, %zu nearest: %.1f distances per query (%.2f %% "
+                "of the linear scan), %.3f ms per query (linear scan %.3f "
+                "ms), results exact\n",
+                queries,
+                k,
+                index_distances,
+                100 * index_distances / scan_distances,
+                1e3 * index_time / queries,
+                1e3 * scan_time / queries);
+}
+
+/// Build the vp_tree of the database and compare it to the linear scan.
+void
+build_vp_tree(const image_match::descriptor_refs& refs, const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    spdlog::info("Building index of {} descriptors ...", refs.size());
+    auto start = std::chrono::steady_clock::now();
+    image_match::vp_tree tree{ refs };
+    double build = seconds(std::chrono::steady_clock::now() - start).count();
+
+    auto index_file = index_filename(db_file);
+    tree.save(index_file);
+    spdlog::info("Index saved to {}", index_file.string());
+
+    std::printf("entries %zu, build %.3f ms\n", refs.size(), 1e3 * build);
+    report_exact(refs, [&](auto&&... args) { return tree.search(args...); });
+}
+
+/// Build the pivot table of the database and compare it to the linear scan.
+void
+build_pivot_table(const image_match::descriptor_refs& refs,
+                  const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    spdlog::info("Building pivot table of {} descriptors ...", refs.size());
+    auto start = std::chrono::steady_clock::now();
+    image_match::pivot_table table{ refs, app.pivots };
+    double build = seconds(std::chrono::steady_clock::now() - start).count();
+
+    auto pivots_file = pivots_filename(db_file);
+    table.save(pivots_file);
+    spdlog::info("Index saved to {}", pivots_file.string());
+
+    std::printf("entries %zu, build %.3f ms, %zu pivots, table %.1f kB\n",
+                refs.size(),
+                1e3 * build,
+                table.pivots(),
+                table.table_size() / 1e3);
+    report_exact(refs, [&](auto&&... args) { return table.search(args...); });
+}
+
+/**
+ * @brief Report the recall and the latency of an approximate search.
+ *
+ * Each query is a descriptor of the database, left out of its own results,
+ * searched with each of the values of the parameter of the search. A
+ * neighbour found counts towards the recall if it is not farther than the
+ * k-th exact neighbour.
+ */
+template<typename S>
+void
+report_recall(const image_match::descriptor_refs& refs,
+              const char* parameter,
+              const std::vector<size_t>& values,
+              S search)
+{
+    using seconds = std::chrono::duration<double>;
+
+    size_t k = app.matches_num == -1 ? refs.size() : app.matches_num;
+    k = std::min(k, refs.size() - std::min<size_t>(refs.size(), 1));
+    size_t queries = std::min(app.queries, refs.size());
+    if (queries == 0 || k == 0)
+        return;
+
+    // Drop the query itself from the results
+    auto leave_out = [k](std::vector<image_match::neighbor> ns, size_t id) {
+        ns.erase(std::remove_if(ns.begin(),
+                                ns.end(),
+                                [id](auto& n) { return n.id == id; }),
+                 ns.end());
+        ns.resize(std::min(ns.size(), k));
+        return ns;
+    };
+
+    std::vector<size_t> ids;
+    std::vector<std::vector<image_match::neighbor>> exact;
+    double scan_time = 0;
+    for (size_t q = 0; q < queries; ++q) {
+        ids.push_back(q * refs.size() / queries);
+        auto start = std::chrono::steady_clock::now();
+        exact.push_back(leave_out(
+          image_match::brute_force_search(refs, *refs[ids.back()], k + 1),
+          ids.back()));
+        scan_time += seconds(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::printf("%zu queries, %zu nearest, linear scan %.3f ms per query\n",
+                queries,
+                k,
+                1e3 * scan_time / queries);
+    std::printf("%6s %10s %12s %14s %10s %11s\n",
+                parameter,
+                "recall",
+                "distances",
+                "latency [ms]",
+                "speedup",
+                "queries/s");
+    for (auto&& value : values) {
+        image_match::search_stats stats;
+        size_t hits = 0;
+        double time = 0;
+        for (size_t q = 0; q < queries; ++q) {
+            auto start = std::chrono::steady_clock::now();
+            auto found =
+              leave_out(search(*refs[ids[q]], k + 1, value, &stats), ids[q]);
+            time += seconds(std::chrono::steady_clock::now() - start).count();
+
+            // The distances found may be approximate
+            for (auto&& n : found)
+                hits += image_match::compare(*refs[ids[q]], *refs[n.id]) <=
+                        exact[q].back().distance;
+        }
+
+        std::printf("%6zu %10.4f %12.1f %14.3f %9.1fx %11.0f\n",
+                    value,
+                    double(hits) / (queries * k),
+                    double(stats.distances) / queries,
+                    1e3 * time / queries,
+                    scan_time / time,
+                    queries / time);
+    }
+}
+
+/// Build the hnsw graph of the database and report its recall.
+void
+build_graph(const image_match::descriptor_refs& refs, const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    std::optional<image_match::thread_pool> pool;
+    if (app.jobs > 1)
+        pool.emplace(app.jobs);
+
+    spdlog::info("Building hnsw graph of {} descriptors ...", refs.size());
+    image_match::hnsw_options options;
+    options.links = app.links;
+    options.ef_construction = app.ef_construction;
+    image_match::hnsw graph{ image_match::csd_from_int(app.type), options };
+    auto start = std::chrono::steady_clock::now();
+    graph.insert(refs, pool ? &*pool : nullptr);
+    double build = seconds(std::chrono::steady_clock::now() - start).count();
+
+    auto graph_file = graph_filename(db_file);
+    graph.save(graph_file);
+    spdlog::info("Index saved to {}", graph_file.string());
+
+    std::printf("entries %zu, build %.3f s with %u threads\n",
+                refs.size(),
+                build,
+                app.jobs);
+    report_recall(refs, "ef", app.ef_values, [&](auto&&... args) {
+        return graph.search(args...);
+    });
+}
+
+/// Build the inverted file of the database and report its recall.
+void
+build_inverted_file(const image_match::descriptor_refs& refs,
+                    const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    std::optional<image_match::thread_pool> pool;
+    if (app.jobs > 1)
+        pool.emplace(app.jobs);
+
+    spdlog::info("Clustering {} descriptors ...", refs.size());
+    image_match::ivf_options options;
+    options.lists = app.lists;
+    options.iterations = app.iterations;
+    if (app.storage == "u8")
+        options.storage = image_match::ivf_storage::uint8;
+    auto start = std::chrono::steady_clock::now();
+    image_match::ivf index{ refs, options, pool ? &*pool : nullptr };
+    double build = seconds(std::chrono::steady_clock::now() - start).count();
+
+    auto index_file = inverted_filename(db_file);
+    index.save(index_file);
+    spdlog::info("Index saved to {}", index_file.string());
+
+    size_t largest = 0;
+    for (size_t l = 0; l < index.lists(); ++l)
+        largest = std::max(largest, index.list_size(l));
+    std::printf("entries %zu, build %.3f s with %u threads, %zu lists of "
+                "%.1f descriptors on average, at most %zu\n",
+                refs.size(),
+                build,
+                app.jobs,
+                index.lists(),
+                double(refs.size()) / index.lists(),
+                largest);
+    report_recall(refs, "nprobe", app.nprobe_values, [&](auto&&... args) {
+        return index.search(args...);
+    });
+}
+
+/// Build the product quantizer of the database and report its recall.
+void
+build_quantizer(const image_descriptors& descriptors, const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    auto refs = database_refs(descriptors);
+
+    size_t bins = image_match::bin_count(image_match::csd_from_int(app.type));
+    if (bins % app.subspaces != 0)
+        throw std::runtime_error("The number of subspaces must divide the " +
+                                 std::to_string(bins) + " bins!");
+
+    std::optional<image_match::thread_pool> pool;
+    if (app.jobs > 1)
+        pool.emplace(app.jobs);
+
+    spdlog::info("Training product quantizer of {} descriptors ...",
+                 refs.size());
+    image_match::pq_options options;
+    options.subspaces = app.subspaces;
+    options.iterations = app.iterations;
+    auto start = std::chrono::steady_clock::now();
+    image_match::product_quantizer quantizer{ refs,
+                                              options,
+                                              pool ? &*pool : nullptr };
+    double build = seconds(std::chrono::steady_clock::now() - start).count();
+
+    // The paths let the quantizer answer matches without the database
+    std::vector<std::string> paths;
+    for (auto&& [p, descriptor] : descriptors)
+        paths.push_back(p.string());
+    quantizer.set_labels(paths);
+
+    auto quantized_file = quantized_filename(db_file);
+    quantizer.save(quantized_file);
+    spdlog::info("Index saved to {}", quantized_file.string());
+
+    std::printf("entries %zu, build %.3f s with %u threads\n",
+                refs.size(),
+                build,
+                app.jobs);
+    std::printf("%zu bytes per descriptor instead of %zu, codes %.1f kB, "
+                "codebooks %.1f kB, paths %.1f kB\n",
+                quantizer.subspaces(),
+                bins * sizeof(float),
+                quantizer.size() * quantizer.subspaces() / 1e3,
+                quantizer.codebook_size() / 1e3,
+                quantizer.labels_size() / 1e3);
+    report_recall(
+      refs,
+      "rerank",
+      app.rerank_values,
+      [&](const auto& query, size_t k, size_t rerank, auto* stats) {
+          return quantizer.search(query, k, rerank, &refs, stats);
+      });
+}
+
+/// Report the recall of the cascade against the linear scan of the fine
+/// database.
+void
+report_cascade()
+{
+    auto dbs = load_cascade_databases();
+    auto [coarse, fine] = cascade_refs(dbs);
+    if (fine.empty())
+        throw std::runtime_error("The database is empty!");
+
+    // The queries are the fine descriptors of the database
+    std::unordered_map<const image_match::CSD*, size_t> positions;
+    for (size_t i = 0; i < fine.size(); ++i)
+        positions.emplace(fine[i], i);
+
+    std::printf("entries %zu, %zu bins re-ranked by %zu bins\n",
+                fine.size(),
+                image_match::bin_count(dbs.coarse_type),
+                image_match::bin_count(dbs.fine_type));
+    report_recall(
+      fine,
+      "pool",
+      app.cascade_pools,
+      [&](const auto& query, size_t k, size_t pool, auto* stats) {
+          auto i = positions.at(&query);
+          return image_match::cascade_search(
+            coarse, fine, *coarse[i], query, k, pool, stats);
+      });
+}
+
+void
+run_index_subcommand()
+{
+    SPDLOG_DEBUG("Running index subcommand.");
+
+    if (app.cascade) {
+        report_cascade();
+        return;
+    }
+
+    auto db_files = find_database_file();
+    if (db_files.empty()) {
+        throw std::runtime_error("Database file not found or invalid! Please "
+                                 "run the `generate` subcommand first.");
+    }
+
+    if (db_files.size() != 1) {
+        throw std::runtime_error(
+          "Multiple database files found, please use the -t argument to chose "
+          "the descriptor type you want to use.");
+    }
+
+    auto db_file = db_files[0];
+    app.type = db_type(db_file);
+
+    Document database;
+    load_databse(db_file, database);
+    auto descriptors = load_descriptors(database);
+    auto refs = database_refs(descriptors);
+
+    if (refs.empty())
+        throw std::runtime_error("The database is empty!");
+
+    if (app.hnsw)
+        build_graph(refs, db_file);
+    else if (app.ivf)
+        build_inverted_file(refs, db_file);
+    else if (app.pq)
+        build_quantizer(descriptors, db_file);
+    else if (app.laesa)
+        build_pivot_table(refs, db_file);
+    else
+        build_vp_tree(refs, db_file);
+}
+
+/**
+ * @brief SAX handler converting the descriptors of a database.
+ *
+ * All the events are forwarded to the writer except for the values of the
+ * "descriptor" arrays, which are collected and converted to the target type
+ * once the array ends. The database is thus converted in a single pass
+ * without building its DOM.
+ */
+class descriptor_converter
+{
+  public:
+    descriptor_converter(Writer<OStreamWrapper>& writer,
+                         image_match::CSDType from,
+                         image_match::CSDType to,
+                         image_match::bin_merge merge)
+      : writer_{ writer }
+      , from_{ from }
+      , to_{ to }
+      , merge_{ merge }
+    {}
+
+    bool Null() { return !in_descriptor_ && writer_.Null(); }
+    bool Bool(bool b) { return !in_descriptor_ && writer_.Bool(b); }
+    bool Int(int i) { return value(i) && (in_descriptor_ || writer_.Int(i)); }
+    bool Uint(unsigned u)
+    {
+        return value(u) && (in_descriptor_ || writer_.Uint(u));
+    }
+    bool Int64(int64_t i)
+    {
+        return value(i) && (in_descriptor_ || writer_.Int64(i));
+    }
+    bool Uint64(uint64_t u)
+    {
+        return value(u) && (in_descriptor_ || writer_.Uint64(u));
+    }
+    bool Double(double d)
+    {
+        return value(d) && (in_descriptor_ || writer_.Double(d));
+    }
+    bool RawNumber(const char* str, SizeType length, bool copy)
+    {
+        return !in_descriptor_ && writer_.RawNumber(str, length, copy);
+    }
+    bool String(const char* str, SizeType length, bool copy)
+    {
+        return !in_descriptor_ && writer_.String(str, length, copy);
+    }
+    bool StartObject()
+    {
+        ++depth_;
+        return !in_descriptor_ && writer_.StartObject();
+    }
+    bool Key(const char* str, SizeType length, bool copy)
+    {
+        descriptor_key_ =
+          depth_ == 2 && std::string(str, length) == "descriptor";
+        return writer_.Key(str, length, copy);
+    }
+    bool EndObject(SizeType count)
+    {
+        --depth_;
+        return writer_.EndObject(count);
+    }
+    bool StartArray()
+    {
+        if (in_descriptor_)
+            return false;
+
+        ++depth_;
+        if (descriptor_key_) {
+            in_descriptor_ = true;
+            values_.clear();
+            return true;
+        }
+
+        return writer_.StartArray();
+    }
+    bool EndArray(SizeType count)
+    {
+        --depth_;
+        if (!in_descriptor_)
+            return writer_.EndArray(count);
+
+        in_descriptor_ = false;
+        descriptor_key_ = false;
+        if (values_.size() != image_match::bin_count(from_))
+            throw std::runtime_error("Invalid database file! (invalid entry)");
+
+        auto converted =
+          image_match::convert(image_match::CSD(values_, from_), to_, merge_);
+
+        writer_.StartArray();
+        for (auto&& v : converted.data)
+            writer_.Double(v);
+        ++converted_;
+        return writer_.EndArray(converted.data.size());
+    }
+
+    /// Number of converted descriptors.
+    size_t converted() const { return converted_; }
+
+  private:
+    template<typename T>
+    bool value(T v)
+    {
+        if (in_descriptor_)
+            values_.push_back(static_cast<float>(v));
+        return true;
+    }
+
+    Writer<OStreamWrapper>& writer_;
+    image_match::CSDType from_;
+    image_match::CSDType to_;
+    image_match::bin_merge merge_;
+
+    size_t depth_{ 0 };
+    bool descriptor_key_{ false };
+    bool in_descriptor_{ false };
+    image_match::CSD::descriptor values_;
+    size_t converted_{ 0 };
+};
+
+void
+run_convert_subcommand()
+{
+    SPDLOG_DEBUG("Running convert subcommand.");
+
+    auto from = image_match::csd_from_int(app.convert_type);
+    auto to = image_match::csd_from_int(app.type);
+    if (image_match::bin_count(to) > image_match::bin_count(from))
+        throw std::runtime_error(
+          "Descriptors can only be converted to a type with fewer bins.");
+
+    path src_file = database_filename(app.convert_type);
+    path dst_file = database_filename(app.type);
+    if (!is_regular_file(src_file))
+        throw std::runtime_error("Database file not found! Please run the "
+                                 "`generate` subcommand first.");
+    if (exists(dst_file) && !app.force_regenerate)
+        throw std::runtime_error("Target database already exists, use -f to "
+                                 "overwrite it.");
+
+    spdlog::info(
+      "Converting {} to {} ...", src_file.string(), dst_file.string());
+    auto start = std::chrono::steady_clock::now();
+
+    std::ifstream ifs{ src_file };
+    if (!ifs)
+        throw std::runtime_error("File read error! Could not read database!");
+
+    // Write into a temporary file so that a failure keeps the old database,
+    // the temporary file is removed on any error
+    path tmp_file = dst_file;
+    tmp_file += ".tmp";
+    try {
+        std::ofstream ofs{ tmp_file };
+        if (!ofs)
+            throw std::runtime_error(
+              "File write error! Could not write database!");
+
+        IStreamWrapper isw{ ifs };
+        OStreamWrapper osw{ ofs };
+        Writer<OStreamWrapper> writer(osw);
+        descriptor_converter converter(writer, from, to, app.merge);
+
+        Reader reader;
+        if (!reader.Parse(isw, converter))
+            throw std::runtime_error("Invalid database file!");
+
+        ofs.close();
+        if (!ofs)
+            throw std::runtime_error(
+              "File write error! Could not write database!");
+
+        spdlog::info("Converted {} descriptors", converter.converted());
+        rename(tmp_file, dst_file);
+    } catch (...) {
+        std::error_code ec;
+        remove(tmp_file, ec);
+        throw;
+    }
+
+    using ms = std::chrono::duration<double, std::milli>;
+    spdlog::info("Database converted in {:.1f} ms",
+                 ms(std::chrono::steady_clock::now() - start).count());
+}
+
+template<typename W>
+void
+write_region(W& writer, const char* name, const image_match::window_region& r)
+{
+    writer.Key(name);
+    writer.StartObject();
+    writer.Key("x");
+    writer.Uint64(r.x);
+    writer.Key("y");
+    writer.Uint64(r.y);
+    writer.Key("width");
+    writer.Uint64(r.width);
+    writer.Key("height");
+    writer.Uint64(r.height);
+    writer.EndObject();
+}
+
+std::optional<image_match::window_region>
+read_region(const Value& v)
+{
+    if (!v.IsObject())
+        return {};
+
+    image_match::window_region r;
+    for (auto&& [name, field] :
+         { std::pair{ "x", &r.x }, { "y", &r.y }, { "width", &r.width },
+           { "height", &r.height } }) {
+        if (!v.HasMember(name) || !v[name].IsUint64())
+            return {};
+        *field = v[name].GetUint64();
+    }
+
+    return r;
+}
+
+/// Image a partial descriptor or a crop was taken from.
+struct source_image
+{
+    path image_path;
+    image_match::image_info info;
+};
+
+/// Name of the file of the tile of the image in the output directory.
+path
+tile_filename(const source_image& source, size_t tile, const std::string& ext)
+{
+    path file = app.output_path;
+    file /= source.image_path.stem().string() + "." + std::to_string(tile) +
+            "." + ext;
+    return file;
+}
+
+template<typename W>
+void
+write_source(W& writer, const source_image& source)
+{
+    writer.Key("path");
+    writer.String(absolute(source.image_path).string());
+    writer.Key("width");
+    writer.Uint64(source.info.width);
+    writer.Key("height");
+    writer.Uint64(source.info.height);
+    writer.Key("channels");
+    writer.Uint64(source.info.channels);
+}
+
+void
+write_partial(const source_image& source,
+              size_t tile,
+              const image_match::partial_descriptor& partial)
+{
+    path file = tile_filename(
+      source, tile, database_filename(app.type).filename().string());
+    spdlog::info("Writing tile {} to {}", tile, file.string());
+
+    std::ofstream ofs{ file };
+    if (!ofs)
+        throw std::runtime_error("File write error! Could not write " +
+                                 file.string() + "!");
+
+    OStreamWrapper osw{ ofs };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartObject();
+    write_source(writer, source);
+    writer.Key("type");
+    writer.Uint(app.type);
+    write_region(writer, "extent", partial.extent);
+    write_region(writer, "region", partial.region);
+    writer.Key("counts");
+    writer.StartArray();
+    for (auto&& count : partial.counts)
+        writer.Uint(count);
+    writer.EndArray();
+    writer.EndObject();
+}
+
+/**
+ * @brief Write the crop of the tile for another process.
+ *
+ * The subsampled pixels are stored as a binary PNM image, which the image
+ * loader reads back, next to a JSON file describing the crop.
+ */
+void
+write_crop(const source_image& source,
+           size_t tile,
+           const image_match::region_crop& crop)
+{
+    path pixels_file = tile_filename(source, tile, "pnm");
+    path file = tile_filename(source, tile, "crop.json");
+    spdlog::info("Writing crop of tile {} to {}", tile, file.string());
+
+    const auto& pixels = crop.pixels;
+    std::ofstream pnm{ pixels_file, std::ios::binary };
+    pnm << (pixels.channels() == 1 ? "P5" : "P6") << '\n'
+        << pixels.width() << ' ' << pixels.height() << "\n255\n";
+    pnm.write(reinterpret_cast<const char*>(pixels.data().get()),
+              pixels.width() * pixels.height() * pixels.channels());
+
+    std::ofstream ofs{ file };
+    if (!pnm || !ofs)
+        throw std::runtime_error("File write error! Could not write " +
+                                 file.string() + "!");
+
+    OStreamWrapper osw{ ofs };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartObject();
+    write_source(writer, source);
+    writer.Key("tile");
+    writer.Uint64(tile);
+    write_region(writer, "region", crop.region);
+    writer.Key("pixels");
+    writer.String(pixels_file.filename().string());
+    writer.EndObject();
+}
+
+/// Compute the partial descriptor of a crop written by write_crop().
+void
+run_partial_crop()
+{
+    std::ifstream ifs{ app.input_image_path };
+    IStreamWrapper isw{ ifs };
+    Document doc;
+    doc.ParseStream(isw);
+
+    auto invalid = [&]() {
+        return std::runtime_error("Invalid crop file " +
+                                  app.input_image_path.string() + "!");
+    };
+    if (doc.HasParseError() || !doc.IsObject())
+        throw invalid();
+    for (auto&& key :
+         { "path", "width", "height", "channels", "tile", "region", "pixels" })
+        if (!doc.HasMember(key))
+            throw invalid();
+    if (!doc["path"].IsString() || !doc["width"].IsUint64() ||
+        !doc["height"].IsUint64() || !doc["channels"].IsUint64() ||
+        !doc["tile"].IsUint64() || !doc["pixels"].IsString())
+        throw invalid();
+    auto region = read_region(doc["region"]);
+    if (!region)
+        throw invalid();
+
+    source_image source{ doc["path"].GetString(),
+                         { doc["width"].GetUint64(),
+                           doc["height"].GetUint64(),
+                           doc["channels"].GetUint64() } };
+
+    path pixels_file =
+      app.input_image_path.parent_path() / doc["pixels"].GetString();
+    image_match::image pixels{ pixels_file };
+    if (!pixels) {
+        std::ostringstream msg;
+        msg << "Error reading " << pixels_file.string() << "!\n"
+            << pixels.fail_msg();
+        throw std::runtime_error(msg.str());
+    }
+
+    image_match::region_crop crop{
+        std::move(pixels), *region, source.info.width, source.info.height
+    };
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    auto partial = [&]() {
+        try {
+            return image_match::compute_partial_descriptors(
+                     crop, { image_match::csd_from_int(app.type) }, options)
+              .front();
+        } catch (std::invalid_argument&) {
+            throw invalid();
+        }
+    }();
+
+    create_directories(app.output_path);
+    write_partial(source, doc["tile"].GetUint64(), partial);
+}
+
+void
+run_partial_subcommand()
+{
+    SPDLOG_DEBUG("Running partial subcommand.");
+
+    if (app.from_crop)
+        return run_partial_crop();
+
+    auto info = image_match::probe_image(app.input_image_path);
+    if (!info)
+        throw std::runtime_error("Error reading " +
+                                 app.input_image_path.string() + "!");
+
+    // The regions are planned from the dimensions only
+    auto extent = image_match::window_extent(info->width, info->height);
+    if (app.tile_columns > extent.width || app.tile_rows > extent.height)
+        throw std::runtime_error("Too many tiles for the image, at most " +
+                                 std::to_string(extent.width) + "x" +
+                                 std::to_string(extent.height) +
+                                 " are possible.");
+    auto regions =
+      image_match::split_regions(extent, app.tile_columns, app.tile_rows);
+
+    std::vector<size_t> tiles = app.tiles;
+    if (tiles.empty())
+        for (size_t i = 0; i < regions.size(); ++i)
+            tiles.push_back(i);
+    for (auto&& tile : tiles)
+        if (tile >= regions.size())
+            throw std::runtime_error("Tile index " + std::to_string(tile) +
+                                     " out of range.");
+
+    image_match::image im{ app.input_image_path };
+    if (!im) {
+        std::ostringstream msg;
+        msg << "Error reading " << app.input_image_path.string() << "!\n"
+            << im.fail_msg();
+        throw std::runtime_error(msg.str());
+    }
+
+    // The image is subsampled once for all the tiles
+    std::vector<image_match::window_region> selected;
+    for (auto&& tile : tiles)
+        selected.push_back(regions[tile]);
+    auto crops = image_match::crop_regions(im.view(), selected);
+    source_image source{ app.input_image_path,
+                         { im.width(), im.height(), im.channels() } };
+
+    create_directories(app.output_path);
+    if (app.write_crops) {
+        for (size_t i = 0; i < tiles.size(); ++i)
+            write_crop(source, tiles[i], crops[i]);
+        return;
+    }
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    auto type = image_match::csd_from_int(app.type);
+    for (size_t i = 0; i < tiles.size(); ++i)
+        write_partial(source,
+                      tiles[i],
+                      image_match::compute_partial_descriptors(
+                        crops[i], { type }, options)
+                        .front());
+}
+
+void
+run_merge_subcommand()
+{
+    SPDLOG_DEBUG("Running merge subcommand.");
+
+    Document first;
+    std::vector<image_match::partial_descriptor> partials;
+    for (auto&& file : app.partial_paths) {
+        std::ifstream ifs{ file };
+        IStreamWrapper isw{ ifs };
+        Document doc;
+        doc.ParseStream(isw);
+
+        auto invalid = [&]() {
+            return std::runtime_error("Invalid partial descriptor file " +
+                                      file.string() + "!");
+        };
+        if (doc.HasParseError() || !doc.IsObject())
+            throw invalid();
+        for (auto&& key : { "path", "type", "counts", "extent", "region" })
+            if (!doc.HasMember(key))
+                throw invalid();
+        if (!doc["path"].IsString() || !doc["type"].IsUint() ||
+            !doc["counts"].IsArray())
+            throw invalid();
+
+        auto extent = read_region(doc["extent"]);
+        auto region = read_region(doc["region"]);
+        if (!extent || !region)
+            throw invalid();
+
+        image_match::CSD::histogram counts;
+        for (auto&& count : doc["counts"].GetArray()) {
+            if (!count.IsUint())
+                throw invalid();
+            counts.push_back(count.GetUint());
+        }
+
+        image_match::CSDType type;
+        try {
+            type = image_match::csd_from_int(doc["type"].GetUint());
+        } catch (std::invalid_argument&) {
+            throw invalid();
+        }
+
+        if (partials.empty())
+            first.Swap(doc);
+        else if (first["path"] != doc["path"])
+            throw std::runtime_error("Partial descriptor " + file.string() +
+                                     " belongs to a different image!");
+
+        partials.push_back({ type, counts, *extent, *region });
+    }
+
+    auto csd = [&]() {
+        try {
+            return image_match::merge(partials);
+        } catch (std::invalid_argument& e) {
+            throw std::runtime_error(
+              std::string("Cannot merge descriptors! ") + e.what());
+        }
+    }();
+    spdlog::info("Merged {} partial descriptors of {} windows",
+                 partials.size(),
+                 csd.windows);
+
+    // The merged descriptor is written as a database entry
+    auto& alloc = first.GetAllocator();
+    first.RemoveMember("extent");
+    first.RemoveMember("region");
+    first.RemoveMember("counts");
+    Value descriptor(kArrayType);
+    for (auto&& val : csd.data)
+        descriptor.PushBack(val, alloc);
+    first.AddMember("descriptor", descriptor, alloc);
+
+    if (app.output_path.empty()) {
+        OStreamWrapper osw{ std::cout };
+        Writer<OStreamWrapper> writer(osw);
+        first.Accept(writer);
+        std::cout << '\n';
+    } else {
+        std::ofstream ofs{ app.output_path };
+        if (!ofs)
+            throw std::runtime_error("File write error! Could not write " +
+                                     app.output_path.string() + "!");
+        OStreamWrapper osw{ ofs };
+        Writer<OStreamWrapper> writer(osw);
+        first.Accept(writer);
+    }
+}
+
+image_match::image
+load_image(const path& file)
+{
+    image_match::image im{ file };
+    if (!im) {
+        std::ostringstream msg;
+        msg << "Error reading " << file.string() << "!\n" << im.fail_msg();
+        throw std::runtime_error(msg.str());
+    }
+
+    return im;
+}
+
+void
+run_locate_subcommand()
+{
+    SPDLOG_DEBUG("Running locate subcommand.");
+
+    auto type = image_match::csd_from_int(app.type ? app.type : 64);
+    auto templ = load_image(app.template_path);
+    auto im = load_image(app.input_image_path);
+
+    spdlog::info("Building presence integral of {} ...",
+                 app.input_image_path.string());
+    auto start = std::chrono::steady_clock::now();
+    image_match::presence_integral integral(im.view(), type);
+
+    image_match::template_search search;
+    search.step = app.step;
+    search.count = app.matches_num < 0 ? std::numeric_limits<size_t>::max()
+                                       : app.matches_num;
+    auto matches = image_match::find_template(
+      integral, image_match::CSD(templ.view(), type), search);
+
+    using ms = std::chrono::duration<double, std::milli>;
+    spdlog::info("Searched in {:.1f} ms",
+                 ms(std::chrono::steady_clock::now() - start).count());
+
+    // Report the pixels of the image covered by the structuring elements
+    const auto& extent = integral.extent();
+    double scale_x = static_cast<double>(im.width()) /
+                     (extent.width + STRUCTURING_ELEMENT_SIZE - 1);
+    double scale_y = static_cast<double>(im.height()) /
+                     (extent.height + STRUCTURING_ELEMENT_SIZE - 1);
+    for (auto&& [distance, region] : matches) {
+        auto x = std::lround(region.x * scale_x);
+        auto y = std::lround(region.y * scale_y);
+        auto width = std::lround(
+          (region.width + STRUCTURING_ELEMENT_SIZE - 1) * scale_x);
+        auto height = std::lround(
+          (region.height + STRUCTURING_ELEMENT_SIZE - 1) * scale_y);
+        std::cout << distance << '\t' << x << '\t' << y << '\t' << width
+                  << '\t' << height << '\n';
+    }
+}
+
+void
+print_stats_text(const image_match::stats::summary& summary, double wall)
+{
+    using image_match::stats::counter;
+    auto counter_value = [&](counter c) {
+        return summary.counters[static_cast<size_t>(c)];
+    };
+
+    std::printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n",
+                "stage",
+                "count",
+                "total [s]",
+                "mean [ms]",
+                "p50 [ms]",
+                "p90 [ms]",
+                "p99 [ms]",
+                "max [ms]");
+    for (auto&& st : summary.stages)
+        std::printf("%-10s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                    image_match::stats::stage_name(st.id),
+                    static_cast<unsigned long long>(st.count),
+                    st.total,
+                    1e3 * st.mean,
+                    1e3 * st.p50,
+                    1e3 * st.p90,
+                    1e3 * st.p99,
+                    1e3 * st.max);
+
+    double images = counter_value(counter::images);
+    double megapixels = counter_value(counter::pixels) * 1e-6;
+    double megabytes = counter_value(counter::bytes_read) * 1e-6;
+    std::printf("wall %.3f s, %zu threads, %.0f images (%.2f images/s), "
+                "%.2f MP (%.2f MP/s), %.2f MB read (%.2f MB/s)\n",
+                wall,
+                summary.threads,
+                images,
+                images / wall,
+                megapixels,
+                megapixels / wall,
+                megabytes,
+                megabytes / wall);
+}
+
+void
+print_stats_json(const image_match::stats::summary& summary, double wall)
+{
+    using image_match::stats::counter;
+    auto counter_value = [&](counter c) {
+        return summary.counters[static_cast<size_t>(c)];
+    };
+
+    OStreamWrapper osw{ std::cout };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartObject();
+    writer.Key("wall_seconds");
+    writer.Double(wall);
+    writer.Key("threads");
+    writer.Uint64(summary.threads);
+    writer.Key("images");
+    writer.Uint64(counter_value(counter::images));
+    writer.Key("pixels");
+    writer.Uint64(counter_value(counter::pixels));
+    writer.Key("bytes_read");
+    writer.Uint64(counter_value(counter::bytes_read));
+    writer.Key("images_per_second");
+    writer.Double(counter_value(counter::images) / wall);
+    writer.Key("megapixels_per_second");
+    writer.Double(counter_value(counter::pixels) * 1e-6 / wall);
+    writer.Key("megabytes_read_per_second");
+    writer.Double(counter_value(counter::bytes_read) * 1e-6 / wall);
+
+    writer.Key("stages");
+    writer.StartArray();
+    for (auto&& st : summary.stages) {
+        writer.StartObject();
+        writer.Key("stage");
+        writer.String(image_match::stats::stage_name(st.id));
+        writer.Key("count");
+        writer.Uint64(st.count);
+        for (auto&& [name, value] : { std::pair{ "total", st.total },
+                                      { "mean", st.mean },
+                                      { "p50", st.p50 },
+                                      { "p90", st.p90 },
+                                      { "p99", st.p99 },
+                                      { "max", st.max } }) {
+            writer.Key(name);
+            writer.Double(value);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    std::cout << '\n';
+}
+
+/// Print the stage timers recorded during the subcommand, times in seconds.
+void
+print_stats(double wall)
+{
+#ifndef IMAGE_MATCH_STAGE_TIMERS
+    spdlog::warn("The stage timers are not compiled in, configure with "
+                 "-DIMAGE_MATCH_STAGE_TIMERS=ON.");
+#endif
+
+    auto summary = image_match::stats::collect();
+    if (app.stats_format == "json")
+        print_stats_json(summary, wall);
+    else
+        print_stats_text(summary, wall);
+}
+
+/// Temporary directory removed with all its content on destruction.
+class scratch_directory
+{
+  public:
+    scratch_directory()
+      : path_{ temp_directory_path() /
+               ("image_match_bench_" + std::to_string(getpid())) }
+    {
+        remove_all(path_);
+        create_directories(path_);
+    }
+
+    ~scratch_directory()
+    {
+        std::error_code ec;
+        remove_all(path_, ec);
+    }
+
+    scratch_directory(const scratch_directory&) = delete;
+    scratch_directory& operator=(const scratch_directory&) = delete;
+
+    const path& get() const { return path_; }
+
+  private:
+    path path_;
+};
+
+/// Copy the images of the dataset into the directory until there are count.
+void
+replicate_images(const path& dir, size_t count)
+{
+    auto images = image_match::get_image_paths(app.dataset);
+    if (images.empty())
+        throw std::runtime_error("No images found!");
+
+    spdlog::info("Replicating {} images to {}", images.size(), count);
+    for (size_t i = 0; i < count; ++i) {
+        const auto& src = images[i % images.size()];
+        auto name = std::to_string(i) + "_" + src.filename().string();
+        copy_file(src, dir / name);
+    }
+}
+
+/// Return the user and system CPU time of the process and its peak RSS.
+std::pair<double, std::uint64_t>
+process_usage()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    auto seconds = [](const timeval& tv) {
+        return tv.tv_sec + tv.tv_usec * 1e-6;
+    };
+
+    // ru_maxrss is in kilobytes on Linux
+    return { seconds(usage.ru_utime) + seconds(usage.ru_stime),
+             static_cast<std::uint64_t>(usage.ru_maxrss) * 1024 };
+}
+
+/**
+ * @brief Return the value below which the given fraction of the values lie.
+ *
+ * The values must be sorted and not empty.
+ */
+double
+percentile(const std::vector<double>& sorted, double fraction)
+{
+    return sorted[static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5)];
+}
+
+/// Throughput of the descriptor generation.
+struct generate_result
+{
+    size_t images{ 0 };
+    std::uint64_t bytes{ 0 };
+    std::uint64_t pixels{ 0 };
+    double wall{ 0 };
+    double cpu{ 0 };
+    std::vector<double> busy; ///< Seconds each thread spent working.
+};
+
+/// Latencies of the match queries, in seconds.
+struct query_result
+{
+    size_t entries{ 0 };
+    double load{ 0 };
+    std::vector<double> latencies;
+};
+
+generate_result
+bench_generate(const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    std::vector<database> dbs(1);
+    dbs[0].type = app.type;
+    dbs[0].file = db_file;
+    dbs[0].doc.SetArray();
+
+    auto cpu_start = process_usage().first;
+    auto start = std::chrono::steady_clock::now();
+    image_match::stats::reset();
+
+    auto jobs = plan_generate_jobs(get_new_images(dbs), {});
+    generate_descriptors(jobs, dbs);
+    write_descriptors(dbs[0].file, dbs[0].doc);
+
+    generate_result result;
+    result.wall = seconds(std::chrono::steady_clock::now() - start).count();
+    result.cpu = process_usage().first - cpu_start;
+    result.images = dbs[0].doc.Size();
+    for (auto&& job : jobs) {
+        result.bytes += file_size(job.image_path);
+        result.pixels += job.info.pixels();
+    }
+
+    for (auto&& busy : image_match::stats::collect().busy)
+        if (busy > 0)
+            result.busy.push_back(busy);
+
+    return result;
+}
+
+query_result
+bench_queries(const path& db_file)
+{
+    using seconds = std::chrono::duration<double>;
+
+    query_result result;
+    auto start = std::chrono::steady_clock::now();
+    Document doc;
+    path file = db_file;
+    load_databse(file, doc);
+    auto db = load_match_database(doc);
+    result.load = seconds(std::chrono::steady_clock::now() - start).count();
+    result.entries = doc.Size();
+
+    std::optional<image_match::thread_pool> pool;
+    image_match::extraction_options options;
+    if (app.jobs > 1) {
+        pool.emplace(app.jobs);
+        options.pool = &*pool;
+    }
+
+    // Query images spread evenly over the database
+    auto images = image_match::get_image_paths(app.dataset);
+    for (size_t q = 0; q < app.queries && !images.empty(); ++q) {
+        const auto& ip = images[q * images.size() / app.queries];
+
+        auto query_start = std::chrono::steady_clock::now();
+        image_match::image im{ ip };
+        if (!im) {
+            spdlog::warn(
+              "Error reading {}! {}. Skipping.", ip.string(), im.fail_msg());
+            continue;
+        }
+        match_image(im.view(), db, options);
+        result.latencies.push_back(
+          seconds(std::chrono::steady_clock::now() - query_start).count());
+    }
+
+    if (result.latencies.empty())
+        throw std::runtime_error("No queries were run!");
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    return result;
+}
+
+void
+write_bench_report(std::ostream& os,
+                   const generate_result& gen,
+                   const query_result& queries,
+                   std::uint64_t peak_rss)
+{
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+
+    OStreamWrapper osw{ os };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartObject();
+
+    writer.Key("host");
+    writer.String(hostname);
+    writer.Key("hardware_threads");
+    writer.Uint(std::thread::hardware_concurrency());
+    writer.Key("type");
+    writer.Uint(app.type);
+    writer.Key("grid");
+    writer.Uint64(app.grid);
+    writer.Key("align");
+    writer.Bool(app.align);
+    writer.Key("jobs");
+    writer.Uint(app.jobs);
+    writer.Key("peak_rss_bytes");
+    writer.Uint64(peak_rss);
+
+    writer.Key("generate");
+    writer.StartObject();
+    writer.Key("images");
+    writer.Uint64(gen.images);
+    writer.Key("bytes");
+    writer.Uint64(gen.bytes);
+    writer.Key("pixels");
+    writer.Uint64(gen.pixels);
+    writer.Key("wall_seconds");
+    writer.Double(gen.wall);
+    writer.Key("cpu_seconds");
+    writer.Double(gen.cpu);
+    writer.Key("images_per_second");
+    writer.Double(gen.images / gen.wall);
+    writer.Key("bytes_per_second");
+    writer.Double(gen.bytes / gen.wall);
+    writer.Key("megapixels_per_second");
+    writer.Double(gen.pixels * 1e-6 / gen.wall);
+    writer.Key("cpu_utilization");
+    writer.Double(gen.cpu / (gen.wall * app.jobs));
+    writer.Key("thread_busy");
+    writer.StartArray();
+    for (auto&& busy : gen.busy)
+        writer.Double(busy / gen.wall);
+    writer.EndArray();
+    writer.EndObject();
+
+    const auto& lat = queries.latencies;
+    double total = 0;
+    for (auto&& l : lat)
+        total += l;
+
+    writer.Key("match");
+    writer.StartObject();
+    writer.Key("entries");
+    writer.Uint64(queries.entries);
+    writer.Key("load_seconds");
+    writer.Double(queries.load);
+    writer.Key("queries");
+    writer.Uint64(lat.size());
+    writer.Key("queries_per_second");
+    writer.Double(lat.size() / total);
+    writer.Key("latency_ms");
+    writer.StartObject();
+    for (auto&& [name, value] : { std::pair{ "mean", total / lat.size() },
+                                  { "p50", percentile(lat, 0.5) },
+                                  { "p90", percentile(lat, 0.9) },
+                                  { "p99", percentile(lat, 0.99) },
+                                  { "max", lat.back() } }) {
+        writer.Key(name);
+        writer.Double(value * 1e3);
+    }
+    writer.EndObject();
+    writer.EndObject();
+
+    writer.EndObject();
+    os << '\n';
+}
+
+void
+run_bench_subcommand()
+{
+    SPDLOG_DEBUG("Running bench subcommand.");
+
+#ifndef IMAGE_MATCH_STAGE_TIMERS
+    spdlog::warn("The stage timers are not compiled in, the utilization of "
+                 "the threads is not reported.");
+#endif
+
+    // The database, and the replicated images, never touch the dataset
+    scratch_directory scratch;
+    if (app.replicate) {
+        replicate_images(scratch.get(), app.replicate);
+        app.dataset = scratch.get();
+    }
+
+    std::ostringstream name;
+    name << "csd_" << app.type;
+    if (app.grid)
+        name << "_grid" << app.grid;
+    name << ".json";
+    auto db_file = scratch.get() / name.str();
+
+    image_match::stats::set_enabled(true);
+    auto gen = bench_generate(db_file);
+    image_match::stats::set_enabled(false);
+
+    auto queries = bench_queries(db_file);
+
+    if (app.output_path.empty()) {
+        write_bench_report(std::cout, gen, queries, process_usage().second);
+    } else {
+        std::ofstream ofs{ app.output_path };
+        if (!ofs)
+            throw std::runtime_error("File write error! Could not write "
+                                     "the report!");
+        write_bench_report(ofs, gen, queries, process_usage().second);
+    }
+}
+
+std::string
+check_type(const std::string& opt)
+{
+    if (std::find(CSD_TYPES.begin(), CSD_TYPES.end(), opt) == CSD_TYPES.end()) {
+        std::ostringstream msg{};
+        msg << opt << " is not a valid type.";
+        throw CLI::ValidationError(msg.str());
+    }
+
+    return std::string();
+}
+
+std::string
+check_generate_type(const std::string& opt)
+{
+    if (opt == "all")
+        return std::string();
+
+    return check_type(opt);
+}
+
+std::string
+check_sampling(const std::string& opt)
+{
+    double sampling = 0;
+    std::istringstream iss{ opt };
+    if (!(iss >> sampling) || !(sampling > 0 && sampling <= 1)) {
+        std::ostringstream msg{};
+        msg << opt << " is not a fraction in (0, 1].";
+        throw CLI::ValidationError(msg.str());
+    }
+
+    return std::string();
+}
+
+int
+main(int argc, char* argv[])
+{
+    // Set the default global log level to debug
+    spdlog::set_level(spdlog::level::debug);
+
+    // Parse command line arguments
+    CLI::App args("Simple image matching utility.");
+    args.require_subcommand(1);
+
+    auto generate_sub =
+      args.add_subcommand("generate", "Generate descriptor database.");
+    auto match_sub =
+      args.add_subcommand("match", "Match an image against database.");
+    auto convert_sub = args.add_subcommand(
+      "convert", "Derive a database with fewer bins from an existing one.");
+    auto partial_sub = args.add_subcommand(
+      "partial", "Compute partial descriptors of tiles of an image.");
+    auto merge_sub = args.add_subcommand(
+      "merge", "Merge partial descriptors of an image into a descriptor.");
+    auto locate_sub = args.add_subcommand(
+      "locate", "Find the regions of an image most similar to a template.");
+    auto index_sub = args.add_subcommand(
+      "index", "Build an index of a database for faster matching.");
+    auto bench_sub = args.add_subcommand(
+      "bench", "Measure the throughput of generate and the latency of match.");
+
+    // Arguments for the generate subcommand
+    generate_sub
+      ->add_option("type",
+                   app.generate_type,
+                   "Type of descriptor to generate (32, 64, 128, 256 or all)")
+      ->required(true)
+      ->check(check_generate_type);
+
+    generate_sub
+      ->add_option(
+        "dataset", app.dataset, "Path to the directory containing images.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    generate_sub->add_flag("-f,--force-regenerate",
+                           app.force_regenerate,
+                           "Force regenerate all descriptors.");
+
+    generate_sub
+      ->add_option("-j,--jobs",
+                   app.jobs,
+                   "Number of images processed in parallel. (default: number "
+                   "of hardware threads)")
+      ->check(CLI::PositiveNumber);
+
+    generate_sub
+      ->add_option("--max-memory",
+                   app.max_memory,
+                   "Memory budget for images decoded at once, 0 for no "
+                   "limit. (default: 0)")
+      ->transform(CLI::AsSizeValue(false));
+
+    generate_sub
+      ->add_option("--grid",
+                   app.grid,
+                   "Generate descriptors of the cells of a N x N grid into a "
+                   "separate database.")
+      ->check(CLI::Range(1, 16));
+
+    generate_sub
+      ->add_option("--stride",
+                   app.stride,
+                   "Evaluate the structuring element only at every N-th "
+                   "position in both directions, for faster approximate "
+                   "descriptors. (default: 1)")
+      ->check(CLI::PositiveNumber);
+
+    generate_sub
+      ->add_option("--sampling",
+                   app.sampling,
+                   "Evaluate the structuring element only at a pseudo-random "
+                   "fraction of the positions, for faster approximate "
+                   "descriptors. (default: 1)")
+      ->check(check_sampling);
+
+    generate_sub->add_option(
+      "--seed", app.seed, "Seed of the sampled positions. (default: 0)");
+
+    generate_sub->add_option(
+      "--max-pixels",
+      app.max_pixels,
+      "Skip images with more pixels than given, 0 for no limit. (default: 0)");
+
+    // Arguments for the match subcommand
+    match_sub
+      ->add_option(
+        "image_path", app.input_image_path, "Path of image to compare.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    match_sub
+      ->add_option(
         "dataset", app.dataset, "Path to the directory containing images.")
       ->required()
       ->check(CLI::ExistingDirectory);
@@ -432,21 +3026,438 @@ main(int argc, char* argv[])
       app.matches_num,
       "Number of matches to display, -1 for all. (default: 10)");
 
+    match_sub
+      ->add_option("-j,--jobs",
+                   app.jobs,
+                   "Number of threads computing the descriptor of the image. "
+                   "(default: number of hardware threads)")
+      ->check(CLI::PositiveNumber);
+
+    auto grid_opt =
+      match_sub
+        ->add_option("--grid",
+                     app.grid,
+                     "Match against the N x N grid database, cell by cell.")
+        ->check(CLI::Range(1, 16));
+
+    match_sub
+      ->add_flag("--align",
+                 app.align,
+                 "Match the image against the best aligned rectangle of cells "
+                 "of each grid, for matching crops.")
+      ->needs(grid_opt);
+
     match_sub
       ->add_option("-t,--type",
                    app.type,
                    "Type of descriptor to generate (32, 64, 128 or 256)")
       ->check(check_type);
 
-    // Common arguments for both commands
+    match_sub
+      ->add_option("--ef",
+                   app.ef,
+                   "Number of the closest descriptors kept while searching "
+                   "the hnsw index, more for a higher recall. (default: 100)")
+      ->check(CLI::PositiveNumber);
+
+    match_sub
+      ->add_option("--nprobe",
+                   app.nprobe,
+                   "Number of the lists of the inverted file scanned, more "
+                   "for a higher recall. (default: 8)")
+      ->check(CLI::PositiveNumber);
+
+    match_sub->add_flag(
+      "--pq",
+      app.pq,
+      "Match by the codes and the paths of the product quantizer alone, "
+      "without loading the database unless re-ranking.");
+
+    match_sub->add_option(
+      "--rerank",
+      app.rerank,
+      "Number of the closest descriptors by the product quantizer re-ranked "
+      "by their exact distances from the database, 0 for none. (default: 0)");
+
+    match_sub->add_flag(
+      "--exact", app.exact, "Do not use the approximate indexes.");
+
+    auto match_cascade_flag = match_sub->add_flag(
+      "--cascade",
+      app.cascade,
+      "Scan the database of the fewest bins for candidates and re-rank them "
+      "by the database of the type given by -t or of the most bins.");
+    match_cascade_flag->excludes(grid_opt);
+
+    match_sub
+      ->add_option("--pool",
+                   app.cascade_pool,
+                   "Number of the candidates of the cascade re-ranked, more "
+                   "for a higher recall. (default: 100)")
+      ->check(CLI::PositiveNumber)
+      ->needs(match_cascade_flag);
+
+    // Arguments for the convert subcommand
+    convert_sub
+      ->add_option("from",
+                   app.convert_type,
+                   "Type of the existing database (64, 128 or 256)")
+      ->required()
+      ->check(check_type);
+
+    convert_sub
+      ->add_option("to", app.type, "Type of the new database (32, 64 or 128)")
+      ->required()
+      ->check(check_type);
+
+    convert_sub
+      ->add_option(
+        "dataset", app.dataset, "Path to the directory containing images.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    convert_sub
+      ->add_option("-m,--merge",
+                   app.merge,
+                   "How to merge unified bins, sum (MPEG-7) or max. "
+                   "(default: sum)")
+      ->transform(CLI::CheckedTransformer(
+        std::map<std::string, image_match::bin_merge>{
+          { "sum", image_match::bin_merge::sum },
+          { "max", image_match::bin_merge::max } }));
+
+    convert_sub->add_flag("-f,--force",
+                          app.force_regenerate,
+                          "Overwrite the target database if it exists.");
+
+    // Arguments for the partial subcommand
+    partial_sub
+      ->add_option(
+        "type", app.type, "Type of descriptor to compute (32, 64, 128 or 256)")
+      ->required()
+      ->check(check_type);
+
+    partial_sub
+      ->add_option("image_path", app.input_image_path, "Path of the image.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    partial_sub
+      ->add_option("output",
+                   app.output_path,
+                   "Directory the partial descriptors are written to.")
+      ->required();
+
+    partial_sub
+      ->add_option("--columns",
+                   app.tile_columns,
+                   "Number of columns of the tile grid. (default: 2)")
+      ->check(CLI::PositiveNumber);
+
+    partial_sub
+      ->add_option("--rows",
+                   app.tile_rows,
+                   "Number of rows of the tile grid. (default: 2)")
+      ->check(CLI::PositiveNumber);
+
+    partial_sub->add_option(
+      "-t,--tile",
+      app.tiles,
+      "Indices of the tiles to compute, row by row. (default: all)");
+
+    partial_sub
+      ->add_option("-j,--jobs",
+                   app.jobs,
+                   "Number of threads computing a tile. (default: number of "
+                   "hardware threads)")
+      ->check(CLI::PositiveNumber);
+
+    partial_sub->add_flag(
+      "--write-crops",
+      app.write_crops,
+      "Write the subsampled pixels of the tiles for other processes instead "
+      "of the descriptors.");
+
+    partial_sub->add_flag("--crop",
+                          app.from_crop,
+                          "The image is a crop written by --write-crops.");
+
+    // Arguments for the merge subcommand
+    merge_sub
+      ->add_option("partials",
+                   app.partial_paths,
+                   "Partial descriptors covering the whole image.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    merge_sub->add_option(
+      "-o,--output",
+      app.output_path,
+      "File to write the descriptor to. (default: standard output)");
+
+    // Arguments for the locate subcommand
+    locate_sub
+      ->add_option(
+        "template_path", app.template_path, "Path of the searched template.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    locate_sub
+      ->add_option(
+        "image_path", app.input_image_path, "Path of the searched image.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    locate_sub->add_option(
+      "-n,--number-of-matches",
+      app.matches_num,
+      "Number of regions to display, -1 for all. (default: 10)");
+
+    locate_sub
+      ->add_option("-t,--type",
+                   app.type,
+                   "Type of descriptor to compare (32, 64, 128 or 256). "
+                   "(default: 64)")
+      ->check(check_type);
+
+    locate_sub
+      ->add_option("--step",
+                   app.step,
+                   "Distance between the searched regions in structuring "
+                   "element positions. (default: 1)")
+      ->check(CLI::PositiveNumber);
+
+    // Arguments for the index subcommand
+    index_sub
+      ->add_option(
+        "dataset", app.dataset, "Path to the directory containing images.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    index_sub
+      ->add_option("-t,--type",
+                   app.type,
+                   "Type of descriptor to index (32, 64, 128 or 256)")
+      ->check(check_type);
+
+    index_sub
+      ->add_option("--queries",
+                   app.queries,
+                   "Number of descriptors of the database searched to "
+                   "compare the index to the linear scan. (default: 100)");
+
+    index_sub->add_option(
+      "-n,--number-of-matches",
+      app.matches_num,
+      "Number of neighbours searched by each query, -1 for all. (default: 10)");
+
+    index_sub->add_flag("--hnsw",
+                        app.hnsw,
+                        "Build the approximate hnsw graph instead of the "
+                        "exact vantage-point tree.");
+
+    index_sub
+      ->add_option("--links",
+                   app.links,
+                   "Maximal number of links of a node of the hnsw graph. "
+                   "(default: 16)")
+      ->check(CLI::Range(2, 1024));
+
+    index_sub
+      ->add_option("--ef-construction",
+                   app.ef_construction,
+                   "Number of the closest nodes explored when inserting into "
+                   "the hnsw graph. (default: 200)")
+      ->check(CLI::PositiveNumber);
+
+    index_sub
+      ->add_option("--ef",
+                   app.ef_values,
+                   "Values of ef the recall and the latency of the hnsw "
+                   "graph are reported for. (default: 10 20 40 80 160 320)")
+      ->check(CLI::PositiveNumber);
+
+    auto ivf_flag = index_sub->add_flag(
+      "--ivf",
+      app.ivf,
+      "Build the approximate inverted file of clusters instead.");
+    ivf_flag->excludes("--hnsw");
+
+    index_sub
+      ->add_option("--lists",
+                   app.lists,
+                   "Number of the clusters of the inverted file, 0 for the "
+                   "square root of the number of descriptors. (default: 0)")
+      ->needs(ivf_flag);
+
+    auto pq_flag = index_sub->add_flag(
+      "--pq",
+      app.pq,
+      "Build the approximate product quantizer compressing the descriptors "
+      "instead.");
+    pq_flag->excludes("--hnsw")->excludes(ivf_flag);
+
+    auto laesa_flag = index_sub->add_flag(
+      "--laesa",
+      app.laesa,
+      "Build the exact table of the distances to pivot descriptors instead.");
+    laesa_flag->excludes("--hnsw")->excludes(ivf_flag)->excludes(pq_flag);
+
+    auto cascade_flag = index_sub->add_flag(
+      "--cascade",
+      app.cascade,
+      "Build nothing, report the recall of the cascade of the database of "
+      "the fewest bins re-ranked by the one of the type given by -t or of "
+      "the most bins.");
+    cascade_flag->excludes("--hnsw")
+      ->excludes(ivf_flag)
+      ->excludes(pq_flag)
+      ->excludes(laesa_flag);
+
+    index_sub
+      ->add_option("--pool",
+                   app.cascade_pools,
+                   "Numbers of the re-ranked candidates the recall and the "
+                   "latency of the cascade are reported for. (default: 10 20 "
+                   "50 100 200 500)")
+      ->check(CLI::PositiveNumber)
+      ->needs(cascade_flag);
+
+    index_sub
+      ->add_option("--pivots",
+                   app.pivots,
+                   "Number of the pivots of the pivot table. (default: 16)")
+      ->check(CLI::PositiveNumber)
+      ->needs(laesa_flag);
+
+    index_sub
+      ->add_option("--iterations",
+                   app.iterations,
+                   "Number of the k-medians iterations clustering the "
+                   "inverted file or training the codebooks. (default: 10)");
+
+    index_sub
+      ->add_option("--subspaces",
+                   app.subspaces,
+                   "Number of the sub-vectors of the product quantizer, the "
+                   "bytes of a descriptor, must divide the bins. (default: 16)")
+      ->check(CLI::PositiveNumber)
+      ->needs(pq_flag);
+
+    index_sub
+      ->add_option("--rerank",
+                   app.rerank_values,
+                   "Numbers of the re-ranked candidates the recall and the "
+                   "latency of the product quantizer are reported for. "
+                   "(default: 0 10 50 100 200)")
+      ->needs(pq_flag);
+
+    index_sub
+      ->add_option("--storage",
+                   app.storage,
+                   "Format of the descriptors in the inverted file, float or "
+                   "8-bit u8. (default: float)")
+      ->check(CLI::IsMember({ "float", "u8" }))
+      ->needs(ivf_flag);
+
+    index_sub
+      ->add_option("--nprobe",
+                   app.nprobe_values,
+                   "Numbers of the scanned lists the recall and the latency "
+                   "of the inverted file are reported for. (default: 1 2 4 8 "
+                   "16 32)")
+      ->check(CLI::PositiveNumber)
+      ->needs(ivf_flag);
+
+    index_sub
+      ->add_option("-j,--jobs",
+                   app.jobs,
+                   "Number of threads building the approximate indexes. "
+                   "(default: number of hardware threads)")
+      ->check(CLI::PositiveNumber);
+
+    // Arguments for the bench subcommand
+    bench_sub
+      ->add_option(
+        "dataset", app.dataset, "Path to the directory containing images.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    bench_sub
+      ->add_option("-t,--type",
+                   app.type,
+                   "Type of descriptor to benchmark (32, 64, 128 or 256). "
+                   "(default: 64)")
+      ->check(check_type);
+
+    auto bench_grid_opt =
+      bench_sub
+        ->add_option("--grid",
+                     app.grid,
+                     "Benchmark the N x N grid database instead.")
+        ->check(CLI::Range(1, 16));
+
+    bench_sub
+      ->add_flag(
+        "--align", app.align, "Match with alignment of the grid cells.")
+      ->needs(bench_grid_opt);
+
+    bench_sub
+      ->add_option("-j,--jobs",
+                   app.jobs,
+                   "Number of threads. (default: number of hardware threads)")
+      ->check(CLI::PositiveNumber);
+
+    bench_sub->add_option("--replicate",
+                          app.replicate,
+                          "Replicate the images of the dataset to N images, "
+                          "0 to use the dataset as it is. (default: 0)");
+
+    bench_sub
+      ->add_option("--queries",
+                   app.queries,
+                   "Number of match queries. (default: 100)")
+      ->check(CLI::PositiveNumber);
+
+    bench_sub->add_option(
+      "-n,--number-of-matches",
+      app.matches_num,
+      "Number of matches of each query. (default: 10)");
+
+    bench_sub->add_option(
+      "-o,--output", app.output_path, "Write the report to the file.");
+
+    // Stage timers of the subcommands extracting descriptors
+    for (auto&& sub : { generate_sub, match_sub, locate_sub })
+        sub
+          ->add_option("--stats",
+                       app.stats_format,
+                       "Print the time spent in each stage and the throughput "
+                       "as text or json. (default: text)")
+          ->expected(0, 1)
+          ->check(CLI::IsMember({ "", "text", "json" }));
+
+    // Common arguments for all commands
     generate_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
     match_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    convert_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    partial_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    merge_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    locate_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    index_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
+    bench_sub->add_flag("-q,--quiet", app.quiet_mode, "Enable quiet mode.");
 
     CLI11_PARSE(args, argc, argv);
 
     if (app.quiet_mode)
         spdlog::set_level(spdlog::level::critical);
 
+    bool stats_requested = false;
+    for (auto&& sub : { generate_sub, match_sub, locate_sub })
+        stats_requested |= sub->get_option("--stats")->count() > 0;
+    image_match::stats::set_enabled(stats_requested);
+    auto start = std::chrono::steady_clock::now();
+
     if (*generate_sub)
         try {
             run_generate_subcommand();
@@ -463,5 +3474,60 @@ main(int argc, char* argv[])
             return EXIT_FAILURE;
         }
 
+    if (*convert_sub)
+        try {
+            run_convert_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (*partial_sub)
+        try {
+            run_partial_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (*merge_sub)
+        try {
+            run_merge_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (*locate_sub)
+        try {
+            run_locate_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (*index_sub)
+        try {
+            run_index_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (*bench_sub)
+        try {
+            if (!app.type)
+                app.type = 64;
+            run_bench_subcommand();
+        } catch (std::runtime_error& e) {
+            spdlog::critical(e.what());
+            return EXIT_FAILURE;
+        }
+
+    if (stats_requested) {
+        using seconds = std::chrono::duration<double>;
+        print_stats(seconds(std::chrono::steady_clock::now() - start).count());
+    }
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,593 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define IMAGE_MATCH_BENCH_TSC
+#endif
+
+#include "spdlog/spdlog.h"
+
+#include "CLI/CLI.hpp"
+
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/prettywriter.h>
+
+#include "image_match/csd.hpp"
+#include "image_match/hmmd.hpp"
+#include "image_match/image.hpp"
+#include "image_match/stats.hpp"
+
+using namespace std::filesystem;
+using namespace rapidjson;
+
+/// Global configuration of the tool.
+struct config
+{
+    std::vector<size_t> sizes{ 256, 512, 1024, 2048 };
+    path images;
+    size_t max_images{ 4 };
+    std::vector<unsigned int> types{ 32, 64, 128, 256 };
+    std::string filter;
+
+    double warmup{ 0.1 };   ///< Seconds of warm-up of every benchmark.
+    double min_time{ 0.02 }; ///< Minimal seconds of a repetition.
+    size_t repetitions{ 10 };
+
+    std::string json;
+};
+
+config app;
+
+/// Image the benchmarks run on.
+struct bench_input
+{
+    std::string name;
+    image_match::image im;
+};
+
+/// Per operation costs measured in the repetitions of a benchmark.
+struct samples
+{
+    size_t iterations{ 0 };
+    std::vector<double> ns;
+    std::vector<double> cycles; ///< Empty if no cycle counter is available.
+    /// Stage timers of each repetition, empty unless the timers are enabled.
+    std::vector<image_match::stats::summary> stages{};
+};
+
+/// Statistics of the repetitions of a benchmark.
+struct result
+{
+    std::string kernel;
+    std::string image;
+    size_t width{ 0 };
+    size_t height{ 0 };
+    size_t bins{ 0 }; ///< Bins of the CSDType, 0 if not specific to a type.
+
+    size_t iterations{ 0 };
+    size_t repetitions{ 0 };
+
+    // Nanoseconds per operation
+    double min{ 0 };
+    double median{ 0 };
+    double mean{ 0 };
+    double stddev{ 0 };
+
+    std::optional<double> ns_per_pixel{};
+    std::optional<double> ns_per_descriptor{};
+    std::optional<double> cycles_per_bin{};
+};
+
+std::vector<result> results;
+
+/// Prevents the compiler from discarding the results of the benchmarks.
+volatile float sink;
+
+/// Return the reference cycles elapsed, 0 if not available.
+inline std::uint64_t
+cycle_count()
+{
+#ifdef IMAGE_MATCH_BENCH_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+double
+median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/**
+ * @brief Measure the cost of a single run of the operation.
+ *
+ * The operation is first run repeatedly for app.warmup seconds, which also
+ * estimates its duration. The number of iterations of a repetition is chosen
+ * so that it lasts at least app.min_time seconds. The stage timers are reset
+ * before and collected after every repetition if they are enabled.
+ */
+template<typename Op>
+samples
+measure(Op&& op)
+{
+    using seconds = std::chrono::duration<double>;
+    using nanoseconds = std::chrono::duration<double, std::nano>;
+
+    size_t runs = 0;
+    double elapsed = 0;
+    auto start = std::chrono::steady_clock::now();
+    do {
+        op();
+        ++runs;
+        elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < app.warmup);
+
+    samples s;
+    s.iterations = std::max<size_t>(
+      1, static_cast<size_t>(std::ceil(app.min_time * runs / elapsed)));
+
+    for (size_t r = 0; r < app.repetitions; ++r) {
+        if (image_match::stats::enabled())
+            image_match::stats::reset();
+
+        auto cycles = cycle_count();
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < s.iterations; ++i)
+            op();
+        auto end = std::chrono::steady_clock::now();
+        cycles = cycle_count() - cycles;
+
+        s.ns.push_back(nanoseconds(end - begin).count() / s.iterations);
+#ifdef IMAGE_MATCH_BENCH_TSC
+        s.cycles.push_back(static_cast<double>(cycles) / s.iterations);
+#endif
+        if (image_match::stats::enabled())
+            s.stages.push_back(image_match::stats::collect());
+    }
+
+    return s;
+}
+
+/**
+ * @brief Return the cost of a stage per operation measured by the timers.
+ *
+ * Returns an empty optional if the stage was not recorded.
+ */
+std::optional<samples>
+stage_samples(const samples& s, image_match::stats::stage id)
+{
+    samples stage;
+    stage.iterations = s.iterations;
+    for (auto&& summary : s.stages) {
+        auto it = std::find_if(summary.stages.begin(),
+                               summary.stages.end(),
+                               [&](const auto& st) { return st.id == id; });
+        if (it == summary.stages.end())
+            return {};
+        stage.ns.push_back(it->total * 1e9 / s.iterations);
+    }
+
+    if (stage.ns.empty())
+        return {};
+    return stage;
+}
+
+/// Per operation amounts of work used to normalize the costs.
+struct work
+{
+    size_t pixels{ 0 };
+    bool descriptor{ false }; ///< The operation yields a single descriptor.
+    size_t bins{ 0 };         ///< Bins processed, for the cycles per bin.
+};
+
+void
+report(const std::string& kernel,
+       const bench_input& input,
+       size_t bins,
+       const samples& s,
+       const work& w)
+{
+    result r{ kernel,
+              input.name,
+              input.im.width(),
+              input.im.height(),
+              bins,
+              s.iterations,
+              s.ns.size() };
+
+    r.min = *std::min_element(s.ns.begin(), s.ns.end());
+    r.median = median(s.ns);
+    for (auto&& ns : s.ns)
+        r.mean += ns / s.ns.size();
+    for (auto&& ns : s.ns)
+        r.stddev += (ns - r.mean) * (ns - r.mean) / s.ns.size();
+    r.stddev = std::sqrt(r.stddev);
+
+    if (w.pixels)
+        r.ns_per_pixel = r.median / w.pixels;
+    if (w.descriptor)
+        r.ns_per_descriptor = r.median;
+    if (w.bins && !s.cycles.empty())
+        r.cycles_per_bin = median(s.cycles) / w.bins;
+
+    auto format = [](const std::optional<double>& value) {
+        char buffer[32] = "-";
+        if (value)
+            std::snprintf(buffer, sizeof(buffer), "%.3f", *value);
+        return std::string(buffer);
+    };
+
+    if (app.json != "-")
+        std::printf("%-14s %-28.28s %11s %4s %12.1f %7.2f%% %10s %12s %10s\n",
+                    r.kernel.c_str(),
+                    r.image.c_str(),
+                    (std::to_string(r.width) + "x" +
+                     std::to_string(r.height))
+                      .c_str(),
+                    bins ? std::to_string(bins).c_str() : "-",
+                    r.median,
+                    r.mean > 0 ? 100 * r.stddev / r.mean : 0,
+                    format(r.ns_per_pixel).c_str(),
+                    format(r.ns_per_descriptor).c_str(),
+                    format(r.cycles_per_bin).c_str());
+
+    results.push_back(std::move(r));
+}
+
+bool
+selected(const std::string& kernel)
+{
+    return app.filter.empty() || kernel.find(app.filter) != std::string::npos;
+}
+
+const char*
+kernel_name(image_match::hmmd_kernel kernel)
+{
+    switch (kernel) {
+        case image_match::hmmd_kernel::automatic:
+            return "automatic";
+        case image_match::hmmd_kernel::scalar:
+            return "scalar";
+        case image_match::hmmd_kernel::sse41:
+            return "sse41";
+        case image_match::hmmd_kernel::avx2:
+            return "avx2";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Generate a deterministic image of the given dimensions.
+ *
+ * Smooth gradients are interleaved with blocks of noise, so the colors fall
+ * into all the subspaces of the quantization and the scan sees both uniform
+ * and varied structuring elements.
+ */
+image_match::image
+synthetic_image(size_t width, size_t height)
+{
+    image_match::image im{ width, height, 3 };
+
+    std::uint32_t state = 0x9E3779B9u;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            auto p = im[y][x];
+            if ((x / 32 + y / 32) % 3 == 0) {
+                // xorshift32
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                p[0] = static_cast<unsigned char>(state);
+                p[1] = static_cast<unsigned char>(state >> 8);
+                p[2] = static_cast<unsigned char>(state >> 16);
+            } else {
+                p[0] = static_cast<unsigned char>(255 * x / width);
+                p[1] = static_cast<unsigned char>(255 * y / height);
+                p[2] = static_cast<unsigned char>(255 * (x + y) /
+                                                  (width + height));
+            }
+        }
+    }
+
+    return im;
+}
+
+/// Run all the selected benchmarks on the image.
+void
+bench(const bench_input& input)
+{
+    using namespace image_match;
+
+    const auto view = input.im.view();
+    const size_t pixels = view.width() * view.height();
+    const auto shift = compute_subsample_shift(view.width(), view.height());
+
+    if (selected("subsample")) {
+        auto s = measure([&] {
+            subsampled_shift(
+              view, shift, STRUCTURING_ELEMENT_SIZE, STRUCTURING_ELEMENT_SIZE);
+        });
+        report("subsample", input, 0, s, { pixels });
+    }
+
+    // The following stages work on the subsampled image
+    auto small = subsampled_shift(
+      view, shift, STRUCTURING_ELEMENT_SIZE, STRUCTURING_ELEMENT_SIZE);
+    const size_t small_pixels = small.width() * small.height();
+
+    image hmmd{ small.width(), small.height(), small.channels() };
+    std::copy_n(small.data().get(),
+                small_pixels * small.channels(),
+                hmmd.data().get());
+    if (small.channels() == 3) {
+        for (auto&& kernel :
+             { hmmd_kernel::scalar, hmmd_kernel::sse41, hmmd_kernel::avx2 }) {
+            std::string name = std::string("hmmd/") + kernel_name(kernel);
+            if (!hmmd_kernel_available(kernel) || !selected(name))
+                continue;
+
+            auto s = measure(
+              [&] { rgb2hmmd(small.view(), hmmd.view(), kernel); });
+            report(name, input, 0, s, { small_pixels });
+        }
+        rgb2hmmd(hmmd);
+    }
+
+    std::vector<CSDType> types;
+    for (auto&& bins : app.types)
+        types.push_back(csd_from_int(bins));
+
+    for (auto&& type : types) {
+        if (!selected("quantize"))
+            break;
+        auto s = measure([&] { quantize(hmmd.view(), type); });
+        report("quantize", input, bin_count(type), s, { small_pixels });
+    }
+    if (types.size() > 1 && selected("quantize/all")) {
+        auto s = measure([&] { quantize(hmmd.view(), types); });
+        report("quantize/all", input, 0, s, { small_pixels });
+    }
+
+    for (auto&& type : types) {
+        bool scan = selected("scan");
+        if (!selected("extract") && !scan)
+            break;
+
+        // The scan is not exposed, it is measured by the stage timers
+        stats::set_enabled(scan);
+        auto s = measure([&] { CSD desc{ view, type }; });
+        stats::set_enabled(false);
+
+        size_t bins = bin_count(type);
+        if (selected("extract"))
+            report("extract", input, bins, s, { pixels, true });
+        if (auto stage = stage_samples(s, stats::stage::scan))
+            report("scan", input, bins, *stage, { small_pixels, true });
+    }
+
+    for (auto&& type : types) {
+        if (!selected("compare"))
+            break;
+
+        CSD desc1{ view, type };
+        CSD desc2{ small.view(), type };
+        size_t bins = bin_count(type);
+        auto s = measure([&] { sink = sink + compare(desc1, desc2); });
+        report("compare", input, bins, s, { 0, true, bins });
+    }
+}
+
+void
+write_json(std::ostream& os)
+{
+    OStreamWrapper osw{ os };
+    PrettyWriter<OStreamWrapper> writer(osw);
+
+    writer.StartObject();
+    writer.Key("settings");
+    writer.StartObject();
+    writer.Key("warmup_seconds");
+    writer.Double(app.warmup);
+    writer.Key("min_time_seconds");
+    writer.Double(app.min_time);
+    writer.Key("repetitions");
+    writer.Uint64(app.repetitions);
+    writer.EndObject();
+
+    writer.Key("machine");
+    writer.StartObject();
+    writer.Key("hmmd_kernel");
+    writer.String(kernel_name(image_match::best_hmmd_kernel()));
+    writer.Key("cycles");
+#ifdef IMAGE_MATCH_BENCH_TSC
+    writer.String("tsc");
+#else
+    writer.Null();
+#endif
+    writer.Key("compiler");
+    writer.String(__VERSION__);
+    writer.EndObject();
+
+    writer.Key("results");
+    writer.StartArray();
+    for (auto&& r : results) {
+        writer.StartObject();
+        writer.Key("kernel");
+        writer.String(r.kernel.c_str());
+        writer.Key("image");
+        writer.String(r.image.c_str());
+        writer.Key("width");
+        writer.Uint64(r.width);
+        writer.Key("height");
+        writer.Uint64(r.height);
+        writer.Key("bins");
+        if (r.bins)
+            writer.Uint64(r.bins);
+        else
+            writer.Null();
+        writer.Key("iterations");
+        writer.Uint64(r.iterations);
+        writer.Key("repetitions");
+        writer.Uint64(r.repetitions);
+        for (auto&& [name, value] : { std::pair{ "ns_min", r.min },
+                                      { "ns_median", r.median },
+                                      { "ns_mean", r.mean },
+                                      { "ns_stddev", r.stddev } }) {
+            writer.Key(name);
+            writer.Double(value);
+        }
+        for (auto&& [name, value] :
+             { std::pair{ "ns_per_pixel", r.ns_per_pixel },
+               { "ns_per_descriptor", r.ns_per_descriptor },
+               { "cycles_per_bin", r.cycles_per_bin } }) {
+            writer.Key(name);
+            if (value)
+                writer.Double(*value);
+            else
+                writer.Null();
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    os << '\n';
+}
+
+void
+run()
+{
+#ifndef IMAGE_MATCH_STAGE_TIMERS
+    if (selected("scan"))
+        spdlog::warn("The stage timers are not compiled in, the scan is not "
+                     "measured.");
+#endif
+
+    if (app.json != "-")
+        std::printf("%-14s %-28s %11s %4s %12s %8s %10s %12s %10s\n",
+                    "kernel",
+                    "image",
+                    "size",
+                    "bins",
+                    "ns/op",
+                    "stddev",
+                    "ns/pixel",
+                    "ns/desc",
+                    "cycles/bin");
+
+    for (auto&& size : app.sizes) {
+        size_t height =
+          std::max<size_t>(STRUCTURING_ELEMENT_SIZE, size * 3 / 4);
+        bench_input input{ "synthetic", synthetic_image(size, height) };
+        spdlog::info("Synthetic {}x{}", size, height);
+        bench(input);
+    }
+
+    if (!app.images.empty()) {
+        size_t count = 0;
+        for (auto&& ip : image_match::get_image_paths(app.images)) {
+            if (count == app.max_images)
+                break;
+
+            bench_input input{ ip.filename().string(),
+                               image_match::image{ ip } };
+            if (!input.im) {
+                spdlog::warn("Error reading {}! {}. Skipping.",
+                             ip.string(),
+                             input.im.fail_msg());
+                continue;
+            }
+            spdlog::info("{}", ip.string());
+            bench(input);
+            ++count;
+        }
+    }
+
+    if (app.json == "-") {
+        write_json(std::cout);
+    } else if (!app.json.empty()) {
+        std::ofstream ofs{ app.json };
+        if (!ofs)
+            throw std::runtime_error("Can't open " + app.json + "!");
+        write_json(ofs);
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    CLI::App args("Microbenchmarks of the extraction and matching kernels.");
+
+    args.add_option("--sizes",
+                    app.sizes,
+                    "Widths of the synthetic 4:3 images. (default: 256 512 "
+                    "1024 2048)");
+
+    args.add_option(
+      "--images", app.images, "Directory of images to benchmark as well.")
+      ->check(CLI::ExistingDirectory);
+
+    args.add_option("--max-images",
+                    app.max_images,
+                    "Number of the images from the directory. (default: 4)");
+
+    args
+      .add_option("-t,--types",
+                  app.types,
+                  "Types of descriptor (32, 64, 128 or 256). (default: all)")
+      ->check(CLI::IsMember({ 32, 64, 128, 256 }));
+
+    args.add_option("--filter",
+                    app.filter,
+                    "Run only the kernels whose name contains the string.");
+
+    args.add_option("--warmup",
+                    app.warmup,
+                    "Seconds of warm-up of each benchmark. (default: 0.1)");
+
+    args.add_option("--min-time",
+                    app.min_time,
+                    "Minimal seconds of a repetition. (default: 0.02)");
+
+    args
+      .add_option("-r,--repetitions",
+                  app.repetitions,
+                  "Number of the repetitions. (default: 10)")
+      ->check(CLI::PositiveNumber);
+
+    args.add_option("--json",
+                    app.json,
+                    "Write the results as JSON to the file, - for stdout.");
+
+    bool quiet{ false };
+    args.add_flag("-q,--quiet", quiet, "Enable quiet mode.");
+
+    CLI11_PARSE(args, argc, argv);
+
+    spdlog::set_level(quiet || app.json == "-" ? spdlog::level::critical
+                                               : spdlog::level::info);
+
+    try {
+        run();
+    } catch (std::exception& e) {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "CLI/CLI.hpp"
+
+#include "image_match/csd.hpp"
+#include "image_match/image.hpp"
+
+using namespace std::filesystem;
+
+/// Sparse scan setting whose drift is measured.
+struct setting
+{
+    std::string name;
+    image_match::extraction_options options;
+
+    std::vector<image_match::CSD> descriptors{};
+    double seconds{ 0 };
+    double drift_sum{ 0 };
+    double drift_max{ 0 };
+};
+
+/// Global configuration of the tool.
+struct config
+{
+    path dataset;
+    unsigned int type{ 64 };
+    std::vector<size_t> strides{ 2, 3, 4 };
+    std::vector<double> samplings{ 0.5, 0.25, 0.1 };
+    std::uint64_t seed{ 0 };
+};
+
+config app;
+
+/**
+ * @brief Return the fraction of the images whose nearest exact descriptor is
+ * their own.
+ */
+double
+self_recall(const std::vector<image_match::CSD>& exact,
+            const std::vector<image_match::CSD>& approximate)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < approximate.size(); ++i) {
+        size_t best = 0;
+        float best_distance = std::numeric_limits<float>::infinity();
+        for (size_t j = 0; j < exact.size(); ++j) {
+            float distance = image_match::compare(approximate[i], exact[j]);
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = j;
+            }
+        }
+        found += best == i;
+    }
+
+    return approximate.empty() ? 0 : static_cast<double>(found) / exact.size();
+}
+
+void
+measure()
+{
+    using seconds = std::chrono::duration<double>;
+    auto type = image_match::csd_from_int(app.type);
+
+    std::vector<setting> settings;
+    settings.push_back({ "exact", {} });
+    for (auto&& stride : app.strides) {
+        image_match::extraction_options options;
+        options.stride = stride;
+        settings.push_back({ "stride " + std::to_string(stride), options });
+    }
+    for (auto&& sampling : app.samplings) {
+        image_match::extraction_options options;
+        options.sampling = sampling;
+        options.seed = app.seed;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "sampling %.3g", sampling);
+        settings.push_back({ name, options });
+    }
+
+    for (auto&& ip : image_match::get_image_paths(app.dataset)) {
+        image_match::image im{ ip };
+        if (!im) {
+            spdlog::warn(
+              "Error reading {}! {}. Skipping.", ip.string(), im.fail_msg());
+            continue;
+        }
+        spdlog::info("{}", ip.string());
+
+        for (auto&& s : settings) {
+            auto start = std::chrono::steady_clock::now();
+            s.descriptors.emplace_back(im.view(), type, s.options);
+            s.seconds +=
+              seconds(std::chrono::steady_clock::now() - start).count();
+        }
+
+        const auto& exact = settings.front().descriptors.back();
+        for (auto&& s : settings) {
+            double drift = image_match::compare(exact, s.descriptors.back());
+            s.drift_sum += drift;
+            s.drift_max = std::max(s.drift_max, drift);
+        }
+    }
+
+    size_t images = settings.front().descriptors.size();
+    if (images == 0)
+        throw std::runtime_error("No images found!");
+
+    const auto& exact = settings.front();
+    std::printf("%-16s %10s %10s %12s %8s %10s\n",
+                "setting",
+                "mean L1",
+                "max L1",
+                "ms/image",
+                "speedup",
+                "self top1");
+    for (auto&& s : settings)
+        std::printf("%-16s %10.4f %10.4f %12.3f %8.2f %10.3f\n",
+                    s.name.c_str(),
+                    s.drift_sum / images,
+                    s.drift_max,
+                    1000 * s.seconds / images,
+                    exact.seconds / s.seconds,
+                    self_recall(exact.descriptors, s.descriptors));
+}
+
+int
+main(int argc, char* argv[])
+{
+    CLI::App args("Measure the drift and the speedup of sparse CSD scans.");
+
+    args.add_option("dataset", app.dataset, "Directory containing images.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    args
+      .add_option("-t,--type",
+                  app.type,
+                  "Type of descriptor (32, 64, 128 or 256). (default: 64)")
+      ->check(CLI::IsMember({ 32, 64, 128, 256 }));
+
+    args.add_option(
+      "--strides", app.strides, "Strides to measure. (default: 2 3 4)");
+
+    args.add_option("--sampling",
+                    app.samplings,
+                    "Fractions of sampled positions to measure. (default: "
+                    "0.5 0.25 0.1)");
+
+    args.add_option("--seed", app.seed, "Seed of the sampling. (default: 0)");
+
+    bool quiet{ false };
+    args.add_flag("-q,--quiet", quiet, "Enable quiet mode.");
+
+    CLI11_PARSE(args, argc, argv);
+
+    spdlog::set_level(quiet ? spdlog::level::critical : spdlog::level::info);
+
+    try {
+        measure();
+    } catch (std::exception& e) {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,628 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "CLI/CLI.hpp"
+
+#include <rapidjson/document.h>
+#include <rapidjson/istreamwrapper.h>
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/writer.h>
+
+#include "image_match/csd.hpp"
+#include "image_match/hmmd.hpp"
+#include "image_match/image.hpp"
+#include "image_match/thread_pool.hpp"
+
+using namespace std::filesystem;
+using namespace rapidjson;
+using image_match::CSD;
+using image_match::CSDType;
+
+constexpr unsigned int GOLDEN_TYPES[] = { 32, 64, 128, 256 };
+
+/**
+ * @brief Options of the extraction recorded into a set of golden files.
+ *
+ * The stride and the sampling change the descriptors, so the paths using
+ * them are checked against golden files recorded with the same options.
+ */
+struct golden_set
+{
+    /// Subdirectory of the golden files, empty for the reference.
+    std::string name;
+    size_t stride;
+    double sampling;
+};
+
+const golden_set GOLDEN_SETS[] = { { "", 1, 1.0 },
+                                   { "stride2", 2, 1.0 },
+                                   { "sampling50", 1, 0.5 } };
+
+/// Global configuration of the tool.
+struct config
+{
+    path dataset;
+    path golden{ "golden" };
+    std::string filter;
+    size_t report_bins{ 8 };
+};
+
+config app;
+
+/// Raw counts of a descriptor as stored in the golden files.
+struct golden_entry
+{
+    std::uint64_t windows;
+    CSD::histogram counts;
+};
+
+/// Golden descriptors of one type, indexed by the path relative to the dataset.
+using golden_map = std::map<std::string, golden_entry>;
+
+/// Golden descriptors of all the types of a set.
+using golden_maps = std::vector<golden_map>;
+
+/**
+ * @brief Way of computing descriptors checked against the golden files.
+ *
+ * The tolerance is the largest allowed difference of a bin count. Exact
+ * paths declare 0, approximate kernels must declare how far they may drift.
+ * The number of windows must always match.
+ */
+struct extraction_path
+{
+    std::string name;
+    std::uint32_t tolerance;
+    std::function<std::vector<CSD>(const image_match::image_view&,
+                                   const std::vector<CSDType>&)>
+      extract;
+    /// Name of the golden_set the path is checked against.
+    std::string golden{};
+};
+
+/// Outcome of checking a path for a type.
+struct check_result
+{
+    size_t images{ 0 };
+    size_t failed{ 0 };
+    std::uint32_t max_difference{ 0 };
+};
+
+path
+golden_filename(const golden_set& set, unsigned int bins)
+{
+    return app.golden / set.name / ("csd_" + std::to_string(bins) + ".json");
+}
+
+std::vector<CSDType>
+golden_types()
+{
+    std::vector<CSDType> types;
+    for (auto&& bins : GOLDEN_TYPES)
+        types.push_back(image_match::csd_from_int(bins));
+
+    return types;
+}
+
+/// Compute the descriptors with the scalar reference implementation.
+std::vector<CSD>
+reference_descriptors(const image_match::image_view& im,
+                      const std::vector<CSDType>& types)
+{
+    image_match::extraction_options options;
+    options.hmmd = image_match::hmmd_kernel::scalar;
+
+    std::vector<CSD> descs;
+    for (auto&& type : types)
+        descs.emplace_back(im, type, options);
+
+    return descs;
+}
+
+/// Compute the descriptors of the set with the scalar HMMD conversion.
+std::vector<CSD>
+recorded_descriptors(const golden_set& set,
+                     const image_match::image_view& im,
+                     const std::vector<CSDType>& types)
+{
+    if (set.name.empty())
+        return reference_descriptors(im, types);
+
+    image_match::extraction_options options;
+    options.hmmd = image_match::hmmd_kernel::scalar;
+    options.stride = set.stride;
+    options.sampling = set.sampling;
+
+    return image_match::compute_descriptors(im, types, options);
+}
+
+/**
+ * @brief Call the function for every readable image of the dataset.
+ *
+ * The function receives the path of the image relative to the dataset, which
+ * identifies the image in the golden files.
+ */
+template<typename F>
+void
+for_each_image(F&& f)
+{
+    auto root = canonical(app.dataset);
+    for (auto&& ip : image_match::get_image_paths(root)) {
+        image_match::image im{ ip };
+        if (!im) {
+            spdlog::warn(
+              "Error reading {}! {}. Skipping.", ip.string(), im.fail_msg());
+            continue;
+        }
+
+        f(relative(ip, root).generic_string(), im.view());
+    }
+}
+
+void
+write_golden(const golden_set& set, unsigned int bins, const golden_map& golden)
+{
+    auto filename = golden_filename(set, bins);
+    std::ofstream ofs{ filename };
+    if (!ofs)
+        throw std::runtime_error("Can't open " + filename.string() + "!");
+
+    OStreamWrapper osw{ ofs };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartObject();
+    writer.Key("type");
+    writer.Uint(bins);
+    writer.Key("images");
+    writer.StartArray();
+    for (auto&& [name, entry] : golden) {
+        writer.StartObject();
+        writer.Key("path");
+        writer.String(name.c_str());
+        writer.Key("windows");
+        writer.Uint64(entry.windows);
+        writer.Key("counts");
+        writer.StartArray();
+        for (auto&& count : entry.counts)
+            writer.Uint(count);
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
+
+golden_map
+read_golden(const golden_set& set, unsigned int bins)
+{
+    auto filename = golden_filename(set, bins);
+    std::ifstream ifs{ filename };
+    if (!ifs)
+        throw std::runtime_error("Can't open " + filename.string() +
+                                 "! Record the golden files first.");
+
+    IStreamWrapper isw{ ifs };
+    Document doc;
+    doc.ParseStream(isw);
+    if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("type") ||
+        !doc["type"].IsUint() || doc["type"].GetUint() != bins ||
+        !doc.HasMember("images") || !doc["images"].IsArray())
+        throw std::runtime_error("Invalid golden file " + filename.string() +
+                                 "!");
+
+    golden_map golden;
+    for (auto&& e : doc["images"].GetArray()) {
+        if (!e.IsObject() || !e.HasMember("path") || !e["path"].IsString() ||
+            !e.HasMember("windows") || !e["windows"].IsUint64() ||
+            !e.HasMember("counts") || !e["counts"].IsArray() ||
+            e["counts"].Size() != bins)
+            throw std::runtime_error("Invalid entry in golden file " +
+                                     filename.string() + "!");
+
+        golden_entry entry{ e["windows"].GetUint64(), {} };
+        for (auto&& count : e["counts"].GetArray()) {
+            if (!count.IsUint())
+                throw std::runtime_error("Invalid count in golden file " +
+                                         filename.string() + "!");
+            entry.counts.push_back(count.GetUint());
+        }
+        golden.emplace(e["path"].GetString(), std::move(entry));
+    }
+
+    return golden;
+}
+
+void
+record()
+{
+    auto types = golden_types();
+    std::vector<golden_maps> golden(std::size(GOLDEN_SETS),
+                                    golden_maps(types.size()));
+
+    for_each_image([&](const std::string& name,
+                       const image_match::image_view& im) {
+        spdlog::info("{}", name);
+        for (size_t s = 0; s < golden.size(); ++s) {
+            auto descs = recorded_descriptors(GOLDEN_SETS[s], im, types);
+            for (size_t i = 0; i < types.size(); ++i)
+                golden[s][i].emplace(
+                  name, golden_entry{ descs[i].windows, descs[i].counts });
+        }
+    });
+
+    if (golden.front().front().empty())
+        throw std::runtime_error("No images found!");
+
+    for (size_t s = 0; s < golden.size(); ++s) {
+        create_directories(app.golden / GOLDEN_SETS[s].name);
+        for (size_t i = 0; i < types.size(); ++i)
+            write_golden(GOLDEN_SETS[s], GOLDEN_TYPES[i], golden[s][i]);
+    }
+
+    spdlog::info("Recorded {} images into {}",
+                 golden.front().front().size(),
+                 app.golden.string());
+}
+
+/// Sum the counts of the cells of a grid into the descriptor of the image.
+CSD
+sum_cells(const image_match::grid_descriptor& grid, CSDType type)
+{
+    CSD::histogram counts(image_match::bin_count(type), 0);
+    std::uint64_t windows = 0;
+    for (auto&& cell : grid.cells) {
+        std::transform(counts.begin(),
+                       counts.end(),
+                       cell.counts.begin(),
+                       counts.begin(),
+                       std::plus<>());
+        windows += cell.windows;
+    }
+
+    return CSD{ counts, windows, type };
+}
+
+/**
+ * @brief Return all the ways of computing a descriptor available here.
+ *
+ * The pools are used by the parallel paths and must outlive them.
+ */
+std::vector<extraction_path>
+make_paths(std::vector<std::unique_ptr<image_match::thread_pool>>& pools)
+{
+    using namespace image_match;
+    using types_t = std::vector<CSDType>;
+
+    std::vector<extraction_path> paths;
+    paths.push_back({ "reference", 0, reference_descriptors });
+
+    for (auto&& kernel : { hmmd_kernel::sse41, hmmd_kernel::avx2 }) {
+        if (!hmmd_kernel_available(kernel))
+            continue;
+
+        extraction_options options;
+        options.hmmd = kernel;
+        paths.push_back({ kernel == hmmd_kernel::sse41 ? "hmmd/sse41"
+                                                       : "hmmd/avx2",
+                          0,
+                          [options](const image_view& im, const types_t& ts) {
+                              std::vector<CSD> descs;
+                              for (auto&& type : ts)
+                                  descs.emplace_back(im, type, options);
+                              return descs;
+                          } });
+    }
+
+    paths.push_back(
+      { "automatic", 0, [](const image_view& im, const types_t& ts) {
+           std::vector<CSD> descs;
+           for (auto&& type : ts)
+               descs.emplace_back(im, type);
+           return descs;
+       } });
+
+    paths.push_back(
+      { "multi", 0, [](const image_view& im, const types_t& ts) {
+           return compute_descriptors(im, ts);
+       } });
+
+    for (size_t threads : { 2, 4 }) {
+        pools.push_back(std::make_unique<thread_pool>(threads));
+
+        extraction_options options;
+        options.pool = pools.back().get();
+        paths.push_back({ "pool/" + std::to_string(threads),
+                          0,
+                          [options](const image_view& im, const types_t& ts) {
+                              return compute_descriptors(im, ts, options);
+                          } });
+    }
+
+    paths.push_back(
+      { "partial/2x2", 0, [](const image_view& im, const types_t& ts) {
+           auto extent = window_extent(im.width(), im.height());
+           auto regions =
+             split_regions(extent,
+                           std::min<size_t>(2, extent.width),
+                           std::min<size_t>(2, extent.height));
+
+           std::vector<std::vector<partial_descriptor>> partials(ts.size());
+           for (auto&& crop : crop_regions(im, regions)) {
+               auto parts = compute_partial_descriptors(crop, ts);
+               for (size_t i = 0; i < ts.size(); ++i)
+                   partials[i].push_back(std::move(parts[i]));
+           }
+
+           std::vector<CSD> descs;
+           for (auto&& p : partials)
+               descs.push_back(merge(p));
+           return descs;
+       } });
+
+    paths.push_back(
+      { "grid/3x3", 0, [](const image_view& im, const types_t& ts) {
+           auto grids = compute_grid_descriptors(im, ts, 3, 3);
+
+           std::vector<CSD> descs;
+           for (size_t i = 0; i < ts.size(); ++i)
+               descs.push_back(sum_cells(grids[i], ts[i]));
+           return descs;
+       } });
+
+    paths.push_back(
+      { "integral", 0, [](const image_view& im, const types_t& ts) {
+           std::vector<CSD> descs;
+           for (auto&& type : ts) {
+               presence_integral integral{ im, type };
+               descs.push_back(integral.descriptor(integral.extent()));
+           }
+           return descs;
+       } });
+
+    // The approximate extraction is exact with respect to its own golden
+    // files, whichever kernel and pool computes it
+    for (auto&& set : GOLDEN_SETS) {
+        if (set.name.empty())
+            continue;
+
+        auto extract = [](const extraction_options& options) {
+            return [options](const image_view& im, const types_t& ts) {
+                return compute_descriptors(im, ts, options);
+            };
+        };
+
+        extraction_options options;
+        options.stride = set.stride;
+        options.sampling = set.sampling;
+        paths.push_back({ set.name, 0, extract(options), set.name });
+
+        options.pool = pools.back().get();
+        paths.push_back(
+          { set.name + "/pool", 0, extract(options), set.name });
+    }
+
+    // Databases store the normalized descriptors only
+    paths.push_back(
+      { "denormalize", 0, [](const image_view& im, const types_t& ts) {
+           std::vector<CSD> descs;
+           for (auto&& type : ts) {
+               CSD desc{ im, type };
+               descs.push_back(denormalize(desc.data, desc.windows, type));
+           }
+           return descs;
+       } });
+
+    return paths;
+}
+
+/// Return true if the descriptor matches the golden one, report it otherwise.
+bool
+compare_entry(const extraction_path& p,
+              unsigned int bins,
+              const std::string& name,
+              const golden_entry& golden,
+              const CSD& desc,
+              check_result& result)
+{
+    if (desc.windows != golden.windows ||
+        desc.counts.size() != golden.counts.size()) {
+        std::printf("FAIL %s %u %s: %llu windows, golden %llu\n",
+                    p.name.c_str(),
+                    bins,
+                    name.c_str(),
+                    static_cast<unsigned long long>(desc.windows),
+                    static_cast<unsigned long long>(golden.windows));
+        return false;
+    }
+
+    std::vector<size_t> differing;
+    std::uint32_t max_difference = 0;
+    for (size_t b = 0; b < golden.counts.size(); ++b) {
+        std::uint32_t difference = desc.counts[b] > golden.counts[b]
+                                     ? desc.counts[b] - golden.counts[b]
+                                     : golden.counts[b] - desc.counts[b];
+        if (difference > 0)
+            differing.push_back(b);
+        max_difference = std::max(max_difference, difference);
+    }
+    result.max_difference = std::max(result.max_difference, max_difference);
+
+    if (differing.empty())
+        return true;
+
+    bool within = max_difference <= p.tolerance;
+    std::printf("%s %s %u %s: %zu bins differ, max difference %u, "
+                "tolerance %u\n",
+                within ? "DIFF" : "FAIL",
+                p.name.c_str(),
+                bins,
+                name.c_str(),
+                differing.size(),
+                max_difference,
+                p.tolerance);
+    for (size_t i = 0; i < std::min(differing.size(), app.report_bins); ++i) {
+        size_t b = differing[i];
+        std::printf("    bin %3zu: %u, golden %u\n",
+                    b,
+                    desc.counts[b],
+                    golden.counts[b]);
+    }
+
+    return within;
+}
+
+/// Return true if all the paths match the golden files.
+bool
+check()
+{
+    auto types = golden_types();
+    std::map<std::string, golden_maps> golden;
+    for (auto&& set : GOLDEN_SETS)
+        for (auto&& bins : GOLDEN_TYPES)
+            golden[set.name].push_back(read_golden(set, bins));
+    const auto& reference = golden.at("");
+
+    std::vector<std::unique_ptr<image_match::thread_pool>> pools;
+    auto paths = make_paths(pools);
+    paths.erase(std::remove_if(paths.begin(),
+                               paths.end(),
+                               [](const extraction_path& p) {
+                                   return p.name.find(app.filter) ==
+                                          std::string::npos;
+                               }),
+                paths.end());
+    if (paths.empty())
+        throw std::runtime_error("No path matches the filter!");
+
+    std::vector<std::vector<check_result>> results(
+      paths.size(), std::vector<check_result>(types.size()));
+    bool passed = true;
+    size_t checked = 0;
+
+    for_each_image([&](const std::string& name,
+                       const image_match::image_view& im) {
+        if (reference.front().count(name) == 0) {
+            std::printf("FAIL %s: not in the golden files\n", name.c_str());
+            passed = false;
+            return;
+        }
+        spdlog::info("{}", name);
+        ++checked;
+
+        for (size_t j = 0; j < paths.size(); ++j) {
+            const auto& expected = golden.at(paths[j].golden);
+            auto descs = paths[j].extract(im, types);
+            for (size_t i = 0; i < types.size(); ++i) {
+                auto& result = results[j][i];
+                ++result.images;
+                auto entry = expected[i].find(name);
+                if (entry == expected[i].end()) {
+                    std::printf("FAIL %s %u %s: not in the golden files\n",
+                                paths[j].name.c_str(),
+                                GOLDEN_TYPES[i],
+                                name.c_str());
+                    ++result.failed;
+                    passed = false;
+                } else if (!compare_entry(paths[j],
+                                          GOLDEN_TYPES[i],
+                                          name,
+                                          entry->second,
+                                          descs[i],
+                                          result)) {
+                    ++result.failed;
+                    passed = false;
+                }
+            }
+        }
+    });
+
+    if (checked != reference.front().size()) {
+        std::printf("FAIL %zu golden images were not checked\n",
+                    reference.front().size() - checked);
+        passed = false;
+    }
+
+    std::printf("\n%-16s %5s %8s %8s %10s %10s\n",
+                "path",
+                "bins",
+                "images",
+                "failed",
+                "max diff",
+                "tolerance");
+    for (size_t j = 0; j < paths.size(); ++j)
+        for (size_t i = 0; i < types.size(); ++i)
+            std::printf("%-16s %5u %8zu %8zu %10u %10u\n",
+                        paths[j].name.c_str(),
+                        GOLDEN_TYPES[i],
+                        results[j][i].images,
+                        results[j][i].failed,
+                        results[j][i].max_difference,
+                        paths[j].tolerance);
+
+    std::printf("%s\n", passed ? "PASSED" : "FAILED");
+    return passed;
+}
+
+int
+main(int argc, char* argv[])
+{
+    CLI::App args("Check the descriptors of all the extraction paths against "
+                  "golden descriptors of the reference implementation.");
+    args.require_subcommand(1);
+
+    bool quiet{ false };
+
+    auto record_sub = args.add_subcommand(
+      "record", "Record the golden descriptors of all the types.");
+    auto check_sub = args.add_subcommand(
+      "check", "Check all the extraction paths against the golden files.");
+
+    for (auto&& cmd : { record_sub, check_sub }) {
+        cmd->add_option("dataset", app.dataset, "Directory containing images.")
+          ->required()
+          ->check(CLI::ExistingDirectory);
+        cmd->add_option(
+          "-g,--golden",
+          app.golden,
+          "Directory of the golden files. (default: golden)");
+        cmd->add_flag("-q,--quiet", quiet, "Enable quiet mode.");
+    }
+
+    check_sub->add_option(
+      "--filter", app.filter, "Check only the paths containing the string.");
+    check_sub->add_option(
+      "--bins",
+      app.report_bins,
+      "Number of the differing bins listed per image. (default: 8)");
+
+    args.add_flag("-q,--quiet", quiet, "Enable quiet mode.");
+
+    CLI11_PARSE(args, argc, argv);
+
+    spdlog::set_level(quiet ? spdlog::level::critical : spdlog::level::info);
+
+    try {
+        if (*record_sub) {
+            record();
+        } else if (!check()) {
+            return EXIT_FAILURE;
+        }
+    } catch (std::exception& e) {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
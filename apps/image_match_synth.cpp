@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "CLI/CLI.hpp"
+
+#include <rapidjson/document.h>
+#include <rapidjson/istreamwrapper.h>
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/writer.h>
+
+#include "image_match/csd.hpp"
+#include "image_match/image.hpp"
+
+using namespace std::filesystem;
+using namespace rapidjson;
+
+/// Global configuration of the tool.
+struct config
+{
+    path model;
+    path output;
+    size_t count{ 100000 };
+    size_t grid{ 0 };
+    double duplicates{ 0 };
+    size_t cluster_size{ 10 };
+    double noise{ 0.05 };
+    std::uint64_t seed{ 0 };
+};
+
+config app;
+
+/**
+ * @brief Statistics of the descriptors of a database.
+ *
+ * The descriptors are sampled bin by bin: the number of the nonzero bins is
+ * drawn from the numbers observed in the database, the bins are chosen with
+ * the frequencies they are nonzero with and their values are drawn from the
+ * values observed in each bin. The sampled descriptors thus share the
+ * sparsity of the database and its mass on the dominant bins, although the
+ * correlations between the bins are lost.
+ */
+struct descriptor_model
+{
+    size_t bins{ 0 };
+    std::vector<size_t> active;   ///< Numbers of the nonzero bins.
+    std::vector<double> presence; ///< Frequencies of the nonzero bins.
+    /// Sorted nonzero values observed in each bin.
+    std::vector<std::vector<float>> values;
+    /// Dimensions of the images of the database.
+    std::vector<image_match::image_info> sizes;
+};
+
+descriptor_model
+learn_model(const path& db_file)
+{
+    spdlog::info("Learning descriptor statistics from {} ...",
+                 db_file.string());
+
+    std::ifstream ifs{ db_file };
+    if (!ifs)
+        throw std::runtime_error("File read error! Could not read database!");
+
+    IStreamWrapper isw{ ifs };
+    Document doc;
+    doc.ParseStream(isw);
+    if (doc.HasParseError() || !doc.IsArray() || doc.Empty())
+        throw std::runtime_error("Invalid database file! (not an array)");
+
+    descriptor_model model;
+    for (auto&& entry : doc.GetArray()) {
+        if (!entry.IsObject() || !entry.HasMember("descriptor") ||
+            !entry["descriptor"].IsArray())
+            throw std::runtime_error("Invalid database file! (invalid entry)");
+
+        auto desc = entry["descriptor"].GetArray();
+        if (model.bins == 0) {
+            model.bins = desc.Size();
+            image_match::csd_from_int(model.bins);
+            model.presence.assign(model.bins, 0);
+            model.values.resize(model.bins);
+        }
+        if (desc.Size() != model.bins)
+            throw std::runtime_error("Invalid database file! (invalid entry)");
+
+        size_t active = 0;
+        for (size_t b = 0; b < model.bins; ++b) {
+            if (!desc[b].IsNumber())
+                throw std::runtime_error(
+                  "Invalid database file! (invalid entry)");
+
+            float v = desc[b].GetFloat();
+            if (v > 0) {
+                ++active;
+                model.presence[b] += 1;
+                model.values[b].push_back(v);
+            }
+        }
+        model.active.push_back(active);
+
+        image_match::image_info info;
+        if (entry.HasMember("width") && entry["width"].IsUint64() &&
+            entry.HasMember("height") && entry["height"].IsUint64()) {
+            info.width = entry["width"].GetUint64();
+            info.height = entry["height"].GetUint64();
+            info.channels = entry.HasMember("channels") &&
+                                entry["channels"].IsUint64()
+                              ? entry["channels"].GetUint64()
+                              : 3;
+            model.sizes.push_back(info);
+        }
+    }
+
+    for (auto&& p : model.presence)
+        p /= model.active.size();
+    for (auto&& v : model.values)
+        std::sort(v.begin(), v.end());
+    if (model.sizes.empty())
+        model.sizes.push_back({ 320, 240, 3 });
+
+    spdlog::info("Learned {} bin statistics from {} descriptors",
+                 model.bins,
+                 model.active.size());
+
+    return model;
+}
+
+/// Sample a descriptor following the statistics of the model.
+image_match::CSD::descriptor
+sample_descriptor(const descriptor_model& model, std::mt19937_64& rng)
+{
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::uniform_int_distribution<size_t> pick(0, model.active.size() - 1);
+
+    // Weighted choice of the nonzero bins without replacement, the bins
+    // with the largest u^(1 / presence) are chosen
+    std::vector<std::pair<double, size_t>> keys;
+    for (size_t b = 0; b < model.bins; ++b)
+        if (model.presence[b] > 0)
+            keys.push_back(
+              { std::pow(uniform(rng), 1 / model.presence[b]), b });
+
+    size_t active = std::min(model.active[pick(rng)], keys.size());
+    std::partial_sort(keys.begin(),
+                      keys.begin() + active,
+                      keys.end(),
+                      std::greater<>());
+
+    image_match::CSD::descriptor desc(model.bins, 0);
+    for (size_t i = 0; i < active; ++i) {
+        // Inverse of the empirical distribution, interpolated
+        const auto& values = model.values[keys[i].second];
+        double pos = uniform(rng) * (values.size() - 1);
+        size_t j = static_cast<size_t>(pos);
+        size_t k = std::min(j + 1, values.size() - 1);
+        desc[keys[i].second] =
+          static_cast<float>(values[j] + (pos - j) * (values[k] - values[j]));
+    }
+
+    return desc;
+}
+
+/// Descriptors of an entry, the cells row by row of a grid entry.
+using entry_descriptors = std::vector<image_match::CSD::descriptor>;
+
+/// Sample the descriptors of an entry, a single one unless in grid mode.
+entry_descriptors
+sample_entry(const descriptor_model& model, std::mt19937_64& rng)
+{
+    entry_descriptors descs(app.grid ? app.grid * app.grid : 1);
+    for (auto&& desc : descs)
+        desc = sample_descriptor(model, rng);
+
+    return descs;
+}
+
+/// Perturb the nonzero bins of the descriptors by relative gaussian noise.
+entry_descriptors
+near_duplicate(const entry_descriptors& descs, std::mt19937_64& rng)
+{
+    std::normal_distribution<double> normal(0, app.noise);
+
+    auto dup = descs;
+    for (auto&& desc : dup)
+        for (auto&& v : desc)
+            if (v > 0)
+                v = static_cast<float>(
+                  std::clamp(v * (1 + normal(rng)), 0.0, 1.0));
+
+    return dup;
+}
+
+/// Entry which further near-duplicates may be derived from.
+struct open_cluster
+{
+    size_t id;
+    entry_descriptors descs;
+    image_match::image_info info;
+    size_t members;
+};
+
+/// Maximal number of the clusters near-duplicates are added to at once.
+constexpr size_t OPEN_CLUSTERS = 4096;
+
+template<typename W>
+void
+write_descriptor(W& writer, const image_match::CSD::descriptor& desc)
+{
+    writer.StartArray();
+    for (auto&& v : desc)
+        writer.Double(v);
+    writer.EndArray();
+}
+
+/**
+ * @brief Write the cells of a grid entry.
+ *
+ * The cells are rounded to the counts of their windows, so they can be
+ * merged as in a generated database.
+ */
+template<typename W>
+void
+write_cells(W& writer,
+            const entry_descriptors& cells,
+            const image_match::image_info& info)
+{
+    auto type = image_match::csd_from_int(cells.front().size());
+    auto extent = image_match::window_extent(info.width, info.height);
+    size_t grid = std::min({ app.grid, extent.width, extent.height });
+    auto regions = image_match::split_regions(extent, grid, grid);
+
+    writer.StartArray();
+    for (size_t i = 0; i < app.grid * app.grid; ++i) {
+        // Cells beyond the positions of a small image stay empty
+        size_t column = i % app.grid;
+        size_t row = i / app.grid;
+        std::uint64_t windows = 0;
+        if (column < grid && row < grid)
+            windows = regions[row * grid + column].area();
+
+        auto cell = image_match::denormalize(cells[i], windows, type);
+
+        writer.StartObject();
+        writer.Key("windows");
+        writer.Uint64(windows);
+        writer.Key("descriptor");
+        write_descriptor(writer, cell.data);
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+void
+generate(const descriptor_model& model)
+{
+    std::ostringstream name;
+    name << "csd_" << model.bins;
+    if (app.grid)
+        name << "_grid" << app.grid;
+    name << ".json";
+
+    create_directories(app.output);
+    auto db_file = app.output / name.str();
+    std::ofstream ofs{ db_file };
+    if (!ofs)
+        throw std::runtime_error("File write error! Could not write database!");
+
+    spdlog::info("Writing {} synthetic descriptors to {} ...",
+                 app.count,
+                 db_file.string());
+
+    std::mt19937_64 rng{ app.seed };
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::uniform_int_distribution<size_t> pick_size(0, model.sizes.size() - 1);
+
+    // The paths name the cluster and the member, originals are member 0
+    auto root = absolute(app.output / "synthetic").lexically_normal();
+
+    OStreamWrapper osw{ ofs };
+    Writer<OStreamWrapper> writer(osw);
+    writer.StartArray();
+
+    std::vector<open_cluster> clusters;
+    size_t next_cluster = 0;
+    for (size_t i = 0; i < app.count; ++i) {
+        if (i % 1000000 == 0 && i)
+            spdlog::info("{} descriptors written", i);
+
+        // Near-duplicate grid entries perturb every cell of the original
+        size_t cluster, member;
+        entry_descriptors descs;
+        image_match::image_info info;
+        if (!clusters.empty() && uniform(rng) < app.duplicates) {
+            size_t c = static_cast<size_t>(uniform(rng) * clusters.size());
+            auto& open = clusters[c];
+            cluster = open.id;
+            member = open.members++;
+            descs = near_duplicate(open.descs, rng);
+            info = open.info;
+
+            if (open.members == app.cluster_size) {
+                std::swap(open, clusters.back());
+                clusters.pop_back();
+            }
+        } else {
+            cluster = next_cluster++;
+            member = 0;
+            descs = sample_entry(model, rng);
+            info = model.sizes[pick_size(rng)];
+
+            if (app.duplicates > 0 && app.cluster_size > 1) {
+                open_cluster open{ cluster, descs, info, 1 };
+                if (clusters.size() < OPEN_CLUSTERS)
+                    clusters.push_back(std::move(open));
+                else
+                    clusters[static_cast<size_t>(uniform(rng) *
+                                                 OPEN_CLUSTERS)] =
+                      std::move(open);
+            }
+        }
+
+        auto p = root / (std::to_string(cluster) + "-" +
+                         std::to_string(member) + ".jpg");
+
+        writer.StartObject();
+        writer.Key("path");
+        writer.String(p.string().c_str());
+        writer.Key("width");
+        writer.Uint64(info.width);
+        writer.Key("height");
+        writer.Uint64(info.height);
+        writer.Key("channels");
+        writer.Uint64(info.channels);
+        if (app.grid) {
+            writer.Key("grid");
+            writer.Uint64(app.grid);
+            writer.Key("cells");
+            write_cells(writer, descs, info);
+        } else {
+            writer.Key("descriptor");
+            write_descriptor(writer, descs.front());
+        }
+        writer.EndObject();
+    }
+
+    writer.EndArray();
+    spdlog::info("Database saved successfully.");
+}
+
+int
+main(int argc, char* argv[])
+{
+    CLI::App args("Generate synthetic descriptor databases for load testing.");
+
+    args
+      .add_option("model",
+                  app.model,
+                  "Database whose descriptor statistics are mimicked.")
+      ->required()
+      ->check(CLI::ExistingFile);
+
+    args
+      .add_option("output",
+                  app.output,
+                  "Directory to write the synthetic database into.")
+      ->required();
+
+    args.add_option("-c,--count",
+                    app.count,
+                    "Number of descriptors to generate. (default: 100000)");
+
+    args
+      .add_option("--grid",
+                  app.grid,
+                  "Generate a database of N x N grid descriptors instead.")
+      ->check(CLI::Range(1, 16));
+
+    args
+      .add_option("--duplicates",
+                  app.duplicates,
+                  "Fraction of the descriptors which are near-duplicates of "
+                  "another one. (default: 0)")
+      ->check(CLI::Range(0.0, 1.0));
+
+    args
+      .add_option("--cluster-size",
+                  app.cluster_size,
+                  "Maximal number of descriptors in a cluster of "
+                  "near-duplicates. (default: 10)")
+      ->check(CLI::PositiveNumber);
+
+    args
+      .add_option("--noise",
+                  app.noise,
+                  "Relative deviation of the bins of a near-duplicate. "
+                  "(default: 0.05)")
+      ->check(CLI::NonNegativeNumber);
+
+    args.add_option("--seed", app.seed, "Seed of the generator. (default: 0)");
+
+    bool quiet{ false };
+    args.add_flag("-q,--quiet", quiet, "Enable quiet mode.");
+
+    CLI11_PARSE(args, argc, argv);
+
+    spdlog::set_level(quiet ? spdlog::level::critical : spdlog::level::info);
+
+    try {
+        generate(learn_model(app.model));
+    } catch (std::exception& e) {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -64,7 +64,7 @@
  *  +----------+-------+-------+-------+-------+------+------+------+------+
  *  |        3 |    16 |     4 |     8 |     4 |    8 |    2 |    4 |    1 |
  *  +----------+-------+-------+-------+-------+------+------+------+------+
- *  |        5 |    16 |     4 |     8 |     4 |    8 |    1 |    4 |    1 |
+ *  |        4 |    16 |     4 |     8 |     4 |    8 |    1 |    4 |    1 |
  *  +----------+-------+-------+-------+-------+------+------+------+------+
  *
  *
@@ -85,8 +85,11 @@
 #ifndef _IMAGE_MATCH_CSD_GUARD
 #define _IMAGE_MATCH_CSD_GUARD
 
+#include <cstdint>
+#include <utility>
 #include <vector>
 
+#include "image_match/hmmd.hpp"
 #include "image_match/image.hpp"
 
 namespace image_match {
@@ -110,21 +113,456 @@ enum CSDType
 CSDType
 csd_from_int(int);
 
-/// Color structure descriptor
+/// Return the number of bins of the CSDType.
+size_t
+bin_count(CSDType type);
+
+/**
+ * @brief Return the exponent p of the subsampling factor 2^p of an image.
+ *
+ * The descriptor of an image of the given dimensions is computed from the
+ * image subsampled by subsampled_shift with this shift.
+ */
+std::uint32_t
+compute_subsample_shift(size_t width, size_t height);
+
+/// Map of quantized HMMD colors, one bin index per pixel.
+using quantized_map = std::vector<std::vector<std::uint8_t>>;
+
+/**
+ * @brief Quantize an image in HMMD color space.
+ *
+ * Each pixel of the image is assigned the index of its bin according to the
+ * quantization defined for the given CSDType.
+ *
+ * A single channel image is treated as a grayscale image holding luminance
+ * (not converted to HMMD). Its pixels have zero hue and diff and sum equal to
+ * the luminance, so they are binned through a lookup table. The result is
+ * identical to quantizing the same image with three identical RGB channels
+ * converted to HMMD.
+ */
+quantized_map
+quantize(const image_view& im, CSDType type);
+
+/**
+ * @brief Quantize an image for several CSDTypes in a single pass.
+ *
+ * Equivalent to quantizing the image for each of the types separately, but
+ * the image is traversed only once. The maps are returned in the order of
+ * the given types.
+ */
+std::vector<quantized_map>
+quantize(const image_view& im, const std::vector<CSDType>& types);
+
+class thread_pool;
+
+/// Options of the descriptor extraction.
+struct extraction_options
+{
+    /**
+     * Pool processing horizontal bands of the image in parallel. The
+     * extraction runs on the calling thread if null. The pool must not be the
+     * one executing the extraction itself.
+     */
+    thread_pool* pool{ nullptr };
+
+    /**
+     * Evaluate the structuring element only at every stride-th position in
+     * both directions. The descriptor is normalized by the number of the
+     * evaluated positions, so each bin estimates the exact fraction.
+     */
+    size_t stride{ 1 };
+
+    /**
+     * Fraction of the positions evaluated, in (0, 1]. The positions are
+     * chosen by a hash of their coordinates and the seed, so the result
+     * is deterministic and independent of the pool.
+     */
+    double sampling{ 1.0 };
+    std::uint64_t seed{ 0 };
+
+    /// Kernel of the HMMD conversion, all the kernels give the same result.
+    hmmd_kernel hmmd{ hmmd_kernel::automatic };
+};
+
+/**
+ * @brief Color structure descriptor
+ *
+ * Each bin holds the fraction of the structuring element positions (windows)
+ * containing a color of the bin. Descriptors computed from an image also keep
+ * the raw counts of the windows, so they can be merged and normalized again.
+ */
 struct CSD
 {
     using descriptor = std::vector<float>;
+    using histogram = std::vector<std::uint32_t>;
 
     CSDType type;
     descriptor data;
 
+    /// Number of windows containing each bin, empty if not known.
+    histogram counts;
+    /// Number of windows the counts were taken from, 0 if not known.
+    std::uint64_t windows{ 0 };
+
     CSD(const image& im, CSDType type);
+    CSD(const image_view& im,
+        CSDType type,
+        const extraction_options& options = {});
     CSD(const descriptor& desc, CSDType type);
+
+    /// Construct normalized descriptor from raw counts.
+    CSD(const histogram& counts, std::uint64_t windows, CSDType type);
+};
+
+/**
+ * @brief Divide the counts by the number of windows.
+ *
+ * The quotients are computed in double precision, so each bin is the
+ * correctly rounded fraction. Throws std::invalid_argument if windows is 0.
+ */
+CSD::descriptor
+normalize(const CSD::histogram& counts, std::uint64_t windows);
+
+/**
+ * @brief Restore the raw counts of a normalized descriptor.
+ *
+ * The counts are recovered exactly from the correctly rounded fractions as
+ * long as windows is below 2^24. Returns empty_descriptor if windows is 0.
+ */
+CSD
+denormalize(const CSD::descriptor& desc, std::uint64_t windows, CSDType type);
+
+/// Return a descriptor of no windows, with all the bins and counts zero.
+CSD
+empty_descriptor(CSDType type);
+
+/**
+ * @brief Merge descriptors computed from disjoint sets of windows.
+ *
+ * The counts and the windows are summed and normalized again. The result is
+ * identical to a descriptor computed from all the windows at once.
+ *
+ * Throws std::invalid_argument if the types differ or any of the descriptors
+ * does not hold the raw counts and std::overflow_error if the counts do not
+ * fit into 32 bits.
+ */
+CSD
+merge(const CSD& desc1, const CSD& desc2);
+
+/**
+ * @brief Compute descriptors of several types from a single image.
+ *
+ * The subsampling and the HMMD conversion are shared by all the descriptors
+ * and the quantization and the scan are done in a single pass over the image
+ * for all the types. The result is identical to constructing the descriptors
+ * one by one. The descriptors are returned in the order of the given types.
+ *
+ * With a thread pool in the options, the subsampled image is split into
+ * horizontal bands of structuring element positions. Each band is converted,
+ * quantized and scanned by a single task together with the rows of the next
+ * band covered by its structuring elements. The bands produce integer counts
+ * which are summed, so the result does not depend on the number of bands.
+ */
+std::vector<CSD>
+compute_descriptors(const image_view& im,
+                    const std::vector<CSDType>& types,
+                    const extraction_options& options = {});
+
+/**
+ * @brief Rectangle of structuring element positions.
+ *
+ * The positions are the top left corners of the structuring element in the
+ * subsampled image the descriptor is computed from. A region reads the pixels
+ * of the rectangle extended by STRUCTURING_ELEMENT_SIZE - 1 to the right and
+ * to the bottom.
+ */
+struct window_region
+{
+    size_t x{ 0 };
+    size_t y{ 0 };
+    size_t width{ 0 };
+    size_t height{ 0 };
+
+    /// Return the number of positions within the region.
+    std::uint64_t area() const;
+    /// Return true if the regions share a position.
+    bool overlaps(const window_region& other) const;
+
+    bool operator==(const window_region& other) const;
+    bool operator!=(const window_region& other) const;
 };
 
+/**
+ * @brief Bin counts of the structuring elements within a region of an image.
+ *
+ * Partial descriptors of regions covering all the positions of an image can
+ * be merged into the descriptor of the whole image.
+ */
+struct partial_descriptor
+{
+    CSDType type;
+    CSD::histogram counts;
+    /// All the positions of the image, as returned by window_extent.
+    window_region extent;
+    /// Positions the counts were taken from.
+    window_region region;
+};
+
+/**
+ * @brief Return all the structuring element positions of an image.
+ *
+ * Only the dimensions of the image are needed, so the regions can be planned
+ * without decoding the image.
+ */
+window_region
+window_extent(size_t width, size_t height);
+
+/**
+ * @brief Split the region into a grid of disjoint regions covering it.
+ *
+ * The regions are returned row by row. Throws std::invalid_argument if the
+ * grid is empty or has more columns or rows than the region.
+ */
+std::vector<window_region>
+split_regions(const window_region& extent, size_t columns, size_t rows);
+
+/**
+ * @brief Subsampled pixels covered by the structuring elements of a region.
+ *
+ * A crop holds everything needed for the partial descriptors of its region,
+ * so they can be computed without decoding or holding the whole image.
+ */
+struct region_crop
+{
+    /// The region.width + STRUCTURING_ELEMENT_SIZE - 1 by region.height +
+    /// STRUCTURING_ELEMENT_SIZE - 1 subsampled pixels from the region origin.
+    image pixels;
+    /// Positions of the crop within the window_extent of the image.
+    window_region region;
+    size_t width;  ///< Width of the whole image.
+    size_t height; ///< Height of the whole image.
+};
+
+/**
+ * @brief Crop the pixels covered by each of the regions.
+ *
+ * The whole image is subsampled once, since the subsampling filter reaches
+ * across region boundaries, and the crops are copied from the subsampled
+ * image. The crops are returned in the order of the regions.
+ *
+ * Throws std::invalid_argument if a region is empty or lies outside of the
+ * window_extent of the image.
+ */
+std::vector<region_crop>
+crop_regions(const image_view& im, const std::vector<window_region>& regions);
+
+/**
+ * @brief Compute partial descriptors of the region of a crop.
+ *
+ * Only the pixels of the crop are converted, quantized and scanned. The
+ * stride and the sampling of the options are ignored, all the positions of
+ * the region are evaluated.
+ *
+ * Throws std::invalid_argument if the region is empty, lies outside of the
+ * window_extent of the image or the pixels don't match its size.
+ */
+std::vector<partial_descriptor>
+compute_partial_descriptors(const region_crop& crop,
+                            const std::vector<CSDType>& types,
+                            const extraction_options& options = {});
+
+/**
+ * @brief Compute partial descriptors of a region of the image.
+ *
+ * Same as cropping the region by crop_regions and computing the partial
+ * descriptors of the crop. To compute several regions of an image, crop all
+ * of them at once, so that the image is subsampled only once.
+ */
+std::vector<partial_descriptor>
+compute_partial_descriptors(const image_view& im,
+                            const std::vector<CSDType>& types,
+                            const window_region& region,
+                            const extraction_options& options = {});
+
+/**
+ * @brief Merge partial descriptors into the descriptor of the whole image.
+ *
+ * The counts are summed, so the result is identical to the descriptor
+ * computed from the whole image at once. Throws std::invalid_argument unless
+ * the partials are of the same type and image and their regions are disjoint
+ * and cover the whole extent.
+ */
+CSD
+merge(const std::vector<partial_descriptor>& partials);
+
+/**
+ * @brief Descriptors of the cells of a grid laid over the image.
+ *
+ * The cells are the regions returned by split_regions for the window_extent
+ * of the image, each descriptor is identical to the partial descriptor of
+ * its region. A cell of an image with fewer positions than the grid may be
+ * an empty_descriptor.
+ */
+struct grid_descriptor
+{
+    size_t columns;
+    size_t rows;
+    std::vector<CSD> cells; ///< Row by row.
+};
+
+/**
+ * @brief Compute grid descriptors of several types in a single scan.
+ *
+ * Each structuring element position is counted into the histogram of its
+ * cell, so the grid costs about the same as a single descriptor.
+ *
+ * Throws std::invalid_argument if the grid is empty.
+ */
+std::vector<grid_descriptor>
+compute_grid_descriptors(const image_view& im,
+                         const std::vector<CSDType>& types,
+                         size_t columns,
+                         size_t rows,
+                         const extraction_options& options = {});
+
+/**
+ * @brief Bin counts of all the rectangles of structuring element positions.
+ *
+ * For every bin, the numbers of positions whose structuring element contains
+ * the bin are summed over all the rectangles anchored at the top left corner
+ * of the image. The counts of any rectangle, and thus its descriptor, are
+ * then obtained from four of the sums in O(bins).
+ *
+ * The sums take 4 * bins * (width + 1) * (height + 1) bytes for the
+ * window_extent of the image, up to about 130 MB for Bin256.
+ */
+class presence_integral
+{
+  public:
+    presence_integral(const image_view& im, CSDType type);
+
+    CSDType type() const { return type_; }
+    /// Return all the structuring element positions of the image.
+    const window_region& extent() const { return extent_; }
+
+    /**
+     * @brief Return the descriptor of the region.
+     *
+     * The result is identical to the partial descriptor of the region merged
+     * on its own. Throws std::invalid_argument if the region is empty or
+     * lies outside of the extent.
+     */
+    CSD descriptor(const window_region& region) const;
+
+    /// Store the counts of the region, which must lie within the extent.
+    void counts(const window_region& region, CSD::histogram& counts) const;
+
+  private:
+    CSDType type_;
+    window_region extent_;
+    /// Sums for each corner, row by row, each holding all the bins.
+    std::vector<std::uint32_t> sums_;
+};
+
+/// Parameters of a template search.
+struct template_search
+{
+    /**
+     * Width and height of the searched regions in structuring element
+     * positions. If empty, squares from an eighth of the shorter side of the
+     * image up to the whole side are searched.
+     */
+    std::vector<std::pair<size_t, size_t>> sizes;
+    /// Distance between the neighbouring searched regions.
+    size_t step{ 1 };
+    /// Maximal number of returned regions.
+    size_t count{ 1 };
+};
+
+/// Region of an image and its distance from the template.
+struct region_match
+{
+    float distance;
+    window_region region;
+};
+
+/**
+ * @brief Find the regions of the image most similar to the template.
+ *
+ * Every region of the searched sizes is compared against the descriptor of
+ * the template. The best regions are returned ordered by increasing distance,
+ * leaving out the regions overlapping a better one.
+ *
+ * Throws std::invalid_argument if the types differ.
+ */
+std::vector<region_match>
+find_template(const presence_integral& integral,
+              const CSD& templ,
+              const template_search& search = {});
+
+/// Ways of merging bins when converting a descriptor to fewer bins.
+enum class bin_merge
+{
+    sum, ///< Sum of the unified bins, the MPEG-7 bin unification.
+    max  ///< Maximum of the unified bins.
+};
+
+/**
+ * @brief Convert a descriptor to a type with fewer bins.
+ *
+ * The quantizations are nested, every bin of a finer quantization lies
+ * within a single bin of any coarser one. The converted descriptor is
+ * obtained by merging the values of the bins that are unified.
+ *
+ * The result may differ from a descriptor extracted directly. A structuring
+ * element containing colors of several fine bins which are unified counts
+ * only once for the coarse bin during the extraction. The directly extracted
+ * value thus lies between the maximum and the sum of the unified values, so
+ * bin_merge::sum overestimates and bin_merge::max underestimates it. Both
+ * are exact when no structuring element contains two different fine bins of
+ * the same coarse bin. Converting to the same type returns the descriptor
+ * unchanged. The raw counts are converted as well if present and the
+ * descriptor is normalized from them.
+ *
+ * Throws std::invalid_argument if the target type has more bins.
+ */
+CSD
+convert(const CSD& desc, CSDType type, bin_merge merge = bin_merge::sum);
+
 float
 compare(const CSD& desc1, const CSD& desc2);
 
+/**
+ * @brief Compare grids cell by cell.
+ *
+ * Returns the mean distance of the corresponding cells. Throws
+ * std::invalid_argument if the grids have different dimensions.
+ */
+float
+compare(const grid_descriptor& grid1, const grid_descriptor& grid2);
+
+/// Best alignment of a descriptor with a rectangle of cells.
+struct subgrid_match
+{
+    float distance;
+    size_t column;
+    size_t row;
+    size_t columns;
+    size_t rows;
+};
+
+/**
+ * @brief Find the rectangle of cells of the grid most similar to descriptor.
+ *
+ * The cells of every rectangle are merged into a single descriptor, so a crop
+ * of an image is matched against the part of the grid it covers. The cells
+ * must hold the raw counts. Throws std::invalid_argument if the types differ
+ * or the grid holds no counts.
+ */
+subgrid_match
+compare_subgrids(const CSD& desc, const grid_descriptor& grid);
+
 }
 
 #endif
@@ -35,9 +35,55 @@
 
 namespace image_match {
 
+/**
+ * @brief Implementations of the HMMD conversion.
+ *
+ * All the kernels produce exactly the same output. The vectorized kernels
+ * de-interleave blocks of 16 (SSE4.1) or 32 (AVX2) pixels and replace the
+ * division in the hue computation by a multiplication with a value from a
+ * 256 entry reciprocal table. They are only available on x86 processors
+ * supporting the respective instruction set.
+ */
+enum class hmmd_kernel
+{
+    automatic, ///< Fastest kernel supported by the processor.
+    scalar,
+    sse41,
+    avx2
+};
+
+/// Returns true if the kernel can be used on this machine.
+bool
+hmmd_kernel_available(hmmd_kernel kernel);
+
+/// Returns the kernel used for hmmd_kernel::automatic.
+hmmd_kernel
+best_hmmd_kernel();
+
 /// Convert the image to HMMD color space in place.
 void
-rgb2hmmd(image& im);
+rgb2hmmd(image& im, hmmd_kernel kernel = hmmd_kernel::automatic);
+
+/// Convert the pixels referenced by the view to HMMD color space in place.
+void
+rgb2hmmd(const mutable_image_view& im,
+         hmmd_kernel kernel = hmmd_kernel::automatic);
+
+/**
+ * @brief Convert the pixels of the source view to HMMD color space.
+ *
+ * The result is stored in the destination view, which must have the same
+ * dimensions as the source. Both views must have three channels. The
+ * destination may reference the same pixels as the source, in which case the
+ * conversion is done in place.
+ *
+ * Throws std::invalid_argument if the views do not match or if the requested
+ * kernel is not available.
+ */
+void
+rgb2hmmd(const image_view& src,
+         const mutable_image_view& dst,
+         hmmd_kernel kernel = hmmd_kernel::automatic);
 
 }
 
@@ -0,0 +1,146 @@
+/**
+ * @file hnsw.hpp
+ * @brief Hierarchical navigable small world graph of descriptors.
+ *
+ * The graph finds approximate nearest neighbours of a query in a number of
+ * distance computations growing roughly logarithmically with the size of the
+ * database. Every descriptor is a node linked to its near neighbours at the
+ * bottom level and, with an exponentially decreasing probability, at the
+ * sparser levels above. A search descends greedily from the top level and
+ * then explores the bottom level keeping the ef closest nodes seen, the
+ * larger ef, the higher the recall and the slower the search.
+ *
+ * Unlike the vp_tree, the graph keeps a copy of the descriptors, so that a
+ * persisted graph can be searched directly from a file mapped into memory.
+ */
+#ifndef _IMAGE_MATCH_HNSW_GUARD
+#define _IMAGE_MATCH_HNSW_GUARD
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "image_match/csd.hpp"
+#include "image_match/index.hpp"
+#include "image_match/thread_pool.hpp"
+
+namespace image_match {
+
+/// Parameters of the construction of a hnsw graph.
+struct hnsw_options
+{
+    /// Maximal number of the links of a node above the bottom level, twice
+    /// as many are kept at the bottom level.
+    size_t links{ 16 };
+    /// Number of the closest nodes explored when linking a new node.
+    size_t ef_construction{ 200 };
+    /// Seed of the levels of the nodes.
+    std::uint64_t seed{ 0 };
+};
+
+/**
+ * @brief Approximate nearest neighbour index over L1 distances.
+ *
+ * The nodes are identified by the order of their insertion, which for a
+ * database is the order of its entries. The layout of the graph is flat, the
+ * persisted file holds the same arrays as the memory.
+ */
+class hnsw
+{
+  public:
+    /// Create an empty graph of descriptors of the type.
+    explicit hnsw(CSDType type, const hnsw_options& options = {});
+
+    hnsw(hnsw&&) = default;
+    hnsw& operator=(hnsw&&) = default;
+    hnsw(const hnsw&) = delete;
+    hnsw& operator=(const hnsw&) = delete;
+
+    /**
+     * @brief Map the graph persisted by save() into memory read-only.
+     *
+     * The graph can be searched, but not extended. Throws
+     * std::runtime_error if the file can't be read or is not a graph.
+     */
+    static hnsw open(const std::filesystem::path& file);
+
+    /// Read the graph persisted by save() into memory, to be extended.
+    static hnsw load(const std::filesystem::path& file);
+
+    /// Persist the graph including the descriptors.
+    void save(const std::filesystem::path& file) const;
+
+    /**
+     * @brief Insert the descriptors, numbered after the present nodes.
+     *
+     * If a pool is given, the descriptors are inserted by all of its
+     * workers at once. Throws std::invalid_argument if a descriptor is of a
+     * different type and std::logic_error if the graph is mapped.
+     */
+    void insert(const descriptor_refs& descriptors,
+                thread_pool* pool = nullptr);
+
+    /// Number of the nodes.
+    size_t size() const { return size_; }
+
+    /// Type of the descriptors.
+    CSDType type() const { return type_; }
+
+    /// Return descriptor_fingerprint() of the descriptors of the nodes.
+    std::uint64_t fingerprint() const { return fingerprint_; }
+
+    /**
+     * @brief Return approximately k nearest nodes of the query.
+     *
+     * The ef closest nodes found are kept during the search, at least k.
+     * The neighbours are ordered by increasing distance, ties by position,
+     * and their distances are the ones of compare(). Throws
+     * std::invalid_argument if the query is of a different type.
+     */
+    std::vector<neighbor> search(const CSD& query,
+                                 size_t k,
+                                 size_t ef,
+                                 search_stats* stats = nullptr) const;
+
+  private:
+    class builder;
+
+    /// Point the views at the owned arrays.
+    void attach();
+
+    const float* values(std::uint32_t node) const
+    {
+        return values_view_ + static_cast<size_t>(node) * bins_;
+    }
+
+    /// Return the links of the node at the level, the count first.
+    const std::uint32_t* links(std::uint32_t node, unsigned level) const;
+
+    CSDType type_;
+    size_t bins_;
+    hnsw_options options_;
+    size_t size_{ 0 };
+    std::uint32_t entry_{ 0 };
+    unsigned max_level_{ 0 };
+    std::uint64_t fingerprint_;
+    std::uint64_t random_state_;
+
+    std::vector<float> values_;           ///< Descriptors of the nodes.
+    std::vector<std::uint32_t> bottom_;   ///< Bottom level links by node.
+    std::vector<std::uint32_t> offsets_;  ///< First upper block by node.
+    std::vector<std::uint32_t> upper_;    ///< Upper level links by block.
+    std::vector<std::uint8_t> levels_;    ///< Top level of each node.
+
+    /// The arrays, owned or in the mapped file.
+    std::shared_ptr<const void> mapping_;
+    const float* values_view_{ nullptr };
+    const std::uint32_t* bottom_view_{ nullptr };
+    const std::uint32_t* offsets_view_{ nullptr };
+    const std::uint32_t* upper_view_{ nullptr };
+    const std::uint8_t* levels_view_{ nullptr };
+};
+
+}
+
+#endif
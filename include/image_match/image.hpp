@@ -19,7 +19,11 @@
 #include <cstdint>
 #include <filesystem>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include "gsl/gsl-lite.hpp"
 
@@ -42,6 +46,107 @@ using image_wrapper = std::unique_ptr<unsigned char, image_wrapper_deleter>;
 
 using pixel = gsl::span<unsigned char>;
 
+/**
+ * @brief Non-owning view of interleaved 8-bit pixel data.
+ *
+ * The view references height() scanlines of width() pixels, each pixel
+ * consisting of channels() interleaved 8-bit components. Consecutive
+ * scanlines start stride() bytes apart, which allows the view to reference
+ * a sub-rectangle of a larger image, a padded frame or a foreign buffer
+ * without copying.
+ *
+ * Use image_view for read-only access and mutable_image_view for in-place
+ * processing.
+ */
+template<typename T>
+class basic_image_view
+{
+  public:
+    using value_type = T;
+
+    /**
+     * @brief Construct a view of the given buffer.
+     *
+     * @param[in] data - Pointer to the top-left-most pixel.
+     * @param[in] width - Width of the view in pixels.
+     * @param[in] height - Height of the view in pixels.
+     * @param[in] channels - Number of interleaved channels per pixel.
+     * @param[in] stride - Distance between scanlines in bytes. If 0, the
+     *                     scanlines are assumed to be packed.
+     */
+    basic_image_view(T* data,
+                     size_t width,
+                     size_t height,
+                     size_t channels,
+                     size_t stride = 0)
+      : data_{ data }
+      , width_{ width }
+      , height_{ height }
+      , channels_{ channels }
+      , stride_{ stride ? stride : width * channels }
+    {}
+
+    /// Allow implicit conversion of a mutable view to a read-only view.
+    template<typename U,
+             typename = std::enable_if_t<std::is_same_v<const U, T> &&
+                                         !std::is_same_v<U, T>>>
+    basic_image_view(const basic_image_view<U>& other)
+      : basic_image_view(other.data(),
+                         other.width(),
+                         other.height(),
+                         other.channels(),
+                         other.stride())
+    {}
+
+    size_t width() const { return width_; };
+    size_t height() const { return height_; };
+    size_t channels() const { return channels_; };
+    size_t stride() const { return stride_; };
+
+    /// Returns a pointer to the top-left-most pixel.
+    T* data() const { return data_; };
+
+    /// Returns a pointer to the first pixel of the given scanline.
+    T* row(size_t y) const { return data_ + y * stride_; };
+
+    /// Returns true if there is no padding between the scanlines.
+    bool packed() const { return stride_ == width_ * channels_; };
+
+    /**
+     * @brief Returns a view of a sub-rectangle of this view.
+     *
+     * Throws std::out_of_range if the rectangle does not fit into the view.
+     *
+     * @param[in] x - Column of the top-left corner of the sub-rectangle.
+     * @param[in] y - Row of the top-left corner of the sub-rectangle.
+     * @param[in] width - Width of the sub-rectangle.
+     * @param[in] height - Height of the sub-rectangle.
+     */
+    basic_image_view subview(size_t x,
+                             size_t y,
+                             size_t width,
+                             size_t height) const
+    {
+        if (x + width > width_ || y + height > height_)
+            throw std::out_of_range("Sub-rectangle exceeds the image view.");
+
+        return { row(y) + x * channels_, width, height, channels_, stride_ };
+    }
+
+  private:
+    T* data_;
+
+    size_t width_;
+    size_t height_;
+    size_t channels_;
+    size_t stride_;
+};
+
+/// Read-only view of image data.
+using image_view = basic_image_view<const unsigned char>;
+/// Mutable view of image data.
+using mutable_image_view = basic_image_view<unsigned char>;
+
 /// Simple image container.
 class image
 {
@@ -88,10 +193,12 @@ class image
     /**
      * @brief Constructs an image from given image path.
      *
-     * Loads an image from the given file path. To check that the file loaded
-     * successfully, use the fail() member function or the provided operator
-     * bool().  If the loading fails, a message describing the problem is
-     * provided by the fail_msg() member function.
+     * Loads an image from the given file path. Grayscale images are loaded
+     * with a single channel, all other images are converted to three channel
+     * RGB. To check that the file loaded successfully, use the fail() member
+     * function or the provided operator bool().  If the loading fails, a
+     * message describing the problem is provided by the fail_msg() member
+     * function.
      *
      * @param[in] image_path - File path of the image to load.
      */
@@ -131,6 +238,17 @@ class image
      */
     const image_wrapper& data() const { return data_; };
 
+    /// Returns a mutable view of the whole image.
+    mutable_image_view view()
+    {
+        return { data_.get(), width_, height_, channels_ };
+    };
+    /// Returns a read-only view of the whole image.
+    image_view view() const
+    {
+        return { data_.get(), width_, height_, channels_ };
+    };
+
     /// Returns a proxy to an image row.
     row_proxy operator[](size_t index) { return row_proxy(index, *this); };
     /// Returns a proxy to an image row.
@@ -146,24 +264,6 @@ class image
     /// Reason of failure. Empty if failure didn't occur.
     std::string fail_msg() const { return fail_msg_; }
 
-    /**
-     * @brief Subsample an image by bit shifting its dimensions.
-     *
-     * Specialized function to subsample by bit shifting the image dimensions
-     * to the right by a given amount.
-     *
-     * @param[in] im - Image to shift
-     * @param[in] shift - Number of bits to shift to right.
-     * @param[in] min_width - Minimum resulting image width.
-     * @param[in] min_height - Minimum resulting image height.
-     *
-     * @return The subsampled image.
-     */
-    friend image subsampled_shift(const image& im,
-                                  std::uint32_t shift,
-                                  size_t min_width,
-                                  size_t min_height);
-
   private:
     image_wrapper data_;
 
@@ -175,6 +275,58 @@ class image
     std::string fail_msg_;
 };
 
+/// Image properties read from the file header.
+struct image_info
+{
+    size_t width{ 0 };
+    size_t height{ 0 };
+    size_t channels{ 0 }; ///< Number of channels stored in the file.
+
+    /// Returns the total number of pixels in the image.
+    size_t pixels() const { return width * height; };
+};
+
+/**
+ * @brief Read the image properties without decoding the image.
+ *
+ * Only the file header is parsed, which makes probing considerably cheaper
+ * than loading the image. Returns an empty optional if the header could not
+ * be parsed.
+ *
+ * @param[in] image_path - File path of the image to probe.
+ */
+std::optional<image_info>
+probe_image(const std::filesystem::path& image_path);
+
+/**
+ * @brief Subsample an image by bit shifting its dimensions.
+ *
+ * Specialized function to subsample by bit shifting the image dimensions
+ * to the right by a given amount.
+ *
+ * @param[in] im - Image to shift
+ * @param[in] shift - Number of bits to shift to right.
+ * @param[in] min_width - Minimum resulting image width.
+ * @param[in] min_height - Minimum resulting image height.
+ *
+ * @return The subsampled image.
+ */
+image
+subsampled_shift(const image_view& im,
+                 std::uint32_t shift,
+                 size_t min_width,
+                 size_t min_height);
+
+/// @copydoc subsampled_shift(const image_view&, std::uint32_t, size_t, size_t)
+inline image
+subsampled_shift(const image& im,
+                 std::uint32_t shift,
+                 size_t min_width,
+                 size_t min_height)
+{
+    return subsampled_shift(im.view(), shift, min_width, min_height);
+}
+
 /**
  * @brief Recursively find all the image files in the given directory.
  *
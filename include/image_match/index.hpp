@@ -0,0 +1,161 @@
+/**
+ * @file index.hpp
+ * @brief Indexes for the nearest neighbour search of descriptors.
+ *
+ * The L1 distance computed by compare() is a metric, so a metric tree can
+ * prune whole subtrees using the triangle inequality without losing any of
+ * the nearest neighbours.
+ *
+ * The indexes do not own the descriptors. They refer to them by their
+ * position in the sequence they were built from, which for a database is the
+ * order of its entries. A persisted index holds a fingerprint of the
+ * descriptors, so an index of a database changed since is detected on load.
+ */
+#ifndef _IMAGE_MATCH_INDEX_GUARD
+#define _IMAGE_MATCH_INDEX_GUARD
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "image_match/csd.hpp"
+
+namespace image_match {
+
+/// Descriptors referenced by an index, in the order of the database.
+using descriptor_refs = std::vector<const CSD*>;
+
+/// Descriptor found by a search and its distance from the query.
+struct neighbor
+{
+    float distance;
+    size_t id; ///< Position of the descriptor in the indexed sequence.
+};
+
+/// Work done by a search.
+struct search_stats
+{
+    size_t distances{ 0 }; ///< Number of the computed distances.
+};
+
+/**
+ * @brief Return the k nearest descriptors by a linear scan.
+ *
+ * The neighbours are ordered by increasing distance, ties by position.
+ */
+std::vector<neighbor>
+brute_force_search(const descriptor_refs& descriptors,
+                   const CSD& query,
+                   size_t k,
+                   search_stats* stats = nullptr);
+
+/**
+ * @brief Return the k nearest descriptors by a coarse-to-fine cascade.
+ *
+ * The coarse and the fine descriptors at the same position describe the same
+ * image. The pool descriptors nearest to the coarse query are found by a
+ * linear scan of the coarse ones and re-ranked by the distances of the fine
+ * ones to the fine query, which are the ones of compare(). The neighbours are
+ * ordered by increasing distance, ties by position. A neighbour is missed if
+ * its coarse descriptor is not among the pool nearest. Throws
+ * std::invalid_argument if the sequences differ in length.
+ */
+std::vector<neighbor>
+cascade_search(const descriptor_refs& coarse,
+               const descriptor_refs& fine,
+               const CSD& coarse_query,
+               const CSD& fine_query,
+               size_t k,
+               size_t pool,
+               search_stats* stats = nullptr);
+
+/**
+ * @brief Return a hash of the types and the values of the descriptors.
+ *
+ * The hash identifies the descriptors an index was built from.
+ */
+std::uint64_t
+descriptor_fingerprint(const descriptor_refs& descriptors);
+
+/**
+ * @brief Vantage-point tree over L1 distances of descriptors.
+ *
+ * Every inner node holds a vantage point and the median distance of the
+ * descriptors of its subtree from it. The descriptors closer than the median
+ * form the inside subtree, the rest the outside one. Small subtrees are
+ * stored as leaves which are scanned linearly. The tree keeps a copy of the
+ * values of the descriptors laid out in the order of its nodes.
+ *
+ * The search is exact. Subtrees are pruned only if the triangle inequality
+ * rules them out with a margin covering the rounding errors of the distances
+ * computed in single precision.
+ */
+class vp_tree
+{
+  public:
+    /**
+     * @brief Build the tree over the descriptors.
+     *
+     * The vantage points are chosen pseudo-randomly from the seed. The
+     * descriptors must be of the same type and must outlive the tree.
+     * Throws std::invalid_argument if the types differ.
+     */
+    explicit vp_tree(const descriptor_refs& descriptors,
+                     std::uint64_t seed = 0);
+
+    /**
+     * @brief Load the tree persisted by save() for the given descriptors.
+     *
+     * Throws std::runtime_error if the file can't be read or is not an
+     * index of these descriptors.
+     */
+    static vp_tree load(const std::filesystem::path& file,
+                        const descriptor_refs& descriptors);
+
+    /// Persist the tree, the descriptors are not stored.
+    void save(const std::filesystem::path& file) const;
+
+    /// Number of the indexed descriptors.
+    size_t size() const { return descriptors_.size(); }
+
+    /**
+     * @brief Return the k nearest descriptors of the query.
+     *
+     * The result is the same as of brute_force_search. Throws
+     * std::invalid_argument if the query is of a different type.
+     */
+    std::vector<neighbor> search(const CSD& query,
+                                 size_t k,
+                                 search_stats* stats = nullptr) const;
+
+  private:
+    vp_tree() = default;
+
+    struct node
+    {
+        std::uint32_t begin; ///< First item, the vantage point if inner.
+        std::uint32_t end;
+        float radius;          ///< Median distance from the vantage point.
+        std::uint32_t inside;  ///< Child within the radius, NONE if a leaf.
+        std::uint32_t outside; ///< Child beyond the radius, NONE if a leaf.
+    };
+
+    std::uint32_t build(std::uint32_t begin,
+                        std::uint32_t end,
+                        std::uint64_t& state);
+
+    /// Copy the values of the descriptors in the order of the items.
+    void gather_values();
+
+    descriptor_refs descriptors_;
+    std::vector<std::uint32_t> items_; ///< Descriptors in the order of nodes.
+    std::vector<node> nodes_;
+    size_t bins_{ 0 };
+    /// Values of the items, contiguous so that the leaves are scanned
+    /// sequentially.
+    std::vector<float> values_;
+};
+
+}
+
+#endif
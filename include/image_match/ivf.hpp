@@ -0,0 +1,141 @@
+/**
+ * @file ivf.hpp
+ * @brief Inverted file index of descriptors.
+ *
+ * The descriptors are clustered around centroids and every cluster is stored
+ * as a contiguous list. A search computes the distances to the centroids and
+ * scans only the nprobe lists of the closest ones, so it misses the
+ * neighbours assigned to the other lists.
+ *
+ * The centroids are trained by k-medians, the L1 counterpart of k-means: a
+ * descriptor is assigned to the closest centroid by the L1 distance and a
+ * centroid is moved to the per bin median of its descriptors, which
+ * minimizes the sum of their L1 distances.
+ */
+#ifndef _IMAGE_MATCH_IVF_GUARD
+#define _IMAGE_MATCH_IVF_GUARD
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "image_match/csd.hpp"
+#include "image_match/index.hpp"
+#include "image_match/thread_pool.hpp"
+
+namespace image_match {
+
+/**
+ * @brief Format of the descriptors stored in the lists.
+ *
+ * The 8-bit format stores every bin rounded to a multiple of 1/255, a quarter
+ * of the float format. The distances are then computed from the rounded
+ * values of both the descriptors and the query, so they differ from the ones
+ * of compare() by at most half a step per bin.
+ */
+enum class ivf_storage
+{
+    float32,
+    uint8
+};
+
+/// Parameters of the construction of an ivf index.
+struct ivf_options
+{
+    /// Number of the lists, 0 for the square root of the descriptors.
+    size_t lists{ 0 };
+    /// Number of the k-medians iterations.
+    size_t iterations{ 10 };
+    /// Number of the descriptors the centroids are trained on per list.
+    size_t training{ 64 };
+    ivf_storage storage{ ivf_storage::float32 };
+    /// Seed of the initial centroids.
+    std::uint64_t seed{ 0 };
+};
+
+/**
+ * @brief Approximate nearest neighbour index scanning the closest clusters.
+ *
+ * Like the hnsw graph, the index keeps a copy of the descriptors, ordered by
+ * the lists.
+ */
+class ivf
+{
+  public:
+    /**
+     * @brief Cluster the descriptors and build the lists.
+     *
+     * If a pool is given, the clustering runs on all of its workers. Throws
+     * std::invalid_argument if there are no descriptors or their types
+     * differ.
+     */
+    explicit ivf(const descriptor_refs& descriptors,
+                 const ivf_options& options = {},
+                 thread_pool* pool = nullptr);
+
+    /**
+     * @brief Load the index persisted by save().
+     *
+     * Throws std::runtime_error if the file can't be read or is not an
+     * index.
+     */
+    static ivf load(const std::filesystem::path& file);
+
+    /// Persist the index including the descriptors.
+    void save(const std::filesystem::path& file) const;
+
+    /// Number of the indexed descriptors.
+    size_t size() const { return ids_.size(); }
+
+    /// Number of the lists.
+    size_t lists() const { return offsets_.size() - 1; }
+
+    /// Number of the descriptors in the list.
+    size_t list_size(size_t list) const
+    {
+        return offsets_[list + 1] - offsets_[list];
+    }
+
+    /// Type of the descriptors.
+    CSDType type() const { return type_; }
+
+    /// Format of the stored descriptors.
+    ivf_storage storage() const { return storage_; }
+
+    /// Return descriptor_fingerprint() of the indexed descriptors.
+    std::uint64_t fingerprint() const { return fingerprint_; }
+
+    /**
+     * @brief Return the k nearest descriptors in the nprobe closest lists.
+     *
+     * The neighbours are ordered by increasing distance, ties by position.
+     * Throws std::invalid_argument if the query is of a different type.
+     */
+    std::vector<neighbor> search(const CSD& query,
+                                 size_t k,
+                                 size_t nprobe,
+                                 search_stats* stats = nullptr) const;
+
+  private:
+    ivf() = default;
+
+    /// Train the centroids on a sample of the descriptors.
+    void train(const descriptor_refs& descriptors,
+               const ivf_options& options,
+               thread_pool* pool);
+
+    CSDType type_;
+    size_t bins_{ 0 };
+    ivf_storage storage_{ ivf_storage::float32 };
+    std::uint64_t fingerprint_{ 0 };
+
+    std::vector<float> centroids_;        ///< Centroids of the lists.
+    std::vector<std::uint32_t> offsets_;  ///< First position of each list.
+    std::vector<std::uint32_t> ids_;      ///< Descriptors by position.
+    std::vector<float> values_;           ///< Values in the float format.
+    std::vector<std::uint8_t> codes_;     ///< Values in the 8-bit format.
+};
+
+}
+
+#endif
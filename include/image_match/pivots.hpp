@@ -0,0 +1,99 @@
+/**
+ * @file pivots.hpp
+ * @brief Pivot table for the exact nearest neighbour search (LAESA).
+ *
+ * The distances of all the descriptors to a few pivot descriptors are
+ * computed in advance. By the triangle inequality a descriptor x lies at
+ * least |d(q, p) - d(x, p)| from a query q for every pivot p, so once k
+ * candidates are known, only the descriptors whose bound doesn't exceed the
+ * k-th distance need to be compared to the query. Computing the bounds costs
+ * a subtraction per pivot, much less than a distance of the bins.
+ */
+#ifndef _IMAGE_MATCH_PIVOTS_GUARD
+#define _IMAGE_MATCH_PIVOTS_GUARD
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "image_match/csd.hpp"
+#include "image_match/index.hpp"
+
+namespace image_match {
+
+/**
+ * @brief Exact nearest neighbour index filtering by the distances to pivots.
+ *
+ * Like the vp_tree, the table refers to the descriptors it was built from.
+ * The distances are rounded down to 16 bits and stored pivot by pivot, so
+ * that the bounds of consecutive descriptors are computed together from a
+ * table of two bytes per pivot and descriptor.
+ */
+class pivot_table
+{
+  public:
+    /**
+     * @brief Choose the pivots among the descriptors and tabulate the
+     * distances to them.
+     *
+     * Every next pivot is the descriptor farthest from the pivots already
+     * chosen, the first is chosen pseudo-randomly from the seed. The
+     * descriptors must be of the same type and must outlive the table.
+     * Throws std::invalid_argument if the types differ.
+     */
+    explicit pivot_table(const descriptor_refs& descriptors,
+                         size_t pivots = 16,
+                         std::uint64_t seed = 0);
+
+    /**
+     * @brief Load the table persisted by save() for the given descriptors.
+     *
+     * Throws std::runtime_error if the file can't be read or is not an
+     * index of these descriptors.
+     */
+    static pivot_table load(const std::filesystem::path& file,
+                            const descriptor_refs& descriptors);
+
+    /// Persist the table, the descriptors are not stored.
+    void save(const std::filesystem::path& file) const;
+
+    /// Number of the indexed descriptors.
+    size_t size() const { return descriptors_.size(); }
+
+    /// Number of the pivots.
+    size_t pivots() const { return pivots_.size(); }
+
+    /// Bytes of the table of the distances.
+    size_t table_size() const { return table_.size() * sizeof(table_[0]); }
+
+    /**
+     * @brief Return the k nearest descriptors of the query.
+     *
+     * The result is the same as of brute_force_search. Throws
+     * std::invalid_argument if the query is of a different type.
+     */
+    std::vector<neighbor> search(const CSD& query,
+                                 size_t k,
+                                 search_stats* stats = nullptr) const;
+
+  private:
+    pivot_table() = default;
+
+    /// Copy the values of the descriptors contiguously.
+    void gather_values();
+
+    descriptor_refs descriptors_;
+    size_t bins_{ 0 };
+    /// Values of the descriptors, contiguous so that the few compared ones
+    /// don't wait for the memory one pointer after another.
+    std::vector<float> values_;
+    std::vector<std::uint32_t> pivots_; ///< Descriptors chosen as pivots.
+    float step_{ 1 };                   ///< Distance of a quantization step.
+    /// Distances of all the descriptors to the first pivot, then to the
+    /// second and so on, in the steps.
+    std::vector<std::uint16_t> table_;
+};
+
+}
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * @file pq.hpp
+ * @brief Product quantization of descriptors.
+ *
+ * The bins of a descriptor are split into equally long sub-vectors and every
+ * sub-vector is replaced by the closest of 256 centroids trained for its
+ * subspace, so a descriptor is stored as one byte per subspace. With the
+ * default 16 subspaces a descriptor of 64 bins takes 16 bytes instead of 256.
+ *
+ * The L1 distance is a sum over the bins, hence also over the subspaces. A
+ * search first computes the distances of the sub-vectors of the query to all
+ * the centroids, after which the approximate distance to a descriptor is a
+ * sum of a table lookup per subspace. The closest candidates may be re-ranked
+ * by their exact distances to the descriptors kept by the caller.
+ *
+ * The quantizer may also keep a label, such as the path of the image, of
+ * every descriptor. A search without re-ranking is then answered from the
+ * codes and the labels alone.
+ */
+#ifndef _IMAGE_MATCH_PQ_GUARD
+#define _IMAGE_MATCH_PQ_GUARD
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "image_match/csd.hpp"
+#include "image_match/index.hpp"
+#include "image_match/thread_pool.hpp"
+
+namespace image_match {
+
+/// Parameters of the training of a product quantizer.
+struct pq_options
+{
+    /// Number of the sub-vectors, must divide the bin count.
+    size_t subspaces{ 16 };
+    /// Number of the k-medians iterations training each codebook.
+    size_t iterations{ 10 };
+    /// Number of the descriptors the codebooks are trained on per centroid.
+    size_t training{ 64 };
+    /// Seed of the initial centroids.
+    std::uint64_t seed{ 0 };
+};
+
+/**
+ * @brief Compressed descriptors searched by asymmetric distances.
+ *
+ * The codes are ordered as the descriptors they were built from. Unlike the
+ * hnsw graph and the ivf index, the quantizer does not keep the original
+ * descriptors, a re-ranking search is given them by the caller.
+ */
+class product_quantizer
+{
+  public:
+    /**
+     * @brief Train the codebooks on a sample of the descriptors and encode
+     * all of them.
+     *
+     * If a pool is given, the codebooks are trained by all of its workers.
+     * Throws std::invalid_argument if there are no descriptors, their types
+     * differ or the subspaces don't divide their bins.
+     */
+    explicit product_quantizer(const descriptor_refs& descriptors,
+                               const pq_options& options = {},
+                               thread_pool* pool = nullptr);
+
+    /**
+     * @brief Load the quantizer persisted by save().
+     *
+     * Throws std::runtime_error if the file can't be read or is not a
+     * quantizer.
+     */
+    static product_quantizer load(const std::filesystem::path& file);
+
+    /// Persist the codebooks and the codes.
+    void save(const std::filesystem::path& file) const;
+
+    /// Number of the encoded descriptors.
+    size_t size() const { return subspaces_ ? codes_.size() / subspaces_ : 0; }
+
+    /// Number of the sub-vectors, also the bytes of a code.
+    size_t subspaces() const { return subspaces_; }
+
+    /// Bytes of the codebooks.
+    size_t codebook_size() const { return codebooks_.size() * sizeof(float); }
+
+    /// Type of the descriptors.
+    CSDType type() const { return type_; }
+
+    /// Return descriptor_fingerprint() of the encoded descriptors.
+    std::uint64_t fingerprint() const { return fingerprint_; }
+
+    /**
+     * @brief Label the encoded descriptors, in their order.
+     *
+     * The labels are persisted with the codes. Throws std::invalid_argument
+     * unless there is a label for every descriptor.
+     */
+    void set_labels(const std::vector<std::string>& labels);
+
+    /// Return true if the descriptors are labelled.
+    bool labeled() const { return !label_offsets_.empty(); }
+
+    /// Label of the i-th descriptor, the descriptors must be labelled.
+    std::string_view label(size_t i) const
+    {
+        return std::string_view{ labels_ }.substr(
+          label_offsets_[i], label_offsets_[i + 1] - label_offsets_[i]);
+    }
+
+    /// Bytes of the labels.
+    size_t labels_size() const
+    {
+        return labels_.size() + label_offsets_.size() * sizeof(std::uint64_t);
+    }
+
+    /**
+     * @brief Return the k nearest descriptors by the approximate distances.
+     *
+     * If the store of the encoded descriptors is given, the rerank closest
+     * candidates are re-ranked by their exact distances, which are the ones
+     * of compare(). The neighbours are ordered by increasing distance, ties
+     * by position. Throws std::invalid_argument if the query is of a
+     * different type.
+     */
+    std::vector<neighbor> search(const CSD& query,
+                                 size_t k,
+                                 size_t rerank,
+                                 const descriptor_refs* store = nullptr,
+                                 search_stats* stats = nullptr) const;
+
+  private:
+    product_quantizer() = default;
+
+    CSDType type_;
+    size_t bins_{ 0 };
+    size_t subspaces_{ 0 };
+    size_t centroids_{ 0 };
+    std::uint64_t fingerprint_{ 0 };
+
+    /// Centroids of each subspace, one subspace after another.
+    std::vector<float> codebooks_;
+    /// Centroid of each subspace of each descriptor.
+    std::vector<std::uint8_t> codes_;
+    /// Labels of all the descriptors one after another.
+    std::string labels_;
+    /// Offsets of the labels, one more than the descriptors if labelled.
+    std::vector<std::uint64_t> label_offsets_;
+};
+
+}
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * @file stats.hpp
+ * @brief Timers of the stages of the descriptor extraction.
+ *
+ * Each thread records the durations of the stages into a record of its own,
+ * so no locks are taken while recording. The durations are counted in
+ * logarithmic buckets, so the records don't grow with the number of the
+ * images. The records of all the threads are combined by collect() once the
+ * work is done.
+ *
+ * The timers are compiled in only if IMAGE_MATCH_STAGE_TIMERS is defined (the
+ * CMake option of the same name), otherwise the macros expand to nothing.
+ * Even when compiled in, nothing is recorded until enabled by set_enabled().
+ */
+#ifndef _IMAGE_MATCH_STATS_GUARD
+#define _IMAGE_MATCH_STATS_GUARD
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace image_match {
+namespace stats {
+
+enum class stage
+{
+    probe,     ///< Reading the dimensions of an image.
+    decode,    ///< Reading and decoding an image.
+    subsample, ///< Subsampling an image.
+    hmmd,      ///< Conversion to HMMD.
+    quantize,  ///< Quantization of the colors.
+    scan,      ///< Scan of the structuring elements.
+    extract,   ///< Whole descriptor extraction of an image.
+    write,     ///< Writing a database.
+};
+
+constexpr size_t STAGE_COUNT = static_cast<size_t>(stage::write) + 1;
+
+/// Return the name of the stage.
+const char*
+stage_name(stage s);
+
+enum class counter
+{
+    bytes_read, ///< Bytes of the image files read.
+    pixels,     ///< Pixels of the decoded images.
+    images,     ///< Decoded images.
+};
+
+constexpr size_t COUNTER_COUNT = static_cast<size_t>(counter::images) + 1;
+
+/// Enable or disable the recording, disabled by default.
+void
+set_enabled(bool enabled);
+
+bool
+enabled();
+
+/// Record a duration of the stage on the calling thread.
+void
+record(stage s, std::chrono::nanoseconds duration);
+
+/// Mark the start of a timed stage on the calling thread.
+void
+enter_stage();
+
+/**
+ * @brief Record the duration of a stage started by enter_stage().
+ *
+ * The durations of the outermost stages of the calling thread are also added
+ * to its busy time.
+ */
+void
+leave_stage(stage s, std::chrono::nanoseconds duration);
+
+/// Add to a counter of the calling thread.
+void
+add(counter c, std::uint64_t value);
+
+/**
+ * @brief Records the time from its construction to its destruction.
+ *
+ * Unless the recording is enabled on construction, the clock isn't read.
+ */
+class scoped_timer
+{
+  public:
+    explicit scoped_timer(stage s)
+      : stage_{ s }
+      , active_{ enabled() }
+    {
+        if (!active_)
+            return;
+
+        enter_stage();
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    ~scoped_timer()
+    {
+        if (active_)
+            leave_stage(stage_, std::chrono::steady_clock::now() - start_);
+    }
+
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+  private:
+    stage stage_;
+    bool active_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * @brief Durations of a stage over all the threads, in seconds.
+ *
+ * The percentiles are the middles of their buckets, within a sixteenth of
+ * the exact values, the other figures are exact.
+ */
+struct stage_summary
+{
+    stage id;
+    std::uint64_t count{ 0 };
+    double total{ 0 };
+    double mean{ 0 };
+    double p50{ 0 };
+    double p90{ 0 };
+    double p99{ 0 };
+    double max{ 0 };
+};
+
+struct summary
+{
+    std::vector<stage_summary> stages; ///< Only the recorded stages.
+    std::uint64_t counters[COUNTER_COUNT]{};
+    size_t threads{ 0 }; ///< Number of the threads that recorded anything.
+    /// Seconds each of the threads spent within its outermost stages.
+    std::vector<double> busy;
+};
+
+/**
+ * @brief Combine the records of all the threads.
+ *
+ * Must not be called while any of the threads records.
+ */
+summary
+collect();
+
+/// Clear the records of all the threads, with the same restriction.
+void
+reset();
+
+}
+}
+
+#define IMAGE_MATCH_STATS_CONCAT_(a, b) a##b
+#define IMAGE_MATCH_STATS_CONCAT(a, b) IMAGE_MATCH_STATS_CONCAT_(a, b)
+
+#ifdef IMAGE_MATCH_STAGE_TIMERS
+/// Time the rest of the enclosing scope as the given stage.
+#define IMAGE_MATCH_TIME_STAGE(s)                                             \
+    ::image_match::stats::scoped_timer IMAGE_MATCH_STATS_CONCAT(              \
+      stage_timer_, __LINE__)(::image_match::stats::stage::s)
+/// Add the value to the given counter, evaluated only while enabled.
+#define IMAGE_MATCH_COUNT(c, value)                                           \
+    do {                                                                      \
+        if (::image_match::stats::enabled())                                  \
+            ::image_match::stats::add(::image_match::stats::counter::c,       \
+                                      (value));                               \
+    } while (false)
+#else
+#define IMAGE_MATCH_TIME_STAGE(s) static_cast<void>(0)
+#define IMAGE_MATCH_COUNT(c, value) static_cast<void>(0)
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file thread_pool.hpp
+ * @brief Simple fixed size thread pool.
+ */
+#ifndef _IMAGE_MATCH_THREAD_POOL_GUARD
+#define _IMAGE_MATCH_THREAD_POOL_GUARD
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace image_match {
+
+/**
+ * @brief Fixed number of worker threads executing submitted tasks.
+ *
+ * Tasks are executed in the order of submission. The destructor waits for
+ * all the submitted tasks to finish. A task must not wait for the result of
+ * another task submitted to the same pool, since all the workers may end up
+ * waiting.
+ */
+class thread_pool
+{
+  public:
+    /**
+     * @brief Start the worker threads.
+     *
+     * @param[in] threads - Number of worker threads. If 0, the number of
+     *                      hardware threads is used.
+     */
+    explicit thread_pool(size_t threads = 0);
+    ~thread_pool();
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    /// Returns the number of worker threads.
+    size_t size() const { return workers_.size(); };
+
+    /**
+     * @brief Schedule a task for execution.
+     *
+     * @return Future holding the result of the task or the exception it
+     *         has thrown.
+     */
+    template<typename F>
+    std::future<std::invoke_result_t<F>> submit(F task)
+    {
+        using result_type = std::invoke_result_t<F>;
+
+        auto packaged =
+          std::make_shared<std::packaged_task<result_type()>>(std::move(task));
+        auto result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push([packaged]() { (*packaged)(); });
+        }
+        task_added_.notify_one();
+
+        return result;
+    }
+
+  private:
+    void work();
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+
+    bool stop_{ false };
+    std::mutex mutex_;
+    std::condition_variable task_added_;
+};
+
+}
+
+#endif
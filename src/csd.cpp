@@ -2,6 +2,9 @@
 #include <array>
 #include <cmath>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <limits>
 #include <numeric>
 #include <sstream>
 #include <stdexcept>
@@ -13,13 +16,16 @@
 
 #include "image_match/csd.hpp"
 #include "image_match/hmmd.hpp"
+#include "image_match/stats.hpp"
+#include "image_match/thread_pool.hpp"
+
+#include "csd_kernels.hpp"
 
 namespace image_match {
 
 template<size_t N>
 using u8arr = typename std::array<std::uint8_t, N>;
 
-constexpr u8arr<4> BIN32_SUBSPACE_BOUNDRIES{ 5, 59, 109, 255 };
 constexpr u8arr<5> SUBSPACE_BOUNDRIES{ 5, 19, 59, 109, 255 };
 
 constexpr u8arr<4> BIN32_HUE_BIT_BIN_SIZES{ 0, 2, 2, 2 };
@@ -35,185 +41,1192 @@ constexpr u8arr<5> BIN256_HUE_BIT_BIN_SIZES{ 0, 2, 4, 4, 4 };
 constexpr u8arr<5> BIN256_SUM_BIT_BIN_SIZES{ 5, 3, 2, 2, 2 };
 
 std::uint32_t
-compute_subsample_shift(const image& im)
+compute_subsample_shift(size_t width, size_t height)
 {
     double w, h;
-    w = static_cast<double>(im.width());
-    h = static_cast<double>(im.height());
+    w = static_cast<double>(width);
+    h = static_cast<double>(height);
 
     return static_cast<std::uint32_t>(
       std::max(0.0, std::floor(std::log2(std::sqrt(w * h)) - 7.5)));
 }
 
-using quantized_map = std::vector<std::vector<std::uint8_t>>;
+/// Lookup table mapping a diff value to its subspace.
+using subspace_table = u8arr<256>;
 
-template<size_t N>
-quantized_map
-quantize(const image& im,
-         const u8arr<N>& sub_bounds,
-         const u8arr<N>& hue_bin_bits,
-         const u8arr<N>& sum_bin_bits)
+constexpr subspace_table
+make_subspace_table()
 {
-    SPDLOG_DEBUG("Quantizing image with bins, width={}, height={}",
-                 im.width(),
-                 im.height());
+    subspace_table table{};
+    for (size_t diff = 0; diff < table.size(); ++diff) {
+        std::uint8_t subspace = 0;
+        while (diff > SUBSPACE_BOUNDRIES[subspace])
+            subspace++;
+        table[diff] = subspace;
+    }
 
-    quantized_map qm;
-    qm.resize(im.height());
-    for (auto&& row : qm)
-        row.resize(im.width());
+    return table;
+}
+
+constexpr subspace_table DIFF_SUBSPACES = make_subspace_table();
+
+/**
+ * Quantization of a CSDType expressed over the five subspaces of
+ * SUBSPACE_BOUNDRIES. The 32 bin quantization joins subspaces 1 and 2, which
+ * is expressed by giving both of them the same offset and bin sizes.
+ *
+ * The bin of a pixel in subspace s is
+ *
+ *      offsets[s] + ((hue >> hue_shifts[s]) << sum_bits[s])
+ *                 + (sum >> sum_shifts[s])
+ */
+struct bin_layout
+{
+    u8arr<5> offsets;
+    u8arr<5> hue_bits;
+    u8arr<5> sum_bits;
+    u8arr<5> hue_shifts;
+    u8arr<5> sum_shifts;
+    size_t bins;
+};
+
+template<size_t N>
+constexpr bin_layout
+make_bin_layout(const u8arr<N>& hue_bin_bits, const u8arr<N>& sum_bin_bits)
+{
+    // Index of the type's own subspace for each of the five subspaces
+    constexpr u8arr<5> BIN32_SUBSPACES{ 0, 1, 1, 2, 3 };
+    constexpr u8arr<5> SUBSPACES{ 0, 1, 2, 3, 4 };
+    const auto& subspaces = N == 4 ? BIN32_SUBSPACES : SUBSPACES;
 
     // Compute offsets of individual bins
-    std::vector<std::uint8_t> offsets(N, 0);
-    for (size_t i = 0; i + 1 < N; ++i)
+    std::array<size_t, N + 1> offsets{};
+    for (size_t i = 0; i < N; ++i)
         offsets[i + 1] =
           offsets[i] + (1 << hue_bin_bits[i]) * (1 << sum_bin_bits[i]);
 
-    // Bin individual pixels
-    std::uint8_t subspace, hue_bits, sum_bits;
-    for (size_t y = 0; y < im.height(); ++y) {
-        for (size_t x = 0; x < im.width(); ++x) {
-            pixel p = im[y][x];
+    bin_layout layout{};
+    for (size_t i = 0; i < 5; ++i) {
+        size_t subspace = subspaces[i];
+        layout.offsets[i] = static_cast<std::uint8_t>(offsets[subspace]);
+        layout.hue_bits[i] = hue_bin_bits[subspace];
+        layout.sum_bits[i] = sum_bin_bits[subspace];
+        layout.hue_shifts[i] = 8 - hue_bin_bits[subspace];
+        layout.sum_shifts[i] = 8 - sum_bin_bits[subspace];
+    }
+    layout.bins = offsets[N];
+
+    return layout;
+}
+
+template<CSDType T>
+constexpr bin_layout BIN_LAYOUT{};
 
-            // Determine the pixel subspace
-            subspace = 0;
-            while (p[2] > sub_bounds[subspace])
-                subspace++;
+template<>
+constexpr bin_layout BIN_LAYOUT<CSDType::Bin32> =
+  make_bin_layout(BIN32_HUE_BIT_BIN_SIZES, BIN32_SUM_BIT_BIN_SIZES);
+template<>
+constexpr bin_layout BIN_LAYOUT<CSDType::Bin64> =
+  make_bin_layout(BIN64_HUE_BIT_BIN_SIZES, BIN64_SUM_BIT_BIN_SIZES);
+template<>
+constexpr bin_layout BIN_LAYOUT<CSDType::Bin128> =
+  make_bin_layout(BIN128_HUE_BIT_BIN_SIZES, BIN128_SUM_BIT_BIN_SIZES);
+template<>
+constexpr bin_layout BIN_LAYOUT<CSDType::Bin256> =
+  make_bin_layout(BIN256_HUE_BIT_BIN_SIZES, BIN256_SUM_BIT_BIN_SIZES);
 
-            // Place the color into bins according to subspace
-            hue_bits = p[0] >> (8 - hue_bin_bits[subspace]);
-            sum_bits = p[1] >> (8 - sum_bin_bits[subspace]);
+/// Check that the diff-axis is cut at 6, 20, 60 and 110.
+constexpr bool
+subspaces_match_partition()
+{
+    constexpr std::array<size_t, 6> cuts{ 0, 6, 20, 60, 110, 256 };
+    for (size_t subspace = 0; subspace < 5; ++subspace)
+        for (size_t diff = cuts[subspace]; diff < cuts[subspace + 1]; ++diff)
+            if (DIFF_SUBSPACES[diff] != subspace)
+                return false;
+
+    return true;
+}
+
+/// Check the number of hue and sum levels per subspace and the bin count.
+constexpr bool
+layout_matches_partition(const bin_layout& layout,
+                         const std::array<size_t, 5>& hue_levels,
+                         const std::array<size_t, 5>& sum_levels,
+                         size_t bins)
+{
+    size_t offset = 0;
+    for (size_t subspace = 0; subspace < 5; ++subspace) {
+        if ((1u << layout.hue_bits[subspace]) != hue_levels[subspace] ||
+            (1u << layout.sum_bits[subspace]) != sum_levels[subspace] ||
+            layout.hue_shifts[subspace] + layout.hue_bits[subspace] != 8 ||
+            layout.sum_shifts[subspace] + layout.sum_bits[subspace] != 8)
+            return false;
 
-            // Compute the final bin value
-            qm[y][x] = offsets[subspace] +
-                       ((hue_bits << sum_bin_bits[subspace]) | sum_bits);
+        // Subspaces follow each other, except for the shared ones
+        if (layout.offsets[subspace] != offset) {
+            if (subspace == 0 ||
+                layout.offsets[subspace] != layout.offsets[subspace - 1])
+                return false;
+            continue;
         }
+        offset += hue_levels[subspace] * sum_levels[subspace];
     }
 
-    return qm;
+    return offset == bins && layout.bins == bins;
 }
 
-quantized_map
-quantize(const image& im, CSDType type)
-{
-    SPDLOG_DEBUG("Quantizing image, width={}, height={}, type={}",
-                 im.width(),
-                 im.height(),
-                 type);
+// The MPEG-7 partition as documented in csd.hpp
+static_assert(subspaces_match_partition());
+static_assert(layout_matches_partition(BIN_LAYOUT<CSDType::Bin256>,
+                                       { 1, 4, 16, 16, 16 },
+                                       { 32, 8, 4, 4, 4 },
+                                       256));
+static_assert(layout_matches_partition(BIN_LAYOUT<CSDType::Bin128>,
+                                       { 1, 4, 8, 8, 8 },
+                                       { 16, 4, 4, 4, 4 },
+                                       128));
+static_assert(layout_matches_partition(BIN_LAYOUT<CSDType::Bin64>,
+                                       { 1, 4, 4, 8, 8 },
+                                       { 8, 4, 4, 2, 1 },
+                                       64));
+static_assert(layout_matches_partition(BIN_LAYOUT<CSDType::Bin32>,
+                                       { 1, 4, 4, 4, 4 },
+                                       { 8, 4, 4, 1, 1 },
+                                       32));
 
+const bin_layout&
+get_bin_layout(CSDType type)
+{
     switch (type) {
         case CSDType::Bin32:
-            return quantize(im,
-                            BIN32_SUBSPACE_BOUNDRIES,
-                            BIN32_HUE_BIT_BIN_SIZES,
-                            BIN32_SUM_BIT_BIN_SIZES);
+            return BIN_LAYOUT<CSDType::Bin32>;
         case CSDType::Bin64:
-            return quantize(im,
-                            SUBSPACE_BOUNDRIES,
-                            BIN64_HUE_BIT_BIN_SIZES,
-                            BIN64_SUM_BIT_BIN_SIZES);
+            return BIN_LAYOUT<CSDType::Bin64>;
         case CSDType::Bin128:
-            return quantize(im,
-                            SUBSPACE_BOUNDRIES,
-                            BIN128_HUE_BIT_BIN_SIZES,
-                            BIN128_SUM_BIT_BIN_SIZES);
+            return BIN_LAYOUT<CSDType::Bin128>;
         case CSDType::Bin256:
-            return quantize(im,
-                            SUBSPACE_BOUNDRIES,
-                            BIN256_HUE_BIT_BIN_SIZES,
-                            BIN256_SUM_BIT_BIN_SIZES);
+            return BIN_LAYOUT<CSDType::Bin256>;
     }
 
     throw std::logic_error("Not implemented for given CSDType!");
 }
 
+/// Bin of a HMMD pixel, without any branches.
+inline std::uint8_t
+quantize_pixel(const unsigned char* p, const bin_layout& l)
+{
+    std::uint8_t subspace = DIFF_SUBSPACES[p[2]];
+    return l.offsets[subspace] +
+           ((p[0] >> l.hue_shifts[subspace]) << l.sum_bits[subspace]) +
+           (p[1] >> l.sum_shifts[subspace]);
+}
+
+/// Quantize a HMMD image for a single bin layout known at compile time.
+template<CSDType T>
 void
-scan_sector(const quantized_map& qm,
-            CSD::descriptor& d,
-            std::vector<bool>& seen,
-            size_t x_begin,
-            size_t y_begin)
+quantize_hmmd(const image_view& im, quantized_map& qm)
 {
-    // Reset seen bit vector
-    std::fill(seen.begin(), seen.end(), false);
+    constexpr const bin_layout& layout = BIN_LAYOUT<T>;
 
-    size_t val;
-    for (size_t dy = 0; dy < STRUCTURING_ELEMENT_SIZE; ++dy) {
-        for (size_t dx = 0; dx < STRUCTURING_ELEMENT_SIZE; ++dx) {
-            val = qm[y_begin + dy][x_begin + dx];
-            if (!seen[val]) {
-                seen[val] = true;
-                ++d[val];
-            }
-        }
+    const size_t channels = im.channels();
+    for (size_t y = 0; y < im.height(); ++y) {
+        const unsigned char* p = im.row(y);
+        std::uint8_t* out = qm[y].data();
+        for (size_t x = 0; x < im.width(); ++x, p += channels)
+            out[x] = quantize_pixel(p, layout);
     }
 }
 
-CSD::descriptor
-scan(const quantized_map& qm, size_t bin_size)
+/// Quantize a HMMD image for several bin layouts in a single pass.
+void
+quantize_hmmd(const image_view& im,
+              const std::vector<CSDType>& types,
+              std::vector<quantized_map>& qms)
 {
-    SPDLOG_DEBUG("Scanning quantized map with bin_size={}", bin_size);
+    std::vector<const bin_layout*> layouts;
+    for (auto&& type : types)
+        layouts.push_back(&get_bin_layout(type));
 
-    CSD::descriptor d(bin_size, 0);
-    std::vector<bool> seen(bin_size);
+    const size_t channels = im.channels();
+    for (size_t y = 0; y < im.height(); ++y) {
+        const unsigned char* p = im.row(y);
+        for (size_t x = 0; x < im.width(); ++x, p += channels)
+            for (size_t i = 0; i < layouts.size(); ++i)
+                qms[i][y][x] = quantize_pixel(p, *layouts[i]);
+    }
+}
 
-    size_t y_bound, x_bound;
-    y_bound = qm.size() - STRUCTURING_ELEMENT_SIZE + 1;
-    x_bound = qm[0].size() - STRUCTURING_ELEMENT_SIZE + 1;
+std::vector<quantized_map>
+quantize_hmmd(const image_view& im, const std::vector<CSDType>& types)
+{
+    std::vector<quantized_map> qms(types.size());
+    for (auto&& qm : qms) {
+        qm.resize(im.height());
+        for (auto&& row : qm)
+            row.resize(im.width());
+    }
 
-    for (size_t y = 0; y < y_bound; ++y) {
-        for (size_t x = 0; x < x_bound; ++x) {
-            scan_sector(qm, d, seen, x, y);
-        }
+    if (types.size() != 1) {
+        quantize_hmmd(im, types, qms);
+        return qms;
     }
 
-    return d;
+    switch (types[0]) {
+        case CSDType::Bin32:
+            quantize_hmmd<CSDType::Bin32>(im, qms[0]);
+            break;
+        case CSDType::Bin64:
+            quantize_hmmd<CSDType::Bin64>(im, qms[0]);
+            break;
+        case CSDType::Bin128:
+            quantize_hmmd<CSDType::Bin128>(im, qms[0]);
+            break;
+        case CSDType::Bin256:
+            quantize_hmmd<CSDType::Bin256>(im, qms[0]);
+            break;
+    }
+
+    return qms;
 }
 
-CSD::descriptor
-scan(const quantized_map& qm, CSDType type)
+using gray_bin_table = u8arr<256>;
+
+/**
+ * Lookup table of bins of gray pixels. A gray pixel has zero hue and diff
+ * and its sum equals the luminance, so it always falls into subspace 0.
+ */
+constexpr gray_bin_table
+make_gray_bin_table(const bin_layout& layout)
 {
-    SPDLOG_DEBUG("Scanning quantized map for type={}", type);
+    gray_bin_table table{};
+    for (size_t v = 0; v < table.size(); ++v)
+        table[v] = static_cast<std::uint8_t>(layout.offsets[0] +
+                                             (v >> layout.sum_shifts[0]));
+
+    return table;
+}
 
+template<CSDType T>
+constexpr gray_bin_table GRAY_BINS = make_gray_bin_table(BIN_LAYOUT<T>);
+
+const gray_bin_table&
+gray_bins(CSDType type)
+{
     switch (type) {
         case CSDType::Bin32:
-            return scan(qm, 32);
+            return GRAY_BINS<CSDType::Bin32>;
         case CSDType::Bin64:
-            return scan(qm, 64);
+            return GRAY_BINS<CSDType::Bin64>;
         case CSDType::Bin128:
-            return scan(qm, 128);
+            return GRAY_BINS<CSDType::Bin128>;
         case CSDType::Bin256:
-            return scan(qm, 256);
+            return GRAY_BINS<CSDType::Bin256>;
     }
 
     throw std::logic_error("Not implemented for given CSDType!");
 }
 
-CSD::CSD(const image& im, CSDType type)
-  : type{ type }
+quantized_map
+quantize_gray(const image_view& im, CSDType type)
+{
+    SPDLOG_DEBUG("Quantizing grayscale image, width={}, height={}",
+                 im.width(),
+                 im.height());
+
+    const auto& bins = gray_bins(type);
+
+    quantized_map qm(im.height());
+    for (size_t y = 0; y < im.height(); ++y) {
+        const unsigned char* p = im.row(y);
+        qm[y].resize(im.width());
+        for (size_t x = 0; x < im.width(); ++x)
+            qm[y][x] = bins[p[x]];
+    }
+
+    return qm;
+}
+
+std::vector<quantized_map>
+quantize(const image_view& im, const std::vector<CSDType>& types)
+{
+    SPDLOG_DEBUG("Quantizing image, width={}, height={}, types={}",
+                 im.width(),
+                 im.height(),
+                 types.size());
+
+    if (im.channels() != 1)
+        return quantize_hmmd(im, types);
+
+    std::vector<quantized_map> qms;
+    for (auto&& type : types)
+        qms.push_back(quantize_gray(im, type));
+
+    return qms;
+}
+
+quantized_map
+quantize(const image_view& im, CSDType type)
+{
+    return std::move(quantize(im, std::vector<CSDType>{ type }).front());
+}
+
+/// Minimal number of structuring element rows processed by a single task
+constexpr size_t MIN_BAND_ROWS = 32;
+
+std::uint64_t
+window_region::area() const
+{
+    return static_cast<std::uint64_t>(width) * height;
+}
+
+bool
+window_region::overlaps(const window_region& other) const
+{
+    return x < other.x + other.width && other.x < x + width &&
+           y < other.y + other.height && other.y < y + height;
+}
+
+bool
+window_region::operator==(const window_region& other) const
+{
+    return x == other.x && y == other.y && width == other.width &&
+           height == other.height;
+}
+
+bool
+window_region::operator!=(const window_region& other) const
+{
+    return !(*this == other);
+}
+
+/// Scan the structuring element at the given position of several maps.
+void
+scan_sector(const std::vector<quantized_map>& qms,
+            std::vector<CSD::histogram>& counts,
+            std::vector<bool>& seen,
+            size_t x_begin,
+            size_t y_begin)
 {
-    SPDLOG_DEBUG("Generating Color Structure Desriptor type={}", type);
+    for (size_t i = 0; i < qms.size(); ++i) {
+        // Reset seen bit vector
+        std::fill(seen.begin(), seen.end(), false);
 
-    auto p = compute_subsample_shift(im);
-    auto resized = subsampled_shift(
+        const auto& qm = qms[i];
+        auto& c = counts[i];
+
+        size_t val;
+        for (size_t dy = 0; dy < STRUCTURING_ELEMENT_SIZE; ++dy) {
+            for (size_t dx = 0; dx < STRUCTURING_ELEMENT_SIZE; ++dx) {
+                val = qm[y_begin + dy][x_begin + dx];
+                if (!seen[val]) {
+                    seen[val] = true;
+                    ++c[val];
+                }
+            }
+        }
+    }
+}
+
+/// Assignment of the structuring element positions to the cells of a grid.
+struct grid_cells
+{
+    window_region extent;
+    std::vector<size_t> column; ///< Cell column of each column of positions.
+    std::vector<size_t> row;    ///< First cell of each row of positions.
+    size_t size;
+};
+
+/// Split the positions into a grid the same way as split_regions.
+grid_cells
+make_grid_cells(const window_region& extent, size_t columns, size_t rows)
+{
+    grid_cells grid{ extent,
+                     std::vector<size_t>(extent.width),
+                     std::vector<size_t>(extent.height),
+                     columns * rows };
+    for (size_t i = 0; i < columns; ++i)
+        for (size_t x = extent.width * i / columns;
+             x < extent.width * (i + 1) / columns;
+             ++x)
+            grid.column[x] = i;
+    for (size_t j = 0; j < rows; ++j)
+        for (size_t y = extent.height * j / rows;
+             y < extent.height * (j + 1) / rows;
+             ++y)
+            grid.row[y] = j * columns;
+
+    return grid;
+}
+
+/// Counts of each type within a cell of a grid.
+struct cell_counts
+{
+    std::vector<CSD::histogram> histograms;
+    std::uint64_t windows{ 0 }; ///< Number of the evaluated positions.
+};
+
+using cell_histograms = std::vector<cell_counts>;
+
+/// Decide pseudo-randomly whether the position is evaluated.
+inline bool
+is_sampled(size_t x, size_t y, std::uint64_t seed, std::uint64_t threshold)
+{
+    // Finalizer of splitmix64, the result depends on the position only
+    std::uint64_t h = (static_cast<std::uint64_t>(y) << 32 | x) ^
+                      (seed * 0x9E3779B97F4A7C15ull);
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    h ^= h >> 31;
+
+    return (h >> 32) < threshold;
+}
+
+/// Check the sampling of the positions requested by the options.
+void
+check_sampling(const extraction_options& options)
+{
+    if (options.stride == 0)
+        throw std::invalid_argument("Stride must be positive.");
+    if (!(options.sampling > 0 && options.sampling <= 1))
+        throw std::invalid_argument("Sampling must lie in (0, 1].");
+}
+
+/// Return true if the options evaluate only some of the positions.
+bool
+is_sparse(const extraction_options& options)
+{
+    return options.stride != 1 || options.sampling < 1;
+}
+
+/**
+ * @brief Scan the positions of the region, the maps start at its corner.
+ *
+ * Every evaluated position is counted into the histograms of its cell of the
+ * grid. The positions to evaluate are given by the stride and the sampling
+ * of the options, both relative to the corner of the image, so the result
+ * does not depend on how the image is split into regions.
+ */
+cell_histograms
+scan(const std::vector<quantized_map>& qms,
+     const std::vector<CSDType>& types,
+     const window_region& region,
+     const grid_cells& grid,
+     const extraction_options& options)
+{
+    SPDLOG_DEBUG("Scanning {} quantized maps", qms.size());
+    IMAGE_MATCH_TIME_STAGE(scan);
+
+    cell_histograms counts(grid.size);
+    for (auto&& cell : counts)
+        for (auto&& type : types)
+            cell.histograms.emplace_back(bin_count(type), 0);
+    std::vector<bool> seen(bin_count(CSDType::Bin256));
+
+    const size_t stride = options.stride;
+    const bool sampled = options.sampling < 1;
+    const auto threshold =
+      static_cast<std::uint64_t>(options.sampling * 4294967296.0);
+
+    const size_t* column = grid.column.data() + region.x - grid.extent.x;
+    const size_t* row = grid.row.data() + region.y - grid.extent.y;
+    for (size_t y = (stride - region.y % stride) % stride; y < region.height;
+         y += stride) {
+        for (size_t x = (stride - region.x % stride) % stride;
+             x < region.width;
+             x += stride) {
+            if (sampled && !is_sampled(region.x + x,
+                                       region.y + y,
+                                       options.seed,
+                                       threshold))
+                continue;
+
+            auto& cell = counts[row[y] + column[x]];
+            scan_sector(qms, cell.histograms, seen, x, y);
+            ++cell.windows;
+        }
+    }
+
+    return counts;
+}
+
+/// Subsample the image to the size the descriptor is computed from.
+image
+subsample(const image_view& im)
+{
+    auto p = compute_subsample_shift(im.width(), im.height());
+    return subsampled_shift(
       im, p, STRUCTURING_ELEMENT_SIZE, STRUCTURING_ELEMENT_SIZE);
-    rgb2hmmd(resized);
-    auto qm = quantize(resized, type);
-    auto descriptor = scan(qm, type);
+}
+
+/**
+ * @brief Quantize the part of the image covered by the region.
+ *
+ * The covered pixels are converted to HMMD into a buffer of their own, so
+ * regions can be processed concurrently.
+ */
+std::vector<quantized_map>
+quantize_region(const image_view& im,
+                const std::vector<CSDType>& types,
+                const window_region& region,
+                hmmd_kernel kernel = hmmd_kernel::automatic)
+{
+    auto covered = im.subview(region.x,
+                              region.y,
+                              region.width + STRUCTURING_ELEMENT_SIZE - 1,
+                              region.height + STRUCTURING_ELEMENT_SIZE - 1);
+
+    // Grayscale images are binned directly from luminance
+    if (covered.channels() == 1) {
+        IMAGE_MATCH_TIME_STAGE(quantize);
+        return quantize(covered, types);
+    }
+
+    image converted(covered.width(), covered.height(), covered.channels());
+    rgb2hmmd(covered, converted.view(), kernel);
+
+    IMAGE_MATCH_TIME_STAGE(quantize);
+    return quantize(converted.view(), types);
+}
+
+/// Count the bins of the structuring elements within the region.
+cell_histograms
+scan_region(const image_view& im,
+            const std::vector<CSDType>& types,
+            const window_region& region,
+            const grid_cells& grid,
+            const extraction_options& options)
+{
+    SPDLOG_DEBUG("Scanning region x={}, y={}, width={}, height={}",
+                 region.x,
+                 region.y,
+                 region.width,
+                 region.height);
+
+    return scan(quantize_region(im, types, region, options.hmmd),
+                types,
+                region,
+                grid,
+                options);
+}
+
+/// Count the bins within the region, split into bands if a pool is given.
+cell_histograms
+count_windows(const image_view& im,
+              const std::vector<CSDType>& types,
+              const window_region& region,
+              const grid_cells& grid,
+              const extraction_options& options)
+{
+    size_t bands = 1;
+    if (options.pool)
+        bands = std::clamp(
+          region.height / MIN_BAND_ROWS, size_t(1), options.pool->size());
+
+    if (bands == 1)
+        return scan_region(im, types, region, grid, options);
+
+    std::vector<std::future<cell_histograms>> results;
+    for (size_t b = 0; b < bands; ++b) {
+        window_region band = region;
+        band.y = region.y + region.height * b / bands;
+        band.height = region.y + region.height * (b + 1) / bands - band.y;
+        results.push_back(options.pool->submit(
+          [&, band]() { return scan_region(im, types, band, grid, options); }));
+    }
+
+    // Wait for all the bands before rethrowing, the tasks refer to im
+    for (auto&& result : results)
+        result.wait();
+
+    auto counts = results[0].get();
+    for (size_t b = 1; b < bands; ++b) {
+        auto band_counts = results[b].get();
+        for (size_t cell = 0; cell < counts.size(); ++cell) {
+            auto& histograms = counts[cell].histograms;
+            for (size_t i = 0; i < types.size(); ++i)
+                std::transform(histograms[i].begin(),
+                               histograms[i].end(),
+                               band_counts[cell].histograms[i].begin(),
+                               histograms[i].begin(),
+                               std::plus<>());
+            counts[cell].windows += band_counts[cell].windows;
+        }
+    }
+
+    return counts;
+}
+
+window_region
+window_extent(size_t width, size_t height)
+{
+    auto p = compute_subsample_shift(width, height);
+    size_t w = std::max<size_t>(STRUCTURING_ELEMENT_SIZE, width >> p);
+    size_t h = std::max<size_t>(STRUCTURING_ELEMENT_SIZE, height >> p);
+
+    return { 0,
+             0,
+             w - STRUCTURING_ELEMENT_SIZE + 1,
+             h - STRUCTURING_ELEMENT_SIZE + 1 };
+}
+
+std::vector<window_region>
+split_regions(const window_region& extent, size_t columns, size_t rows)
+{
+    if (columns == 0 || rows == 0 || columns > extent.width ||
+        rows > extent.height)
+        throw std::invalid_argument("Invalid number of regions.");
+
+    std::vector<window_region> regions;
+    for (size_t j = 0; j < rows; ++j) {
+        size_t y_begin = extent.y + extent.height * j / rows;
+        size_t y_end = extent.y + extent.height * (j + 1) / rows;
+        for (size_t i = 0; i < columns; ++i) {
+            size_t x_begin = extent.x + extent.width * i / columns;
+            size_t x_end = extent.x + extent.width * (i + 1) / columns;
+            regions.push_back(
+              { x_begin, y_begin, x_end - x_begin, y_end - y_begin });
+        }
+    }
+
+    return regions;
+}
+
+std::vector<CSD>
+compute_descriptors(const image_view& im,
+                    const std::vector<CSDType>& types,
+                    const extraction_options& options)
+{
+    SPDLOG_DEBUG("Generating {} Color Structure Desriptors", types.size());
+    IMAGE_MATCH_TIME_STAGE(extract);
+
+    check_sampling(options);
+
+    std::vector<CSD> csds;
+    if (types.empty())
+        return csds;
+
+    auto resized = subsample(im);
+    auto extent = window_extent(im.width(), im.height());
+    auto grid = make_grid_cells(extent, 1, 1);
+    auto counts =
+      count_windows(resized.view(), types, extent, grid, options).front();
+
+    // The sampling may miss all the positions of a small image
+    if (counts.windows == 0) {
+        extraction_options exact = options;
+        exact.stride = 1;
+        exact.sampling = 1;
+        counts =
+          count_windows(resized.view(), types, extent, grid, exact).front();
+    }
+
+    // Each evaluated window position in the subsampled image counts once
+    for (size_t i = 0; i < types.size(); ++i)
+        csds.emplace_back(counts.histograms[i], counts.windows, types[i]);
+
+    return csds;
+}
+
+namespace {
+
+/// Throw unless the region is a non-empty part of the extent.
+void
+check_region(const window_region& region, const window_region& extent)
+{
+    if (region.width == 0 || region.height == 0 ||
+        region.x + region.width > extent.width ||
+        region.y + region.height > extent.height)
+        throw std::invalid_argument("Region outside of the image.");
+}
+
+}
+
+std::vector<region_crop>
+crop_regions(const image_view& im, const std::vector<window_region>& regions)
+{
+    auto extent = window_extent(im.width(), im.height());
+    for (auto&& region : regions)
+        check_region(region, extent);
+
+    std::vector<region_crop> crops;
+    if (regions.empty())
+        return crops;
+
+    auto resized = subsample(im);
+    for (auto&& region : regions) {
+        auto covered =
+          resized.view().subview(region.x,
+                                 region.y,
+                                 region.width + STRUCTURING_ELEMENT_SIZE - 1,
+                                 region.height + STRUCTURING_ELEMENT_SIZE - 1);
+
+        image pixels(covered.width(), covered.height(), covered.channels());
+        size_t row_size = covered.width() * covered.channels();
+        for (size_t y = 0; y < covered.height(); ++y)
+            std::copy_n(covered.row(y), row_size, pixels.view().row(y));
+
+        crops.push_back({ std::move(pixels), region, im.width(), im.height() });
+    }
+
+    return crops;
+}
+
+std::vector<partial_descriptor>
+compute_partial_descriptors(const region_crop& crop,
+                            const std::vector<CSDType>& types,
+                            const extraction_options& options)
+{
+    auto extent = window_extent(crop.width, crop.height);
+    check_region(crop.region, extent);
+    if (crop.pixels.width() !=
+          crop.region.width + STRUCTURING_ELEMENT_SIZE - 1 ||
+        crop.pixels.height() !=
+          crop.region.height + STRUCTURING_ELEMENT_SIZE - 1)
+        throw std::invalid_argument("Crop does not match its region.");
+
+    // Partial descriptors are always exact, so that they merge exactly
+    extraction_options exact = options;
+    exact.stride = 1;
+    exact.sampling = 1;
 
-    // Normalize the descriptor
-    for (auto&& val : descriptor)
-        val /= (im.width() - STRUCTURING_ELEMENT_SIZE + 1) *
-               (im.height() - STRUCTURING_ELEMENT_SIZE + 1);
+    // The crop starts at the origin of the region
+    window_region local{ 0, 0, crop.region.width, crop.region.height };
+    auto counts = count_windows(crop.pixels.view(),
+                                types,
+                                local,
+                                make_grid_cells(local, 1, 1),
+                                exact)
+                    .front();
+
+    std::vector<partial_descriptor> partials;
+    for (size_t i = 0; i < types.size(); ++i)
+        partials.push_back(
+          { types[i], counts.histograms[i], extent, crop.region });
+
+    return partials;
+}
+
+std::vector<partial_descriptor>
+compute_partial_descriptors(const image_view& im,
+                            const std::vector<CSDType>& types,
+                            const window_region& region,
+                            const extraction_options& options)
+{
+    return compute_partial_descriptors(
+      crop_regions(im, { region }).front(), types, options);
+}
+
+CSD
+merge(const std::vector<partial_descriptor>& partials)
+{
+    if (partials.empty())
+        throw std::invalid_argument("No partial descriptors to merge.");
+
+    const auto& first = partials.front();
+    std::vector<std::uint64_t> counts(bin_count(first.type), 0);
+    std::uint64_t windows = 0;
+    for (size_t i = 0; i < partials.size(); ++i) {
+        const auto& p = partials[i];
+        if (p.type != first.type)
+            throw std::invalid_argument("Non-matching descriptor types.");
+        if (p.extent != first.extent)
+            throw std::invalid_argument("Partial descriptors of different "
+                                        "images.");
+        if (p.counts.size() != counts.size())
+            throw std::invalid_argument(
+              "Descriptor size does not match its type.");
+        if (p.region.x + p.region.width > p.extent.width ||
+            p.region.y + p.region.height > p.extent.height)
+            throw std::invalid_argument("Region outside of the image.");
+
+        for (size_t j = 0; j < i; ++j)
+            if (p.region.overlaps(partials[j].region))
+                throw std::invalid_argument("Overlapping regions.");
+
+        for (size_t b = 0; b < counts.size(); ++b)
+            counts[b] += p.counts[b];
+        windows += p.region.area();
+    }
+
+    // Disjoint regions within the extent cover it iff their areas add up
+    if (windows != first.extent.area())
+        throw std::invalid_argument("Regions do not cover the whole image.");
+
+    return CSD(
+      CSD::histogram(counts.begin(), counts.end()), windows, first.type);
+}
+
+std::vector<grid_descriptor>
+compute_grid_descriptors(const image_view& im,
+                         const std::vector<CSDType>& types,
+                         size_t columns,
+                         size_t rows,
+                         const extraction_options& options)
+{
+    SPDLOG_DEBUG("Generating {}x{} grid descriptors", columns, rows);
+    IMAGE_MATCH_TIME_STAGE(extract);
+
+    if (columns == 0 || rows == 0)
+        throw std::invalid_argument("Empty grid.");
+    check_sampling(options);
+
+    auto resized = subsample(im);
+    auto extent = window_extent(im.width(), im.height());
+    auto counts = count_windows(resized.view(),
+                                types,
+                                extent,
+                                make_grid_cells(extent, columns, rows),
+                                options);
+
+    std::vector<grid_descriptor> grids;
+    for (size_t i = 0; i < types.size(); ++i) {
+        grid_descriptor grid{ columns, rows, {} };
+        for (auto&& cell : counts) {
+            // Images smaller than the grid or a sparse sampling may leave
+            // some of the cells empty
+            if (cell.windows)
+                grid.cells.emplace_back(
+                  cell.histograms[i], cell.windows, types[i]);
+            else
+                grid.cells.push_back(empty_descriptor(types[i]));
+        }
+        grids.push_back(std::move(grid));
+    }
 
-    data = descriptor;
+    return grids;
 }
 
+CSD::CSD(const image& im, CSDType type)
+  : CSD(im.view(), type)
+{}
+
+CSD::CSD(const image_view& im,
+         CSDType type,
+         const extraction_options& options)
+  : CSD(compute_descriptors(im, { type }, options).front())
+{}
+
 CSD::CSD(const descriptor& desc, CSDType type)
   : type{ type }
   , data{ desc }
 {}
 
+CSD::CSD(const histogram& counts, std::uint64_t windows, CSDType type)
+  : type{ type }
+  , data{ normalize(counts, windows) }
+  , counts{ counts }
+  , windows{ windows }
+{}
+
+namespace detail {
+
+void
+normalize_counts_scalar(const std::uint32_t* counts,
+                        size_t n,
+                        double total,
+                        float* dst)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<float>(counts[i] / total);
+}
+
+}
+
+namespace {
+
+using normalize_kernel = void (*)(const std::uint32_t*, size_t, double, float*);
+
+/// Fastest normalization kernel supported by the processor.
+normalize_kernel
+select_normalize_kernel()
+{
+#ifdef IMAGE_MATCH_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return detail::normalize_counts_avx2;
+    return detail::normalize_counts_sse2;
+#else
+    return detail::normalize_counts_scalar;
+#endif
+}
+
+}
+
+CSD::descriptor
+normalize(const CSD::histogram& counts, std::uint64_t windows)
+{
+    if (windows == 0)
+        throw std::invalid_argument("Cannot normalize zero windows.");
+
+    static const normalize_kernel kernel = select_normalize_kernel();
+
+    CSD::descriptor data(counts.size());
+    kernel(
+      counts.data(), counts.size(), static_cast<double>(windows), data.data());
+
+    return data;
+}
+
+CSD
+denormalize(const CSD::descriptor& desc, std::uint64_t windows, CSDType type)
+{
+    if (desc.size() != bin_count(type))
+        throw std::invalid_argument("Descriptor size does not match its type.");
+    if (windows == 0)
+        return empty_descriptor(type);
+
+    CSD::histogram counts(desc.size());
+    for (size_t i = 0; i < desc.size(); ++i)
+        counts[i] = static_cast<std::uint32_t>(std::lround(
+          static_cast<double>(desc[i]) * static_cast<double>(windows)));
+
+    return CSD(counts, windows, type);
+}
+
+CSD
+empty_descriptor(CSDType type)
+{
+    CSD csd(CSD::descriptor(bin_count(type), 0), type);
+    csd.counts.assign(bin_count(type), 0);
+    return csd;
+}
+
+CSD
+merge(const CSD& desc1, const CSD& desc2)
+{
+    if (desc1.type != desc2.type)
+        throw std::invalid_argument("Non-matching descriptor types.");
+    if (desc1.windows == 0 || desc2.windows == 0)
+        throw std::invalid_argument("Descriptor does not hold raw counts.");
+
+    std::uint64_t windows = desc1.windows + desc2.windows;
+    if (windows > std::numeric_limits<std::uint32_t>::max())
+        throw std::overflow_error("Too many windows to merge.");
+
+    CSD::histogram counts(desc1.counts.size());
+    for (size_t i = 0; i < counts.size(); ++i)
+        counts[i] = desc1.counts[i] + desc2.counts[i];
+
+    return CSD(counts, windows, desc1.type);
+}
+
+presence_integral::presence_integral(const image_view& im, CSDType type)
+  : type_{ type }
+  , extent_{ window_extent(im.width(), im.height()) }
+{
+    SPDLOG_DEBUG("Building presence integral of {}x{} positions",
+                 extent_.width,
+                 extent_.height);
+
+    const size_t bins = bin_count(type);
+    const size_t stride = (extent_.width + 1) * bins;
+    sums_.assign((extent_.height + 1) * stride, 0);
+
+    auto resized = subsample(im);
+    auto qm = std::move(quantize_region(resized.view(), { type }, extent_)[0]);
+
+    std::vector<std::uint8_t> seen(bins);
+    std::vector<std::uint32_t> row(bins);
+    for (size_t y = 0; y < extent_.height; ++y) {
+        std::fill(row.begin(), row.end(), 0);
+        const std::uint32_t* above = sums_.data() + y * stride + bins;
+        std::uint32_t* out = sums_.data() + (y + 1) * stride + bins;
+
+        for (size_t x = 0; x < extent_.width; ++x) {
+            std::fill(seen.begin(), seen.end(), 0);
+            for (size_t dy = 0; dy < STRUCTURING_ELEMENT_SIZE; ++dy)
+                for (size_t dx = 0; dx < STRUCTURING_ELEMENT_SIZE; ++dx)
+                    seen[qm[y + dy][x + dx]] = 1;
+
+            // Sum of the rows above plus the running sum of this row
+            for (size_t b = 0; b < bins; ++b) {
+                row[b] += seen[b];
+                out[b] = above[b] + row[b];
+            }
+            above += bins;
+            out += bins;
+        }
+    }
+}
+
+CSD
+presence_integral::descriptor(const window_region& region) const
+{
+    if (region.width == 0 || region.height == 0 ||
+        region.x + region.width > extent_.width ||
+        region.y + region.height > extent_.height)
+        throw std::invalid_argument("Region outside of the image.");
+
+    CSD::histogram histogram;
+    counts(region, histogram);
+
+    return CSD(histogram, region.area(), type_);
+}
+
+void
+presence_integral::counts(const window_region& region,
+                          CSD::histogram& counts) const
+{
+    const size_t bins = bin_count(type_);
+    const size_t stride = (extent_.width + 1) * bins;
+    const std::uint32_t* a = sums_.data() + region.y * stride + region.x * bins;
+    const std::uint32_t* b = a + region.width * bins;
+    const std::uint32_t* c = a + region.height * stride;
+    const std::uint32_t* d = c + region.width * bins;
+
+    counts.resize(bins);
+    for (size_t i = 0; i < bins; ++i)
+        counts[i] = d[i] - b[i] - c[i] + a[i];
+}
+
+std::vector<region_match>
+find_template(const presence_integral& integral,
+              const CSD& templ,
+              const template_search& search)
+{
+    if (templ.type != integral.type())
+        throw std::invalid_argument("Non-matching descriptor types.");
+
+    const auto& extent = integral.extent();
+    auto sizes = search.sizes;
+    if (sizes.empty()) {
+        // Squares from an eighth of the shorter side up to the whole side
+        size_t side = std::min(extent.width, extent.height);
+        for (double s = side / 8.0; s <= side; s *= 1.25)
+            sizes.push_back({ static_cast<size_t>(s),
+                              static_cast<size_t>(s) });
+    }
+
+    const size_t step = std::max<size_t>(search.step, 1);
+    const size_t bins = bin_count(templ.type);
+    std::vector<region_match> candidates;
+    CSD::histogram counts;
+    for (auto&& [width, height] : sizes) {
+        if (width == 0 || height == 0 || width > extent.width ||
+            height > extent.height)
+            continue;
+
+        const double total = static_cast<double>(width) * height;
+        for (size_t y = 0; y + height <= extent.height; y += step) {
+            for (size_t x = 0; x + width <= extent.width; x += step) {
+                window_region region{ x, y, width, height };
+                integral.counts(region, counts);
+
+                float acc = 0;
+                for (size_t i = 0; i < bins; ++i)
+                    acc += std::fabs(templ.data[i] -
+                                     static_cast<float>(counts[i] / total));
+                candidates.push_back({ acc, region });
+            }
+        }
+    }
+
+    std::sort(candidates.begin(),
+              candidates.end(),
+              [](const auto& lhs, const auto& rhs) {
+                  return lhs.distance < rhs.distance;
+              });
+
+    // Skip regions overlapping a better one, the neighbours of a match are
+    // almost as good
+    std::vector<region_match> matches;
+    for (auto&& candidate : candidates) {
+        if (matches.size() == search.count)
+            break;
+
+        bool overlaps = std::any_of(
+          matches.begin(), matches.end(), [&](const auto& match) {
+              return match.region.overlaps(candidate.region);
+          });
+        if (!overlaps)
+            matches.push_back(candidate);
+    }
+
+    return matches;
+}
+
+float
+compare(const grid_descriptor& grid1, const grid_descriptor& grid2)
+{
+    if (grid1.columns != grid2.columns || grid1.rows != grid2.rows ||
+        grid1.cells.size() != grid2.cells.size() || grid1.cells.empty())
+        throw std::invalid_argument("Non-matching grids.");
+
+    float acc = 0;
+    for (size_t i = 0; i < grid1.cells.size(); ++i)
+        acc += compare(grid1.cells[i], grid2.cells[i]);
+
+    return acc / grid1.cells.size();
+}
+
+subgrid_match
+compare_subgrids(const CSD& desc, const grid_descriptor& grid)
+{
+    SPDLOG_DEBUG(
+      "Aligning descriptor with {}x{} grid", grid.columns, grid.rows);
+
+    const size_t bins = bin_count(desc.type);
+    if (grid.cells.size() != grid.columns * grid.rows || grid.cells.empty())
+        throw std::invalid_argument("Invalid grid.");
+
+    // Prefix sums of the counts and the windows over the cells, so the
+    // counts of any rectangle of cells are obtained in O(bins)
+    const size_t stride = grid.columns + 1;
+    std::vector<std::uint64_t> counts((grid.rows + 1) * stride * bins, 0);
+    std::vector<std::uint64_t> windows((grid.rows + 1) * stride, 0);
+    for (size_t r = 0; r < grid.rows; ++r) {
+        for (size_t c = 0; c < grid.columns; ++c) {
+            const auto& cell = grid.cells[r * grid.columns + c];
+            if (cell.type != desc.type)
+                throw std::invalid_argument("Non-matching descriptor types.");
+            if (cell.windows && cell.counts.size() != bins)
+                throw std::invalid_argument(
+                  "Descriptor size does not match its type.");
+
+            size_t i = (r + 1) * stride + c + 1;
+            windows[i] = cell.windows + windows[i - 1] + windows[i - stride] -
+                         windows[i - stride - 1];
+            for (size_t b = 0; b < bins; ++b)
+                counts[i * bins + b] =
+                  (cell.windows ? cell.counts[b] : 0) +
+                  counts[(i - 1) * bins + b] +
+                  counts[(i - stride) * bins + b] -
+                  counts[(i - stride - 1) * bins + b];
+        }
+    }
+    if (windows.back() == 0)
+        throw std::invalid_argument("Grid does not hold raw counts.");
+
+    subgrid_match best{ std::numeric_limits<float>::infinity(), 0, 0, 0, 0 };
+    for (size_t r0 = 0; r0 < grid.rows; ++r0)
+        for (size_t r1 = r0 + 1; r1 <= grid.rows; ++r1)
+            for (size_t c0 = 0; c0 < grid.columns; ++c0)
+                for (size_t c1 = c0 + 1; c1 <= grid.columns; ++c1) {
+                    size_t a = r0 * stride + c0, b = r0 * stride + c1;
+                    size_t c = r1 * stride + c0, d = r1 * stride + c1;
+
+                    std::uint64_t n =
+                      windows[d] - windows[b] - windows[c] + windows[a];
+                    if (n == 0)
+                        continue;
+
+                    const double total = static_cast<double>(n);
+                    float acc = 0;
+                    for (size_t i = 0; i < bins; ++i) {
+                        std::uint64_t count =
+                          counts[d * bins + i] - counts[b * bins + i] -
+                          counts[c * bins + i] + counts[a * bins + i];
+                        acc += std::fabs(desc.data[i] -
+                                         static_cast<float>(count / total));
+                    }
+
+                    if (acc < best.distance)
+                        best = { acc, c0, r0, c1 - c0, r1 - r0 };
+                }
+
+    return best;
+}
+
 float
 compare(const CSD& desc1, const CSD& desc2)
 {
@@ -230,6 +1243,87 @@ compare(const CSD& desc1, const CSD& desc2)
     return acc;
 }
 
+/// Merge the bins of the finer type according to the coarser one.
+template<typename T>
+std::vector<T>
+unify_bins(const std::vector<T>& values,
+           CSDType from_type,
+           CSDType to_type,
+           bin_merge merge)
+{
+    const bin_layout& from = get_bin_layout(from_type);
+    const bin_layout& to = get_bin_layout(to_type);
+
+    // Every bin of the finer quantization is a union of cells of the
+    // coarser one, the hue and sum bin indices are just truncated.
+    std::vector<T> result(bin_count(to_type), 0);
+    std::vector<bool> converted(values.size(), false);
+    for (size_t subspace = 0; subspace < 5; ++subspace) {
+        size_t hue_shift = from.hue_bits[subspace] - to.hue_bits[subspace];
+        size_t sum_shift = from.sum_bits[subspace] - to.sum_bits[subspace];
+
+        for (size_t hue = 0; hue < (1u << from.hue_bits[subspace]); ++hue) {
+            for (size_t sum = 0; sum < (1u << from.sum_bits[subspace]);
+                 ++sum) {
+                size_t src = from.offsets[subspace] +
+                             ((hue << from.sum_bits[subspace]) | sum);
+                size_t dst =
+                  to.offsets[subspace] +
+                  (((hue >> hue_shift) << to.sum_bits[subspace]) |
+                   (sum >> sum_shift));
+
+                // Subspaces sharing bins must not be counted twice
+                if (converted[src])
+                    continue;
+                converted[src] = true;
+
+                if (merge == bin_merge::sum)
+                    result[dst] += values[src];
+                else
+                    result[dst] = std::max(result[dst], values[src]);
+            }
+        }
+    }
+
+    return result;
+}
+
+CSD
+convert(const CSD& desc, CSDType type, bin_merge merge)
+{
+    SPDLOG_DEBUG("Converting descriptor type={} to type={}", desc.type, type);
+
+    if (bin_count(type) > bin_count(desc.type))
+        throw std::invalid_argument(
+          "Cannot convert descriptor to a type with more bins.");
+    if (desc.data.size() != bin_count(desc.type))
+        throw std::invalid_argument("Descriptor size does not match its type.");
+
+    if (desc.windows != 0)
+        return CSD(unify_bins(desc.counts, desc.type, type, merge),
+                   desc.windows,
+                   type);
+
+    return CSD(unify_bins(desc.data, desc.type, type, merge), type);
+}
+
+size_t
+bin_count(CSDType type)
+{
+    switch (type) {
+        case CSDType::Bin32:
+            return 32;
+        case CSDType::Bin64:
+            return 64;
+        case CSDType::Bin128:
+            return 128;
+        case CSDType::Bin256:
+            return 256;
+    }
+
+    throw std::logic_error("Not implemented for given CSDType!");
+}
+
 CSDType
 csd_from_int(int t)
 {
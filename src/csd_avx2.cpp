@@ -0,0 +1,43 @@
+/**
+ * @file csd_avx2.cpp
+ * @brief AVX2 kernel of the CSD normalization.
+ *
+ * The kernel processes blocks of 8 counts the same way as the SSE2 kernel,
+ * each half of a block is converted and divided in a 256-bit register.
+ */
+#include <immintrin.h>
+
+#include "csd_kernels.hpp"
+
+namespace image_match {
+namespace detail {
+
+void
+normalize_counts_avx2(const std::uint32_t* counts,
+                      size_t n,
+                      double total,
+                      float* dst)
+{
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    const __m256d unbias = _mm256_set1_pd(2147483648.0);
+    const __m256d divisor = _mm256_set1_pd(total);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + i)),
+          bias);
+        __m256d lo = _mm256_add_pd(
+          _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), unbias);
+        __m256d hi = _mm256_add_pd(
+          _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), unbias);
+        __m256 q = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_div_pd(hi, divisor)),
+                                   _mm256_cvtpd_ps(_mm256_div_pd(lo, divisor)));
+        _mm256_storeu_ps(dst + i, q);
+    }
+
+    normalize_counts_scalar(counts + i, n - i, total, dst + i);
+}
+
+}
+}
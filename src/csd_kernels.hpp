@@ -0,0 +1,42 @@
+/**
+ * @file csd_kernels.hpp
+ * @brief Internal interface of the CSD normalization kernels.
+ */
+#ifndef _IMAGE_MATCH_CSD_KERNELS_GUARD
+#define _IMAGE_MATCH_CSD_KERNELS_GUARD
+
+#include <cstddef>
+#include <cstdint>
+
+namespace image_match {
+namespace detail {
+
+/**
+ * Divide n bin counts by the window total. Every bin is divided in double
+ * precision and rounded to float once, so all the kernels produce exactly
+ * the same output.
+ */
+void
+normalize_counts_scalar(const std::uint32_t* counts,
+                        size_t n,
+                        double total,
+                        float* dst);
+
+#ifdef IMAGE_MATCH_X86_KERNELS
+void
+normalize_counts_sse2(const std::uint32_t* counts,
+                      size_t n,
+                      double total,
+                      float* dst);
+
+void
+normalize_counts_avx2(const std::uint32_t* counts,
+                      size_t n,
+                      double total,
+                      float* dst);
+#endif
+
+}
+}
+
+#endif
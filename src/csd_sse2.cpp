@@ -0,0 +1,44 @@
+/**
+ * @file csd_sse2.cpp
+ * @brief SSE2 kernel of the CSD normalization.
+ *
+ * The kernel converts blocks of 4 counts to double, divides them by the
+ * total and rounds the quotients to float. There is no unsigned conversion,
+ * so the counts are biased into the signed range and the bias is added back
+ * exactly in double.
+ */
+#include <emmintrin.h>
+
+#include "csd_kernels.hpp"
+
+namespace image_match {
+namespace detail {
+
+void
+normalize_counts_sse2(const std::uint32_t* counts,
+                      size_t n,
+                      double total,
+                      float* dst)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128d unbias = _mm_set1_pd(2147483648.0);
+    const __m128d divisor = _mm_set1_pd(total);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(counts + i)),
+          bias);
+        __m128d lo = _mm_add_pd(_mm_cvtepi32_pd(v), unbias);
+        __m128d hi =
+          _mm_add_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)), unbias);
+        __m128 q = _mm_movelh_ps(_mm_cvtpd_ps(_mm_div_pd(lo, divisor)),
+                                 _mm_cvtpd_ps(_mm_div_pd(hi, divisor)));
+        _mm_storeu_ps(dst + i, q);
+    }
+
+    normalize_counts_scalar(counts + i, n - i, total, dst + i);
+}
+
+}
+}
@@ -3,7 +3,11 @@
  * @author Dávid Kubek
  * @date 1 March 2021
  */
+#include <stdexcept>
+
 #include "image_match/hmmd.hpp"
+#include "image_match/stats.hpp"
+#include "hmmd_kernels.hpp"
 
 #ifndef NDEBUG
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
@@ -12,45 +16,134 @@
 
 namespace image_match {
 
-void
-rgb2hmmd_pixel_inplace(pixel p)
+inline void
+rgb2hmmd_pixel(const unsigned char* src, unsigned char* dst)
 {
-    pixel::value_type min, max;
+    unsigned char r = src[0], g = src[1], b = src[2];
+    unsigned char min, max;
 
-    min =
-      p[0] < p[1] ? (p[0] < p[2] ? p[0] : p[2]) : (p[1] < p[2] ? p[1] : p[2]);
-    max =
-      p[0] > p[1] ? (p[0] > p[2] ? p[0] : p[2]) : (p[1] > p[2] ? p[1] : p[2]);
+    min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    max = r > g ? (r > b ? r : b) : (g > b ? g : b);
 
-    pixel::value_type sum, diff, hue;
+    unsigned char sum, diff, hue;
     diff = max - min;
-    sum = static_cast<pixel::value_type>(
+    sum = static_cast<unsigned char>(
       (static_cast<int>(max) + static_cast<int>(min)) >> 1);
     hue = 0;
 
     // Hue is defined same as in HSV
     if (diff) {
-        if (max == p[0])
-            hue = 43 * (p[1] - p[2]) / (max - min);
-        else if (max == p[1])
-            hue = 85 + 43 * (p[2] - p[0]) / (max - min);
+        if (max == r)
+            hue = 43 * (g - b) / (max - min);
+        else if (max == g)
+            hue = 85 + 43 * (b - r) / (max - min);
         else
-            hue = 171 + 43 * (p[0] - p[1]) / (max - min);
+            hue = 171 + 43 * (r - g) / (max - min);
+    }
+
+    dst[0] = hue;
+    dst[1] = sum;
+    dst[2] = diff;
+}
+
+namespace detail {
+
+void
+rgb2hmmd_row_scalar(const unsigned char* src, unsigned char* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i, src += 3, dst += 3)
+        rgb2hmmd_pixel(src, dst);
+}
+
+}
+
+bool
+hmmd_kernel_available(hmmd_kernel kernel)
+{
+    switch (kernel) {
+        case hmmd_kernel::automatic:
+        case hmmd_kernel::scalar:
+            return true;
+#ifdef IMAGE_MATCH_X86_KERNELS
+        case hmmd_kernel::sse41:
+            return __builtin_cpu_supports("sse4.1");
+        case hmmd_kernel::avx2:
+            return __builtin_cpu_supports("avx2");
+#else
+        case hmmd_kernel::sse41:
+        case hmmd_kernel::avx2:
+            return false;
+#endif
     }
 
-    p[0] = hue;
-    p[1] = sum;
-    p[2] = diff;
+    return false;
+}
+
+hmmd_kernel
+best_hmmd_kernel()
+{
+    static const hmmd_kernel best = []() {
+        if (hmmd_kernel_available(hmmd_kernel::avx2))
+            return hmmd_kernel::avx2;
+        if (hmmd_kernel_available(hmmd_kernel::sse41))
+            return hmmd_kernel::sse41;
+        return hmmd_kernel::scalar;
+    }();
+
+    return best;
+}
+
+using row_kernel = void (*)(const unsigned char*, unsigned char*, size_t);
+
+row_kernel
+select_row_kernel(hmmd_kernel kernel)
+{
+    if (kernel == hmmd_kernel::automatic)
+        kernel = best_hmmd_kernel();
+
+    if (!hmmd_kernel_available(kernel))
+        throw std::invalid_argument("HMMD kernel not available.");
+
+    switch (kernel) {
+#ifdef IMAGE_MATCH_X86_KERNELS
+        case hmmd_kernel::sse41:
+            return detail::rgb2hmmd_row_sse41;
+        case hmmd_kernel::avx2:
+            return detail::rgb2hmmd_row_avx2;
+#endif
+        default:
+            return detail::rgb2hmmd_row_scalar;
+    }
 }
 
 void
-rgb2hmmd(image& im)
+rgb2hmmd(const image_view& src,
+         const mutable_image_view& dst,
+         hmmd_kernel kernel)
 {
     SPDLOG_DEBUG("Converting image to HMMD color space.");
+    IMAGE_MATCH_TIME_STAGE(hmmd);
 
-    for (size_t y = 0; y < im.height(); ++y)
-        for (size_t x = 0; x < im.width(); ++x)
-            rgb2hmmd_pixel_inplace(im[y][x]);
+    if (src.channels() != 3 || dst.channels() != 3)
+        throw std::invalid_argument("HMMD conversion requires RGB images.");
+    if (src.width() != dst.width() || src.height() != dst.height())
+        throw std::invalid_argument("Non-matching image dimensions.");
+
+    auto convert_row = select_row_kernel(kernel);
+    for (size_t y = 0; y < src.height(); ++y)
+        convert_row(src.row(y), dst.row(y), src.width());
+}
+
+void
+rgb2hmmd(const mutable_image_view& im, hmmd_kernel kernel)
+{
+    rgb2hmmd(im, im, kernel);
+}
+
+void
+rgb2hmmd(image& im, hmmd_kernel kernel)
+{
+    rgb2hmmd(im.view(), kernel);
 }
 
 }
@@ -0,0 +1,145 @@
+/**
+ * @file hmmd_avx2.cpp
+ * @brief AVX2 kernel of the HMMD conversion.
+ *
+ * The kernel processes blocks of 32 pixels. Each half of a block is split
+ * into channel registers the same way as in the SSE4.1 kernel, the halves
+ * are joined and the HMMD components are computed on 256-bit registers. The
+ * reciprocals for the hue division are fetched with gather instructions.
+ */
+#include <immintrin.h>
+
+#include "hmmd_kernels.hpp"
+#include "hmmd_x86.hpp"
+
+namespace image_match {
+namespace detail {
+
+namespace {
+
+/// Compute floor(43 * n / diff) for 8 pixels, n and diff are 32-bit lanes.
+inline __m256i
+hue_quotient(__m256i n, __m256i diff)
+{
+    __m256i rcp = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(HUE_RECIPROCALS.data()), diff, 4);
+    return _mm256_srli_epi32(_mm256_mullo_epi32(n, rcp),
+                             HUE_RECIPROCAL_SHIFT);
+}
+
+/// Zero extend 8 bytes starting at the given byte of the register.
+template<int Byte>
+inline __m256i
+widen(__m256i v)
+{
+    __m128i half = _mm256_extracti128_si256(v, Byte / 16);
+    return _mm256_cvtepu8_epi32(_mm_srli_si128(half, Byte % 16));
+}
+
+/// Convert 32 pixels given as separate channel registers.
+inline void
+rgb2hmmd_block(__m256i r,
+               __m256i g,
+               __m256i b,
+               __m256i& h,
+               __m256i& s,
+               __m256i& d)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    __m256i max = _mm256_max_epu8(_mm256_max_epu8(r, g), b);
+    __m256i min = _mm256_min_epu8(_mm256_min_epu8(r, g), b);
+
+    d = _mm256_sub_epi8(max, min);
+
+    // (max + min) >> 1 without overflow, avg rounds up
+    s = _mm256_sub_epi8(
+      _mm256_avg_epu8(max, min),
+      _mm256_and_si256(_mm256_xor_si256(max, min), _mm256_set1_epi8(1)));
+
+    // Select the hue sector, red has priority over green over blue
+    __m256i is_r = _mm256_cmpeq_epi8(max, r);
+    __m256i is_g = _mm256_andnot_si256(is_r, _mm256_cmpeq_epi8(max, g));
+
+    __m256i x = _mm256_blendv_epi8(_mm256_blendv_epi8(r, b, is_g), g, is_r);
+    __m256i y = _mm256_blendv_epi8(_mm256_blendv_epi8(g, r, is_g), b, is_r);
+    __m256i base = _mm256_blendv_epi8(
+      _mm256_blendv_epi8(_mm256_set1_epi8(-85), _mm256_set1_epi8(85), is_g),
+      _mm256_setzero_si256(),
+      is_r);
+
+    // Absolute value and sign of x - y
+    __m256i xy_max = _mm256_max_epu8(x, y);
+    __m256i n = _mm256_sub_epi8(xy_max, _mm256_min_epu8(x, y));
+    __m256i negative = _mm256_xor_si256(_mm256_cmpeq_epi8(xy_max, x), ones);
+
+    __m256i q0 = hue_quotient(widen<0>(n), widen<0>(d));
+    __m256i q1 = hue_quotient(widen<8>(n), widen<8>(d));
+    __m256i q2 = hue_quotient(widen<16>(n), widen<16>(d));
+    __m256i q3 = hue_quotient(widen<24>(n), widen<24>(d));
+
+    // The packs work within 128-bit lanes, restore the pixel order
+    __m256i q = _mm256_packus_epi16(_mm256_packus_epi32(q0, q1),
+                                    _mm256_packus_epi32(q2, q3));
+    q = _mm256_permutevar8x32_epi32(
+      q, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+
+    // Apply the sign, the hue wraps around modulo 256
+    q = _mm256_sub_epi8(_mm256_xor_si256(q, negative), negative);
+    h = _mm256_add_epi8(base, q);
+}
+
+inline __m256i
+join(__m128i low, __m128i high)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+}
+
+void
+rgb2hmmd_row_avx2(const unsigned char* src, unsigned char* dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32, src += 96, dst += 96) {
+        auto in = reinterpret_cast<const __m128i*>(src);
+        __m128i a0 = _mm_loadu_si128(in);
+        __m128i b0 = _mm_loadu_si128(in + 1);
+        __m128i c0 = _mm_loadu_si128(in + 2);
+        __m128i a1 = _mm_loadu_si128(in + 3);
+        __m128i b1 = _mm_loadu_si128(in + 4);
+        __m128i c1 = _mm_loadu_si128(in + 5);
+
+        __m256i h, s, d;
+        rgb2hmmd_block(join(gather_channel<0>(a0, b0, c0),
+                            gather_channel<0>(a1, b1, c1)),
+                       join(gather_channel<1>(a0, b0, c0),
+                            gather_channel<1>(a1, b1, c1)),
+                       join(gather_channel<2>(a0, b0, c0),
+                            gather_channel<2>(a1, b1, c1)),
+                       h,
+                       s,
+                       d);
+
+        __m128i h0 = _mm256_castsi256_si128(h);
+        __m128i s0 = _mm256_castsi256_si128(s);
+        __m128i d0 = _mm256_castsi256_si128(d);
+        __m128i h1 = _mm256_extracti128_si256(h, 1);
+        __m128i s1 = _mm256_extracti128_si256(s, 1);
+        __m128i d1 = _mm256_extracti128_si256(d, 1);
+
+        auto out = reinterpret_cast<__m128i*>(dst);
+        _mm_storeu_si128(out, scatter_part<0>(h0, s0, d0));
+        _mm_storeu_si128(out + 1, scatter_part<1>(h0, s0, d0));
+        _mm_storeu_si128(out + 2, scatter_part<2>(h0, s0, d0));
+        _mm_storeu_si128(out + 3, scatter_part<0>(h1, s1, d1));
+        _mm_storeu_si128(out + 4, scatter_part<1>(h1, s1, d1));
+        _mm_storeu_si128(out + 5, scatter_part<2>(h1, s1, d1));
+    }
+
+    // Finish a remaining half block with the SSE4.1 kernel
+    rgb2hmmd_row_sse41(src, dst, n - i);
+}
+
+}
+}
@@ -0,0 +1,58 @@
+/**
+ * @file hmmd_kernels.hpp
+ * @brief Internal interface of the HMMD conversion kernels.
+ */
+#ifndef _IMAGE_MATCH_HMMD_KERNELS_GUARD
+#define _IMAGE_MATCH_HMMD_KERNELS_GUARD
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace image_match {
+namespace detail {
+
+/**
+ * Reciprocal table for the hue division. For diff = max - min > 0 and
+ * 0 <= n <= diff it holds that
+ *
+ *      43 * n / diff == (n * HUE_RECIPROCALS[diff]) >> HUE_RECIPROCAL_SHIFT
+ *
+ * The entries are ceil(43 * 2^16 / diff). The error of the rounding is at
+ * most (diff - 1) / 2^16 for each unit of n, so for n < 256 the result of the
+ * multiplication never reaches the next integer.
+ */
+constexpr unsigned int HUE_RECIPROCAL_SHIFT = 16;
+
+constexpr std::array<std::uint32_t, 256>
+make_hue_reciprocals()
+{
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t d = 1; d < table.size(); ++d)
+        table[d] = ((43u << HUE_RECIPROCAL_SHIFT) + d - 1) / d;
+
+    return table;
+}
+
+constexpr std::array<std::uint32_t, 256> HUE_RECIPROCALS =
+  make_hue_reciprocals();
+
+/**
+ * Convert n interleaved RGB pixels to HMMD. The source and destination may
+ * point to the same memory.
+ */
+void
+rgb2hmmd_row_scalar(const unsigned char* src, unsigned char* dst, size_t n);
+
+#ifdef IMAGE_MATCH_X86_KERNELS
+void
+rgb2hmmd_row_sse41(const unsigned char* src, unsigned char* dst, size_t n);
+
+void
+rgb2hmmd_row_avx2(const unsigned char* src, unsigned char* dst, size_t n);
+#endif
+
+}
+}
+
+#endif
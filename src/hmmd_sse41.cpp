@@ -0,0 +1,116 @@
+/**
+ * @file hmmd_sse41.cpp
+ * @brief SSE4.1 kernel of the HMMD conversion.
+ *
+ * The kernel processes blocks of 16 pixels. The interleaved RGB data of a
+ * block are split into one register per channel using byte shuffles, the
+ * HMMD components are computed for all 16 pixels at once and interleaved
+ * back. The hue division is done in 32-bit lanes by multiplying with a value
+ * from the reciprocal table.
+ */
+#include <smmintrin.h>
+
+#include "hmmd_kernels.hpp"
+#include "hmmd_x86.hpp"
+
+namespace image_match {
+namespace detail {
+
+namespace {
+
+/// Compute floor(43 * n / diff) for 4 pixels, n and diff are 32-bit lanes.
+inline __m128i
+hue_quotient(__m128i n, const std::uint8_t* diffs)
+{
+    __m128i rcp = _mm_setr_epi32(HUE_RECIPROCALS[diffs[0]],
+                                 HUE_RECIPROCALS[diffs[1]],
+                                 HUE_RECIPROCALS[diffs[2]],
+                                 HUE_RECIPROCALS[diffs[3]]);
+    return _mm_srli_epi32(_mm_mullo_epi32(n, rcp), HUE_RECIPROCAL_SHIFT);
+}
+
+/// Convert 16 pixels given as separate channel registers.
+inline void
+rgb2hmmd_block(__m128i r,
+               __m128i g,
+               __m128i b,
+               __m128i& h,
+               __m128i& s,
+               __m128i& d)
+{
+    const __m128i ones = _mm_set1_epi8(-1);
+
+    __m128i max = _mm_max_epu8(_mm_max_epu8(r, g), b);
+    __m128i min = _mm_min_epu8(_mm_min_epu8(r, g), b);
+
+    d = _mm_sub_epi8(max, min);
+
+    // (max + min) >> 1 without overflow, avg rounds up
+    s = _mm_sub_epi8(_mm_avg_epu8(max, min),
+                     _mm_and_si128(_mm_xor_si128(max, min), _mm_set1_epi8(1)));
+
+    // Select the hue sector, red has priority over green over blue
+    __m128i is_r = _mm_cmpeq_epi8(max, r);
+    __m128i is_g = _mm_andnot_si128(is_r, _mm_cmpeq_epi8(max, g));
+
+    __m128i x = _mm_blendv_epi8(_mm_blendv_epi8(r, b, is_g), g, is_r);
+    __m128i y = _mm_blendv_epi8(_mm_blendv_epi8(g, r, is_g), b, is_r);
+    __m128i base = _mm_blendv_epi8(
+      _mm_blendv_epi8(_mm_set1_epi8(-85), _mm_set1_epi8(85), is_g),
+      _mm_setzero_si128(),
+      is_r);
+
+    // Absolute value and sign of x - y
+    __m128i xy_max = _mm_max_epu8(x, y);
+    __m128i n = _mm_sub_epi8(xy_max, _mm_min_epu8(x, y));
+    __m128i negative = _mm_xor_si128(_mm_cmpeq_epi8(xy_max, x), ones);
+
+    alignas(16) std::uint8_t diffs[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(diffs), d);
+
+    __m128i q0 = hue_quotient(_mm_cvtepu8_epi32(n), diffs);
+    __m128i q1 =
+      hue_quotient(_mm_cvtepu8_epi32(_mm_srli_si128(n, 4)), diffs + 4);
+    __m128i q2 =
+      hue_quotient(_mm_cvtepu8_epi32(_mm_srli_si128(n, 8)), diffs + 8);
+    __m128i q3 =
+      hue_quotient(_mm_cvtepu8_epi32(_mm_srli_si128(n, 12)), diffs + 12);
+    __m128i q = _mm_packus_epi16(_mm_packus_epi32(q0, q1),
+                                 _mm_packus_epi32(q2, q3));
+
+    // Apply the sign, the hue wraps around modulo 256
+    q = _mm_sub_epi8(_mm_xor_si128(q, negative), negative);
+    h = _mm_add_epi8(base, q);
+}
+
+}
+
+void
+rgb2hmmd_row_sse41(const unsigned char* src, unsigned char* dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16, src += 48, dst += 48) {
+        auto in = reinterpret_cast<const __m128i*>(src);
+        __m128i a = _mm_loadu_si128(in);
+        __m128i b = _mm_loadu_si128(in + 1);
+        __m128i c = _mm_loadu_si128(in + 2);
+
+        __m128i h, s, d;
+        rgb2hmmd_block(gather_channel<0>(a, b, c),
+                       gather_channel<1>(a, b, c),
+                       gather_channel<2>(a, b, c),
+                       h,
+                       s,
+                       d);
+
+        auto out = reinterpret_cast<__m128i*>(dst);
+        _mm_storeu_si128(out, scatter_part<0>(h, s, d));
+        _mm_storeu_si128(out + 1, scatter_part<1>(h, s, d));
+        _mm_storeu_si128(out + 2, scatter_part<2>(h, s, d));
+    }
+
+    rgb2hmmd_row_scalar(src, dst, n - i);
+}
+
+}
+}
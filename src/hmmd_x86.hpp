@@ -0,0 +1,105 @@
+/**
+ * @file hmmd_x86.hpp
+ * @brief Byte shuffles shared by the x86 HMMD conversion kernels.
+ *
+ * The helpers have internal linkage on purpose. Each kernel is compiled with
+ * different instruction set flags, so the helpers must not be merged across
+ * translation units by the linker.
+ */
+#ifndef _IMAGE_MATCH_HMMD_X86_GUARD
+#define _IMAGE_MATCH_HMMD_X86_GUARD
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <tmmintrin.h>
+
+namespace image_match {
+namespace detail {
+
+namespace {
+
+using byte_mask = std::array<std::int8_t, 16>;
+
+/**
+ * Shuffle mask gathering the bytes of the given channel of 16 interleaved
+ * pixels that are stored in the given 16 byte part of the block.
+ */
+constexpr byte_mask
+deinterleave_mask(size_t channel, size_t part)
+{
+    byte_mask mask{};
+    for (size_t i = 0; i < 16; ++i) {
+        size_t src = 3 * i + channel;
+        mask[i] = src / 16 == part ? static_cast<std::int8_t>(src % 16) : -1;
+    }
+
+    return mask;
+}
+
+/**
+ * Shuffle mask placing the bytes of a single channel register into the given
+ * 16 byte part of the interleaved block.
+ */
+constexpr byte_mask
+interleave_mask(size_t channel, size_t part)
+{
+    byte_mask mask{};
+    for (size_t i = 0; i < 16; ++i) {
+        size_t dst = 16 * part + i;
+        mask[i] =
+          dst % 3 == channel ? static_cast<std::int8_t>(dst / 3) : -1;
+    }
+
+    return mask;
+}
+
+template<size_t Channel>
+constexpr std::array<byte_mask, 3> DEINTERLEAVE_MASKS{
+    deinterleave_mask(Channel, 0),
+    deinterleave_mask(Channel, 1),
+    deinterleave_mask(Channel, 2)
+};
+
+template<size_t Part>
+constexpr std::array<byte_mask, 3> INTERLEAVE_MASKS{
+    interleave_mask(0, Part),
+    interleave_mask(1, Part),
+    interleave_mask(2, Part)
+};
+
+inline __m128i
+load_mask(const byte_mask& mask)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask.data()));
+}
+
+template<size_t Channel>
+inline __m128i
+gather_channel(__m128i a, __m128i b, __m128i c)
+{
+    const auto& m = DEINTERLEAVE_MASKS<Channel>;
+    return _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(a, load_mask(m[0])),
+                   _mm_shuffle_epi8(b, load_mask(m[1]))),
+      _mm_shuffle_epi8(c, load_mask(m[2])));
+}
+
+template<size_t Part>
+inline __m128i
+scatter_part(__m128i h, __m128i s, __m128i d)
+{
+    const auto& m = INTERLEAVE_MASKS<Part>;
+    return _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(h, load_mask(m[0])),
+                   _mm_shuffle_epi8(s, load_mask(m[1]))),
+      _mm_shuffle_epi8(d, load_mask(m[2])));
+}
+
+}
+
+}
+}
+
+#endif
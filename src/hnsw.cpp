@@ -0,0 +1,737 @@
+/**
+ * @file hnsw.cpp
+ */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define IMAGE_MATCH_MMAP
+#endif
+
+#ifndef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/spdlog.h"
+
+#include "image_match/hnsw.hpp"
+#include "index_kernels.hpp"
+
+namespace image_match {
+
+namespace {
+
+using detail::closer;
+using detail::l1_distance_lanes;
+
+/// Highest level of a node.
+constexpr unsigned MAX_LEVEL = 16;
+
+/// Number of the mutexes guarding the links during a parallel insertion.
+constexpr size_t LINK_LOCKS = 1 << 16;
+
+constexpr char HNSW_MAGIC[8] = { 'I', 'M', 'H', 'N', 'S', 'W', 0, 0 };
+constexpr std::uint32_t HNSW_VERSION = 1;
+
+/**
+ * @brief Header of a persisted hnsw graph.
+ *
+ * The header is followed by the values of the descriptors, the links of the
+ * bottom level, the offsets of the upper blocks, the links of the upper
+ * levels and the levels of the nodes, all in the native byte order.
+ */
+struct hnsw_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t bins;
+    std::uint32_t links;
+    std::uint32_t ef_construction;
+    std::uint32_t max_level;
+    std::uint32_t entry;
+    std::uint64_t size;
+    std::uint64_t blocks;
+    std::uint64_t fingerprint;
+    std::uint64_t random_state;
+};
+
+/// Size of a list of links of the bottom level, the count first.
+size_t
+bottom_stride(size_t links)
+{
+    return 1 + 2 * links;
+}
+
+/// Size of a list of links of an upper level, the count first.
+size_t
+upper_stride(size_t links)
+{
+    return 1 + links;
+}
+
+/// Nodes already visited by a search, reset in constant time.
+class visited_set
+{
+  public:
+    void reset(size_t size)
+    {
+        if (tags_.size() < size) {
+            tags_.assign(size, 0);
+            epoch_ = 0;
+        }
+        if (++epoch_ == 0) {
+            std::fill(tags_.begin(), tags_.end(), 0);
+            epoch_ = 1;
+        }
+    }
+
+    /// Mark the node, return false if it was visited already.
+    bool insert(std::uint32_t node)
+    {
+        if (tags_[node] == epoch_)
+            return false;
+        tags_[node] = epoch_;
+        return true;
+    }
+
+  private:
+    std::vector<std::uint16_t> tags_;
+    std::uint16_t epoch_{ 0 };
+};
+
+visited_set&
+thread_visited(size_t size)
+{
+    thread_local visited_set visited;
+    visited.reset(size);
+    return visited;
+}
+
+/// Order of a min-heap of the neighbours.
+bool
+farther(const neighbor& n1, const neighbor& n2)
+{
+    return closer(n2, n1);
+}
+
+/**
+ * @brief Move greedily to the closest linked node while it gets closer.
+ *
+ * The links functor returns the list of the links of a node at the level
+ * searched, the count first.
+ */
+template<typename L, typename D>
+neighbor
+greedy_search(neighbor current, L&& links, D&& distance, size_t& distances)
+{
+    for (bool moved = true; moved;) {
+        moved = false;
+        const std::uint32_t* list = links(current.id);
+        for (std::uint32_t i = 1; i <= list[0]; ++i) {
+            float d = distance(list[i]);
+            ++distances;
+            if (d < current.distance) {
+                current = { d, list[i] };
+                moved = true;
+            }
+        }
+    }
+
+    return current;
+}
+
+/**
+ * @brief Return the ef closest nodes found from the entries at a level.
+ *
+ * The nodes are ordered by increasing distance.
+ */
+template<typename L, typename D>
+std::vector<neighbor>
+search_level(const std::vector<neighbor>& entries,
+             size_t ef,
+             L&& links,
+             D&& distance,
+             visited_set& visited,
+             size_t& distances)
+{
+    std::vector<neighbor> candidates; // Min-heap of the nodes to expand
+    std::vector<neighbor> found;      // Max-heap of the closest nodes
+    for (auto&& e : entries) {
+        visited.insert(static_cast<std::uint32_t>(e.id));
+        candidates.push_back(e);
+        found.push_back(e);
+    }
+    std::make_heap(candidates.begin(), candidates.end(), farther);
+    std::make_heap(found.begin(), found.end(), closer);
+    while (found.size() > ef) {
+        std::pop_heap(found.begin(), found.end(), closer);
+        found.pop_back();
+    }
+
+    while (!candidates.empty()) {
+        auto c = candidates.front();
+        if (found.size() >= ef && found.front().distance < c.distance)
+            break;
+        std::pop_heap(candidates.begin(), candidates.end(), farther);
+        candidates.pop_back();
+
+        const std::uint32_t* list = links(static_cast<std::uint32_t>(c.id));
+        for (std::uint32_t i = 1; i <= list[0]; ++i) {
+            if (!visited.insert(list[i]))
+                continue;
+
+            neighbor n{ distance(list[i]), list[i] };
+            ++distances;
+            if (found.size() < ef || closer(n, found.front())) {
+                candidates.push_back(n);
+                std::push_heap(candidates.begin(), candidates.end(), farther);
+                found.push_back(n);
+                std::push_heap(found.begin(), found.end(), closer);
+                if (found.size() > ef) {
+                    std::pop_heap(found.begin(), found.end(), closer);
+                    found.pop_back();
+                }
+            }
+        }
+    }
+
+    std::sort_heap(found.begin(), found.end(), closer);
+    return found;
+}
+
+/**
+ * @brief Select at most m links among the candidates ordered by distance.
+ *
+ * A candidate is skipped if it is closer to an already selected node than
+ * to the linked one, so that the links lead in diverse directions.
+ */
+template<typename D>
+std::vector<neighbor>
+select_links(const std::vector<neighbor>& candidates, size_t m, D&& between)
+{
+    std::vector<neighbor> selected;
+    for (auto&& c : candidates) {
+        if (selected.size() >= m)
+            break;
+
+        bool diverse = true;
+        for (auto&& s : selected)
+            if (between(c.id, s.id) < c.distance) {
+                diverse = false;
+                break;
+            }
+        if (diverse)
+            selected.push_back(c);
+    }
+
+    return selected;
+}
+
+[[noreturn]] void
+invalid_graph(const std::filesystem::path& file)
+{
+    throw std::runtime_error("Invalid index " + file.string() + "!");
+}
+
+}
+
+/**
+ * @brief Links the inserted nodes into the graph.
+ *
+ * With locks, several threads insert at once. The links of a node are then
+ * read and written only under the lock of the node, one lock at a time, and
+ * a node raising the top level holds the lock of the entry point during its
+ * whole insertion.
+ */
+class hnsw::builder
+{
+  public:
+    builder(hnsw& graph, bool has_entry, bool locked)
+      : graph_{ graph }
+      , has_entry_{ has_entry }
+    {
+        if (locked)
+            locks_ = std::vector<std::mutex>(LINK_LOCKS);
+    }
+
+    void insert(std::uint32_t node);
+
+  private:
+    std::uint32_t* links(std::uint32_t node, unsigned level)
+    {
+        return const_cast<std::uint32_t*>(graph_.links(node, level));
+    }
+
+    /// Return a functor copying the links at the level under the lock.
+    auto links_reader(unsigned level, std::vector<std::uint32_t>& buffer)
+    {
+        return [this, level, &buffer](std::uint32_t node) {
+            if (locks_.empty())
+                return graph_.links(node, level);
+
+            std::lock_guard<std::mutex> lock(this->lock(node));
+            const std::uint32_t* list = graph_.links(node, level);
+            buffer.assign(list, list + 1 + list[0]);
+            return static_cast<const std::uint32_t*>(buffer.data());
+        };
+    }
+
+    std::mutex& lock(std::uint32_t node)
+    {
+        return locks_[node % LINK_LOCKS];
+    }
+
+    std::unique_lock<std::mutex> guard(std::uint32_t node)
+    {
+        if (locks_.empty())
+            return {};
+        return std::unique_lock<std::mutex>(lock(node));
+    }
+
+    float between(size_t n1, size_t n2) const
+    {
+        return l1_distance_lanes(graph_.values(static_cast<std::uint32_t>(n1)),
+                                 graph_.values(static_cast<std::uint32_t>(n2)),
+                                 graph_.bins_);
+    }
+
+    /// Link the node with the selected nodes found at the level, both ways.
+    void connect(std::uint32_t node,
+                 unsigned level,
+                 const std::vector<neighbor>& found)
+    {
+        size_t capacity = level ? graph_.options_.links
+                                : 2 * graph_.options_.links;
+        auto by_distance = [this](size_t n1, size_t n2) {
+            return between(n1, n2);
+        };
+        auto selected =
+          select_links(found, graph_.options_.links, by_distance);
+
+        {
+            auto g = guard(node);
+            std::uint32_t* list = links(node, level);
+            list[0] = static_cast<std::uint32_t>(selected.size());
+            for (size_t i = 0; i < selected.size(); ++i)
+                list[1 + i] = static_cast<std::uint32_t>(selected[i].id);
+        }
+
+        for (auto&& s : selected) {
+            auto other = static_cast<std::uint32_t>(s.id);
+            auto g = guard(other);
+            std::uint32_t* list = links(other, level);
+            if (list[0] < capacity) {
+                list[1 + list[0]++] = node;
+                continue;
+            }
+
+            // Full, keep the most diverse of the links and the new one
+            std::vector<neighbor> candidates{ { s.distance, node } };
+            for (std::uint32_t i = 1; i <= list[0]; ++i)
+                candidates.push_back({ between(other, list[i]), list[i] });
+            std::sort(candidates.begin(), candidates.end(), closer);
+
+            auto kept = select_links(candidates, capacity, by_distance);
+            list[0] = static_cast<std::uint32_t>(kept.size());
+            for (size_t i = 0; i < kept.size(); ++i)
+                list[1 + i] = static_cast<std::uint32_t>(kept[i].id);
+        }
+    }
+
+    hnsw& graph_;
+    std::vector<std::mutex> locks_;
+    std::mutex entry_mutex_;
+    bool has_entry_;
+};
+
+void
+hnsw::builder::insert(std::uint32_t node)
+{
+    unsigned level = graph_.levels_[node];
+
+    std::unique_lock<std::mutex> entry_lock(entry_mutex_);
+    if (!has_entry_) {
+        graph_.entry_ = node;
+        graph_.max_level_ = level;
+        has_entry_ = true;
+        return;
+    }
+    auto entry = graph_.entry_;
+    unsigned top = graph_.max_level_;
+    if (level <= top)
+        entry_lock.unlock();
+
+    auto distance = [&](std::uint32_t other) {
+        return l1_distance_lanes(
+          graph_.values(node), graph_.values(other), graph_.bins_);
+    };
+
+    size_t distances = 0;
+    std::vector<std::uint32_t> buffer;
+    neighbor current{ distance(entry), entry };
+    for (unsigned l = top; l > level; --l)
+        current = greedy_search(
+          current, links_reader(l, buffer), distance, distances);
+
+    std::vector<neighbor> entries{ current };
+    auto& visited = thread_visited(graph_.size_);
+    for (unsigned l = std::min(level, top) + 1; l-- > 0;) {
+        auto found = search_level(entries,
+                                  graph_.options_.ef_construction,
+                                  links_reader(l, buffer),
+                                  distance,
+                                  visited,
+                                  distances);
+        connect(node, l, found);
+        entries = std::move(found);
+        visited.reset(graph_.size_);
+    }
+
+    if (level > top) {
+        graph_.entry_ = node;
+        graph_.max_level_ = level;
+    }
+}
+
+hnsw::hnsw(CSDType type, const hnsw_options& options)
+  : type_{ type }
+  , bins_{ bin_count(type) }
+  , options_{ options }
+  , fingerprint_{ detail::FINGERPRINT_BASIS }
+  , random_state_{ options.seed }
+{
+    if (options.links < 2 || options.links > 1024)
+        throw std::invalid_argument("The number of links must be 2 to 1024.");
+    if (options.ef_construction == 0)
+        throw std::invalid_argument("The construction ef must be positive.");
+}
+
+const std::uint32_t*
+hnsw::links(std::uint32_t node, unsigned level) const
+{
+    if (level == 0)
+        return bottom_view_ +
+               static_cast<size_t>(node) * bottom_stride(options_.links);
+
+    size_t block = static_cast<size_t>(offsets_view_[node]) + level - 1;
+    return upper_view_ + block * upper_stride(options_.links);
+}
+
+void
+hnsw::attach()
+{
+    values_view_ = values_.data();
+    bottom_view_ = bottom_.data();
+    offsets_view_ = offsets_.data();
+    upper_view_ = upper_.data();
+    levels_view_ = levels_.data();
+}
+
+void
+hnsw::insert(const descriptor_refs& descriptors, thread_pool* pool)
+{
+    if (mapping_)
+        throw std::logic_error("A mapped hnsw graph can't be extended.");
+    for (auto&& desc : descriptors)
+        if (desc->type != type_)
+            throw std::invalid_argument("Non-matching descriptor types.");
+    if (size_ + descriptors.size() >= std::numeric_limits<std::uint32_t>::max())
+        throw std::invalid_argument("Too many descriptors to index.");
+
+    SPDLOG_DEBUG("Inserting {} descriptors into hnsw graph of {}",
+                 descriptors.size(),
+                 size_);
+
+    auto first = static_cast<std::uint32_t>(size_);
+    size_t blocks = upper_.size() / upper_stride(options_.links);
+    double level_scale = 1 / std::log(static_cast<double>(options_.links));
+    for (auto&& desc : descriptors) {
+        values_.insert(values_.end(), desc->data.begin(), desc->data.end());
+        fingerprint_ = detail::fingerprint_append(
+          fingerprint_, desc->data.data(), desc->data.size());
+
+        // Levels are distributed geometrically with the ratio 1 / links
+        auto bits = detail::next_random(random_state_) >> 11;
+        double u = (bits + 1) * 0x1p-53;
+        auto level = static_cast<unsigned>(
+          std::min(-std::log(u) * level_scale, double(MAX_LEVEL)));
+
+        levels_.push_back(static_cast<std::uint8_t>(level));
+        offsets_.push_back(static_cast<std::uint32_t>(blocks));
+        blocks += level;
+        if (blocks >= std::numeric_limits<std::uint32_t>::max())
+            throw std::invalid_argument("Too many descriptors to index.");
+    }
+
+    size_ += descriptors.size();
+    bottom_.resize(size_ * bottom_stride(options_.links), 0);
+    upper_.resize(blocks * upper_stride(options_.links), 0);
+    attach();
+
+    builder b(*this, first > 0, pool && pool->size() > 1);
+    if (!pool || pool->size() <= 1) {
+        for (auto node = first; node < size_; ++node)
+            b.insert(node);
+        return;
+    }
+
+    std::atomic<std::uint32_t> next{ first };
+    std::vector<std::future<void>> workers;
+    for (size_t t = 0; t < pool->size(); ++t)
+        workers.push_back(pool->submit([&]() {
+            for (auto node = next++; node < size_; node = next++)
+                b.insert(node);
+        }));
+    for (auto&& w : workers)
+        w.get();
+}
+
+std::vector<neighbor>
+hnsw::search(const CSD& query,
+             size_t k,
+             size_t ef,
+             search_stats* stats) const
+{
+    if (query.type != type_)
+        throw std::invalid_argument("Non-matching descriptor types.");
+    if (size_ == 0 || k == 0)
+        return {};
+
+    const float* q = query.data.data();
+    auto distance = [&](std::uint32_t node) {
+        return l1_distance_lanes(q, values(node), bins_);
+    };
+
+    size_t distances = 1;
+    neighbor current{ distance(entry_), entry_ };
+    for (unsigned l = max_level_; l > 0; --l)
+        current = greedy_search(
+          current,
+          [&](std::uint32_t node) { return links(node, l); },
+          distance,
+          distances);
+
+    auto found = search_level(
+      { current },
+      std::max(ef, k),
+      [&](std::uint32_t node) { return links(node, 0); },
+      distance,
+      thread_visited(size_),
+      distances);
+
+    // The distances of the results as computed by compare()
+    detail::knn_heap heap(k);
+    for (auto&& n : found) {
+        auto node = static_cast<std::uint32_t>(n.id);
+        heap.push({ detail::l1_distance(q, values(node), bins_), n.id });
+    }
+
+    if (stats)
+        stats->distances += distances;
+
+    return heap.sorted();
+}
+
+void
+hnsw::save(const std::filesystem::path& file) const
+{
+    size_t blocks = size_ ? offsets_view_[size_ - 1] + levels_view_[size_ - 1]
+                          : 0;
+
+    hnsw_header header{};
+    std::memcpy(header.magic, HNSW_MAGIC, sizeof(header.magic));
+    header.version = HNSW_VERSION;
+    header.bins = static_cast<std::uint32_t>(bins_);
+    header.links = static_cast<std::uint32_t>(options_.links);
+    header.ef_construction =
+      static_cast<std::uint32_t>(options_.ef_construction);
+    header.max_level = max_level_;
+    header.entry = entry_;
+    header.size = size_;
+    header.blocks = blocks;
+    header.fingerprint = fingerprint_;
+    header.random_state = random_state_;
+
+    std::ofstream ofs{ file, std::ios::binary };
+    auto write = [&](const void* data, size_t size) {
+        ofs.write(static_cast<const char*>(data), size);
+    };
+    write(&header, sizeof(header));
+    write(values_view_, size_ * bins_ * sizeof(float));
+    write(bottom_view_,
+          size_ * bottom_stride(options_.links) * sizeof(std::uint32_t));
+    write(offsets_view_, size_ * sizeof(std::uint32_t));
+    write(upper_view_,
+          blocks * upper_stride(options_.links) * sizeof(std::uint32_t));
+    write(levels_view_, size_);
+    if (!ofs)
+        throw std::runtime_error("Could not write index " + file.string() +
+                                 "!");
+}
+
+hnsw
+hnsw::open(const std::filesystem::path& file)
+{
+    std::shared_ptr<const void> mapping;
+    size_t file_size = 0;
+#ifdef IMAGE_MATCH_MMAP
+    int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+    }
+    file_size = static_cast<size_t>(st.st_size);
+    if (file_size < sizeof(hnsw_header)) {
+        ::close(fd);
+        invalid_graph(file);
+    }
+
+    void* addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+        throw std::runtime_error("Could not map index " + file.string() +
+                                 "!");
+    mapping = std::shared_ptr<const void>(
+      addr, [file_size](const void* p) {
+          munmap(const_cast<void*>(p), file_size);
+      });
+#else
+    std::ifstream ifs{ file, std::ios::binary | std::ios::ate };
+    if (!ifs)
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+    file_size = static_cast<size_t>(ifs.tellg());
+    auto buffer = std::make_shared<std::vector<char>>(file_size);
+    ifs.seekg(0);
+    ifs.read(buffer->data(), file_size);
+    if (!ifs || file_size < sizeof(hnsw_header))
+        invalid_graph(file);
+    mapping = std::shared_ptr<const void>(buffer, buffer->data());
+#endif
+
+    auto bytes = static_cast<const char*>(mapping.get());
+    hnsw_header header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, HNSW_MAGIC, 8) != 0 ||
+        header.version != HNSW_VERSION)
+        invalid_graph(file);
+
+    CSDType type;
+    try {
+        type = csd_from_int(static_cast<int>(header.bins));
+    } catch (std::invalid_argument&) {
+        invalid_graph(file);
+    }
+    if (header.links < 2 || header.links > 1024 || !header.ef_construction)
+        invalid_graph(file);
+
+    hnsw_options options;
+    options.links = header.links;
+    options.ef_construction = header.ef_construction;
+
+    hnsw graph{ type, options };
+    graph.size_ = header.size;
+    graph.entry_ = header.entry;
+    graph.max_level_ = header.max_level;
+    graph.fingerprint_ = header.fingerprint;
+    graph.random_state_ = header.random_state;
+
+    size_t bottom = bottom_stride(header.links);
+    size_t upper = upper_stride(header.links);
+    size_t expected = sizeof(header) +
+                      header.size * header.bins * sizeof(float) +
+                      header.size * bottom * sizeof(std::uint32_t) +
+                      header.size * sizeof(std::uint32_t) +
+                      header.blocks * upper * sizeof(std::uint32_t) +
+                      header.size;
+    if (header.size >= std::numeric_limits<std::uint32_t>::max() ||
+        header.blocks >= std::numeric_limits<std::uint32_t>::max() ||
+        file_size != expected || header.max_level > MAX_LEVEL ||
+        (header.size && header.entry >= header.size))
+        invalid_graph(file);
+
+    auto section = bytes + sizeof(header);
+    auto take = [&](size_t size) {
+        auto begin = section;
+        section += size;
+        return begin;
+    };
+    graph.values_view_ = reinterpret_cast<const float*>(
+      take(header.size * header.bins * sizeof(float)));
+    graph.bottom_view_ = reinterpret_cast<const std::uint32_t*>(
+      take(header.size * bottom * sizeof(std::uint32_t)));
+    graph.offsets_view_ = reinterpret_cast<const std::uint32_t*>(
+      take(header.size * sizeof(std::uint32_t)));
+    graph.upper_view_ = reinterpret_cast<const std::uint32_t*>(
+      take(header.blocks * upper * sizeof(std::uint32_t)));
+    graph.levels_view_ =
+      reinterpret_cast<const std::uint8_t*>(take(header.size));
+    graph.mapping_ = std::move(mapping);
+
+    // Reject corrupted structure rather than read out of bounds, the search
+    // descends from the entry through all the levels up to the top one
+    if (header.size && graph.levels_view_[header.entry] != header.max_level)
+        invalid_graph(file);
+    size_t blocks = 0;
+    for (std::uint32_t node = 0; node < header.size; ++node) {
+        unsigned level = graph.levels_view_[node];
+        if (level > header.max_level || graph.offsets_view_[node] != blocks)
+            invalid_graph(file);
+        blocks += level;
+        if (blocks > header.blocks)
+            invalid_graph(file);
+        for (unsigned l = 0; l <= level; ++l) {
+            const std::uint32_t* list = graph.links(node, l);
+            if (list[0] > (l ? upper - 1 : bottom - 1))
+                invalid_graph(file);
+            for (std::uint32_t i = 1; i <= list[0]; ++i)
+                if (list[i] >= header.size)
+                    invalid_graph(file);
+        }
+    }
+    if (blocks != header.blocks)
+        invalid_graph(file);
+
+    return graph;
+}
+
+hnsw
+hnsw::load(const std::filesystem::path& file)
+{
+    auto graph = open(file);
+
+    size_t blocks = graph.size_ ? graph.offsets_view_[graph.size_ - 1] +
+                                    graph.levels_view_[graph.size_ - 1]
+                                : 0;
+    graph.values_.assign(graph.values_view_,
+                         graph.values_view_ + graph.size_ * graph.bins_);
+    graph.bottom_.assign(
+      graph.bottom_view_,
+      graph.bottom_view_ + graph.size_ * bottom_stride(graph.options_.links));
+    graph.offsets_.assign(graph.offsets_view_,
+                          graph.offsets_view_ + graph.size_);
+    graph.upper_.assign(
+      graph.upper_view_,
+      graph.upper_view_ + blocks * upper_stride(graph.options_.links));
+    graph.levels_.assign(graph.levels_view_,
+                         graph.levels_view_ + graph.size_);
+    graph.mapping_.reset();
+    graph.attach();
+
+    return graph;
+}
+
+}
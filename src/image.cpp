@@ -6,6 +6,7 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <memory>
@@ -23,6 +24,7 @@
 #include "stb_image_resize.h"
 
 #include "image_match/image.hpp"
+#include "image_match/stats.hpp"
 
 #define MAGIC_NUMBER_BYTES 8
 
@@ -30,6 +32,21 @@ namespace image_match {
 
 namespace fs = std::filesystem;
 
+#ifdef IMAGE_MATCH_STAGE_TIMERS
+namespace {
+
+/// Size of the file, 0 if it can't be read.
+std::uintmax_t
+file_bytes(const fs::path& file)
+{
+    std::error_code ec;
+    auto size = fs::file_size(file, ec);
+    return ec ? 0 : size;
+}
+
+}
+#endif
+
 void
 image_wrapper_deleter::operator()(unsigned char* data) const
 {
@@ -38,11 +55,20 @@ image_wrapper_deleter::operator()(unsigned char* data) const
 
 image::image(const fs::path& image_path)
 {
+    IMAGE_MATCH_TIME_STAGE(decode);
+
+    // Grayscale images (optionally with alpha) are loaded with a single
+    // channel, everything else is converted to RGB.
     int width, height, channels;
-    auto image_data = image_wrapper(
-      stbi_load(image_path.c_str(), &width, &height, &channels, 3));
+    int desired_channels = 3;
+    if (stbi_info(image_path.c_str(), &width, &height, &channels) &&
+        (channels == 1 || channels == 2))
+        desired_channels = 1;
 
-    if (!image_data.get() || channels != 3) {
+    auto image_data = image_wrapper(stbi_load(
+      image_path.c_str(), &width, &height, &channels, desired_channels));
+
+    if (!image_data.get()) {
         SPDLOG_DEBUG("Error reading file {}", image_path.string());
 
         fail_ = true;
@@ -52,9 +78,32 @@ image::image(const fs::path& image_path)
 
     width_ = width;
     height_ = height;
-    channels_ = channels;
+    channels_ = desired_channels;
 
     data_ = std::move(image_data);
+
+    IMAGE_MATCH_COUNT(bytes_read, file_bytes(image_path));
+    IMAGE_MATCH_COUNT(pixels, width_ * height_);
+    IMAGE_MATCH_COUNT(images, 1);
+}
+
+std::optional<image_info>
+probe_image(const fs::path& image_path)
+{
+    IMAGE_MATCH_TIME_STAGE(probe);
+
+    int width, height, channels;
+    if (!stbi_info(image_path.c_str(), &width, &height, &channels)) {
+        SPDLOG_DEBUG("Error probing file {}", image_path.string());
+        return std::nullopt;
+    }
+
+    image_info info;
+    info.width = width;
+    info.height = height;
+    info.channels = channels;
+
+    return info;
 }
 
 image::image(size_t width, size_t height, size_t channels)
@@ -62,24 +111,29 @@ image::image(size_t width, size_t height, size_t channels)
   , height_{ height }
   , channels_{ channels }
 {
-    data_ = image_wrapper(new unsigned char[width * height * channels]);
+    // Allocate with malloc, the buffer is released by stbi_image_free()
+    data_ = image_wrapper(
+      static_cast<unsigned char*>(std::malloc(width * height * channels)));
 }
 
 image
-subsampled_shift(const image& im,
+subsampled_shift(const image_view& im,
                  std::uint32_t shift,
                  size_t min_width,
                  size_t min_height)
 {
     SPDLOG_DEBUG("Subsampling image: width={}, height={}, channels={} "
-                 "shift={}, min_width={}, min_height={}",
+                 "stride={}, shift={}, min_width={}, min_height={}",
                  im.width(),
                  im.height(),
                  im.channels(),
+                 im.stride(),
                  shift,
                  min_width,
                  min_height);
 
+    IMAGE_MATCH_TIME_STAGE(subsample);
+
     int out_w = std::max(min_width, im.width() >> shift);
     int out_h = std::max(min_height, im.height() >> shift);
 
@@ -87,10 +141,10 @@ subsampled_shift(const image& im,
 
     image new_image(out_w, out_h, im.channels());
 
-    stbir_resize_uint8(im.data().get(),
+    stbir_resize_uint8(im.data(),
                        im.width(),
                        im.height(),
-                       0,
+                       im.stride(),
                        new_image.data().get(),
                        out_w,
                        out_h,
@@ -0,0 +1,450 @@
+/**
+ * @file index.cpp
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#ifndef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/spdlog.h"
+
+#include "image_match/index.hpp"
+#include "index_kernels.hpp"
+
+namespace image_match {
+
+namespace {
+
+using detail::knn_heap;
+using detail::l1_distance;
+using detail::next_random;
+using detail::prunable;
+
+constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+/// Subtrees of at most this many descriptors are scanned linearly.
+constexpr std::uint32_t LEAF_SIZE = 8;
+
+constexpr char VP_TREE_MAGIC[8] = { 'I', 'M', 'V', 'P', 'T', 'R', 'E', 'E' };
+constexpr std::uint32_t VP_TREE_VERSION = 1;
+
+/// Header of a persisted vp_tree.
+struct vp_tree_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t bins;
+    std::uint64_t size;
+    std::uint64_t fingerprint;
+    std::uint64_t nodes;
+};
+
+void
+check_types(const descriptor_refs& descriptors)
+{
+    for (auto&& desc : descriptors)
+        if (desc->type != descriptors.front()->type)
+            throw std::invalid_argument("Non-matching descriptor types.");
+}
+
+}
+
+std::vector<neighbor>
+brute_force_search(const descriptor_refs& descriptors,
+                   const CSD& query,
+                   size_t k,
+                   search_stats* stats)
+{
+    knn_heap heap(k);
+    for (size_t i = 0; i < descriptors.size(); ++i)
+        heap.push({ compare(query, *descriptors[i]), i });
+
+    if (stats)
+        stats->distances += descriptors.size();
+
+    return heap.sorted();
+}
+
+std::vector<neighbor>
+cascade_search(const descriptor_refs& coarse,
+               const descriptor_refs& fine,
+               const CSD& coarse_query,
+               const CSD& fine_query,
+               size_t k,
+               size_t pool,
+               search_stats* stats)
+{
+    if (coarse.size() != fine.size())
+        throw std::invalid_argument("Non-matching cascade descriptors.");
+
+    // Only the order of the coarse distances matters, so they are summed in
+    // the faster lanes
+    knn_heap candidates(std::max(k, pool));
+    const float* q = coarse_query.data.data();
+    size_t bins = coarse_query.data.size();
+    for (size_t i = 0; i < coarse.size(); ++i) {
+        if (coarse[i]->type != coarse_query.type)
+            throw std::invalid_argument("Non-matching descriptor types.");
+        candidates.push(
+          { detail::l1_distance_lanes(q, coarse[i]->data.data(), bins), i });
+    }
+
+    knn_heap heap(k);
+    auto pooled = candidates.sorted();
+    for (auto&& n : pooled)
+        heap.push({ compare(fine_query, *fine[n.id]), n.id });
+
+    if (stats)
+        stats->distances += coarse.size() + pooled.size();
+
+    return heap.sorted();
+}
+
+std::uint64_t
+descriptor_fingerprint(const descriptor_refs& descriptors)
+{
+    std::uint64_t hash = detail::FINGERPRINT_BASIS;
+    for (auto&& desc : descriptors)
+        hash = detail::fingerprint_append(
+          hash, desc->data.data(), desc->data.size());
+
+    return hash;
+}
+
+vp_tree::vp_tree(const descriptor_refs& descriptors, std::uint64_t seed)
+  : descriptors_{ descriptors }
+{
+    if (descriptors.size() >= NONE)
+        throw std::invalid_argument("Too many descriptors to index.");
+    check_types(descriptors);
+
+    SPDLOG_DEBUG("Building VP-tree of {} descriptors", descriptors.size());
+
+    items_.resize(descriptors.size());
+    for (std::uint32_t i = 0; i < items_.size(); ++i)
+        items_[i] = i;
+
+    if (!items_.empty())
+        build(0, static_cast<std::uint32_t>(items_.size()), seed);
+    gather_values();
+}
+
+void
+vp_tree::gather_values()
+{
+    bins_ = descriptors_.empty() ? 0 : descriptors_.front()->data.size();
+    values_.resize(items_.size() * bins_);
+    for (size_t i = 0; i < items_.size(); ++i)
+        std::copy(descriptors_[items_[i]]->data.begin(),
+                  descriptors_[items_[i]]->data.end(),
+                  values_.begin() + i * bins_);
+}
+
+std::uint32_t
+vp_tree::build(std::uint32_t begin, std::uint32_t end, std::uint64_t& state)
+{
+    auto id = static_cast<std::uint32_t>(nodes_.size());
+    nodes_.push_back({ begin, end, 0, NONE, NONE });
+    if (end - begin <= LEAF_SIZE)
+        return id;
+
+    // Random vantage point, moved to the front of the range
+    auto pivot = begin + next_random(state) % (end - begin);
+    std::swap(items_[begin], items_[pivot]);
+    const CSD& vantage = *descriptors_[items_[begin]];
+
+    std::vector<std::pair<float, std::uint32_t>> distances;
+    for (std::uint32_t i = begin + 1; i < end; ++i)
+        distances.push_back({ compare(vantage, *descriptors_[items_[i]]),
+                              items_[i] });
+
+    // The first half lies within the median distance, the rest beyond
+    auto middle = distances.begin() + distances.size() / 2;
+    std::nth_element(distances.begin(), middle, distances.end());
+    for (size_t i = 0; i < distances.size(); ++i)
+        items_[begin + 1 + i] = distances[i].second;
+
+    auto split = begin + 1 + static_cast<std::uint32_t>(distances.size() / 2);
+    float radius = middle->first;
+    auto inside = build(begin + 1, split, state);
+    auto outside = build(split, end, state);
+
+    nodes_[id].radius = radius;
+    nodes_[id].inside = inside;
+    nodes_[id].outside = outside;
+
+    return id;
+}
+
+std::vector<neighbor>
+vp_tree::search(const CSD& query, size_t k, search_stats* stats) const
+{
+    knn_heap heap(k);
+    if (nodes_.empty() || k == 0)
+        return heap.sorted();
+    if (query.type != descriptors_.front()->type)
+        throw std::invalid_argument("Non-matching descriptor types.");
+
+    auto distance = [&](std::uint32_t i) {
+        return l1_distance(query.data.data(), &values_[i * bins_], bins_);
+    };
+
+    size_t distances = 0;
+    auto visit = [&](auto&& self, std::uint32_t id) -> void {
+        const node& n = nodes_[id];
+        if (n.inside == NONE) {
+            for (auto i = n.begin; i < n.end; ++i)
+                heap.push({ distance(i), items_[i] });
+            distances += n.end - n.begin;
+            return;
+        }
+
+        float d = distance(n.begin);
+        heap.push({ d, items_[n.begin] });
+        ++distances;
+
+        // Descriptors inside lie at least d - radius from the query, the
+        // ones outside at least radius - d
+        auto visit_inside = [&]() {
+            float tau = heap.bound();
+            if (!prunable(d - n.radius, tau, d + n.radius + tau))
+                self(self, n.inside);
+        };
+        auto visit_outside = [&]() {
+            float tau = heap.bound();
+            if (!prunable(n.radius - d, tau, d + n.radius + tau))
+                self(self, n.outside);
+        };
+
+        if (d < n.radius) {
+            visit_inside();
+            visit_outside();
+        } else {
+            visit_outside();
+            visit_inside();
+        }
+    };
+    visit(visit, 0);
+
+    if (stats)
+        stats->distances += distances;
+
+    return heap.sorted();
+}
+
+void
+vp_tree::save(const std::filesystem::path& file) const
+{
+    vp_tree_header header{};
+    std::memcpy(header.magic, VP_TREE_MAGIC, sizeof(header.magic));
+    header.version = VP_TREE_VERSION;
+    header.bins = descriptors_.empty()
+                    ? 0
+                    : static_cast<std::uint32_t>(
+                        bin_count(descriptors_.front()->type));
+    header.size = descriptors_.size();
+    header.fingerprint = descriptor_fingerprint(descriptors_);
+    header.nodes = nodes_.size();
+
+    std::ofstream ofs{ file, std::ios::binary };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(items_.data()),
+              items_.size() * sizeof(std::uint32_t));
+    ofs.write(reinterpret_cast<const char*>(nodes_.data()),
+              nodes_.size() * sizeof(node));
+    if (!ofs)
+        throw std::runtime_error("Could not write index " + file.string() +
+                                 "!");
+}
+
+vp_tree
+vp_tree::load(const std::filesystem::path& file,
+              const descriptor_refs& descriptors)
+{
+    std::ifstream ifs{ file, std::ios::binary };
+    if (!ifs)
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+
+    vp_tree_header header{};
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, VP_TREE_MAGIC, 8) != 0 ||
+        header.version != VP_TREE_VERSION)
+        throw std::runtime_error("Invalid index " + file.string() + "!");
+
+    std::uint32_t bins = descriptors.empty()
+                           ? 0
+                           : static_cast<std::uint32_t>(
+                               bin_count(descriptors.front()->type));
+    if (header.size != descriptors.size() || header.bins != bins ||
+        header.fingerprint != descriptor_fingerprint(descriptors))
+        throw std::runtime_error("Index " + file.string() +
+                                 " does not match the database!");
+
+    vp_tree tree;
+    tree.descriptors_ = descriptors;
+    tree.items_.resize(header.size);
+    tree.nodes_.resize(header.nodes);
+    ifs.read(reinterpret_cast<char*>(tree.items_.data()),
+             tree.items_.size() * sizeof(std::uint32_t));
+    ifs.read(reinterpret_cast<char*>(tree.nodes_.data()),
+             tree.nodes_.size() * sizeof(node));
+    if (!ifs)
+        throw std::runtime_error("Invalid index " + file.string() + "!");
+
+    // Reject corrupted structure rather than read out of bounds
+    for (auto&& item : tree.items_)
+        if (item >= header.size)
+            throw std::runtime_error("Invalid index " + file.string() + "!");
+    for (auto&& n : tree.nodes_)
+        if (n.begin >= n.end || n.end > header.size ||
+            (n.inside != NONE && n.inside >= header.nodes) ||
+            (n.outside != NONE && n.outside >= header.nodes) ||
+            ((n.inside == NONE) != (n.outside == NONE)))
+            throw std::runtime_error("Invalid index " + file.string() + "!");
+
+    tree.gather_values();
+
+    return tree;
+}
+
+namespace detail {
+
+std::uint32_t
+closest_centroid(const float* values,
+                 const std::vector<float>& centroids,
+                 size_t dims)
+{
+    std::uint32_t best = 0;
+    float best_distance = std::numeric_limits<float>::infinity();
+    for (size_t c = 0; c * dims < centroids.size(); ++c) {
+        float d = l1_distance_lanes(values, &centroids[c * dims], dims);
+        if (d < best_distance) {
+            best_distance = d;
+            best = static_cast<std::uint32_t>(c);
+        }
+    }
+
+    return best;
+}
+
+std::vector<std::uint32_t>
+group_by_label(const std::vector<std::uint32_t>& labels,
+               size_t groups,
+               std::vector<std::uint32_t>& order)
+{
+    std::vector<std::uint32_t> offsets(groups + 1, 0);
+    for (auto&& l : labels)
+        ++offsets[l + 1];
+    for (size_t g = 0; g < groups; ++g)
+        offsets[g + 1] += offsets[g];
+
+    auto next = offsets;
+    order.resize(labels.size());
+    for (std::uint32_t i = 0; i < labels.size(); ++i)
+        order[next[labels[i]]++] = i;
+
+    return offsets;
+}
+
+std::vector<float>
+k_medians(const std::vector<const float*>& points,
+          size_t dims,
+          size_t k,
+          size_t iterations,
+          std::mt19937_64& rng,
+          thread_pool* pool)
+{
+    // k-medians++ initialization, the next centroid is chosen with the
+    // probability proportional to the distance from the closest one
+    std::vector<float> centroids;
+    auto add_centroid = [&](size_t i) {
+        centroids.insert(centroids.end(), points[i], points[i] + dims);
+    };
+    add_centroid(
+      std::uniform_int_distribution<size_t>(0, points.size() - 1)(rng));
+
+    std::vector<float> closest(points.size(),
+                               std::numeric_limits<float>::infinity());
+    std::uniform_real_distribution<double> uniform(0, 1);
+    for (size_t c = 1; c < k; ++c) {
+        const float* last = &centroids[(c - 1) * dims];
+        parallel_chunks(pool, points.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                closest[i] = std::min(
+                  closest[i], l1_distance_lanes(points[i], last, dims));
+        });
+
+        double total = 0;
+        for (auto&& d : closest)
+            total += d;
+
+        size_t chosen = points.size() - 1;
+        double target = uniform(rng) * total;
+        for (size_t i = 0; i < points.size(); ++i) {
+            target -= closest[i];
+            if (target < 0) {
+                chosen = i;
+                break;
+            }
+        }
+        add_centroid(chosen);
+    }
+
+    // Lloyd iterations with the per coordinate medians
+    std::vector<std::uint32_t> labels(points.size(), 0);
+    std::vector<std::uint32_t> order;
+    for (size_t it = 0; it < iterations; ++it) {
+        std::vector<std::uint8_t> reassigned(points.size(), 0);
+        parallel_chunks(pool, points.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                auto l = closest_centroid(points[i], centroids, dims);
+                reassigned[i] = l != labels[i];
+                labels[i] = l;
+            }
+        });
+        size_t changed = 0;
+        for (auto&& r : reassigned)
+            changed += r;
+        if (it && !changed)
+            break;
+
+        auto offsets = group_by_label(labels, k, order);
+        parallel_chunks(pool, k, [&](size_t begin, size_t end) {
+            std::vector<float> values;
+            for (size_t c = begin; c < end; ++c) {
+                if (offsets[c] == offsets[c + 1])
+                    continue;
+                for (size_t b = 0; b < dims; ++b) {
+                    values.clear();
+                    for (auto i = offsets[c]; i < offsets[c + 1]; ++i)
+                        values.push_back(points[order[i]][b]);
+                    auto median = values.begin() + values.size() / 2;
+                    std::nth_element(values.begin(), median, values.end());
+                    centroids[c * dims + b] = *median;
+                }
+            }
+        });
+
+        // An empty cluster restarts from a random point
+        for (size_t c = 0; c < k; ++c)
+            if (offsets[c] == offsets[c + 1]) {
+                size_t i = std::uniform_int_distribution<size_t>(
+                  0, points.size() - 1)(rng);
+                std::copy(points[i], points[i] + dims, &centroids[c * dims]);
+            }
+
+        SPDLOG_DEBUG("k-medians iteration {}: {} reassigned", it, changed);
+    }
+
+    return centroids;
+}
+
+}
+
+}
@@ -0,0 +1,219 @@
+/**
+ * @file index_kernels.hpp
+ * @brief Internal helpers shared by the indexes.
+ */
+#ifndef _IMAGE_MATCH_INDEX_KERNELS_GUARD
+#define _IMAGE_MATCH_INDEX_KERNELS_GUARD
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "image_match/index.hpp"
+#include "image_match/thread_pool.hpp"
+
+namespace image_match {
+namespace detail {
+
+/// Order of the neighbours, by distance and then by position.
+inline bool
+closer(const neighbor& n1, const neighbor& n2)
+{
+    return n1.distance < n2.distance ||
+           (n1.distance == n2.distance && n1.id < n2.id);
+}
+
+/// Collects the k nearest neighbours seen so far.
+class knn_heap
+{
+  public:
+    explicit knn_heap(size_t k)
+      : k_{ k }
+    {}
+
+    size_t size() const { return heap_.size(); }
+
+    /// Distance of the k-th neighbour, infinity until k were seen.
+    float bound() const
+    {
+        return heap_.size() < k_ ? std::numeric_limits<float>::infinity()
+                                 : heap_.front().distance;
+    }
+
+    void push(const neighbor& n)
+    {
+        if (heap_.size() < k_) {
+            heap_.push_back(n);
+            std::push_heap(heap_.begin(), heap_.end(), closer);
+        } else if (k_ && closer(n, heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), closer);
+            heap_.back() = n;
+            std::push_heap(heap_.begin(), heap_.end(), closer);
+        }
+    }
+
+    /// Return the neighbours ordered by increasing distance.
+    std::vector<neighbor> sorted()
+    {
+        std::sort_heap(heap_.begin(), heap_.end(), closer);
+        return std::move(heap_);
+    }
+
+  private:
+    size_t k_;
+    std::vector<neighbor> heap_;
+};
+
+/**
+ * @brief Return the L1 distance of the values.
+ *
+ * The values are summed in the same order as by compare(), so the distances
+ * are identical to the ones of the linear scan.
+ */
+inline float
+l1_distance(const float* values1, const float* values2, size_t bins)
+{
+    float acc = 0;
+    for (size_t i = 0; i < bins; ++i)
+        acc += std::fabs(values1[i] - values2[i]);
+
+    return acc;
+}
+
+/**
+ * @brief Return the L1 distance of the values, summed in eight lanes.
+ *
+ * The independent sums vectorize, but round differently than compare().
+ */
+inline float
+l1_distance_lanes(const float* values1, const float* values2, size_t bins)
+{
+    float acc[8] = {};
+    size_t i = 0;
+    for (; i + 8 <= bins; i += 8)
+        for (size_t j = 0; j < 8; ++j)
+            acc[j] += std::fabs(values1[i + j] - values2[i + j]);
+    for (; i < bins; ++i)
+        acc[i % 8] += std::fabs(values1[i] - values2[i]);
+
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) +
+           ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+/**
+ * Relative margin of the pruning. The distances are sums of up to 256 terms
+ * in single precision, so their relative error stays below 256 * 2^-24, about
+ * 1.5e-5, and a bound computed from two distances can't overshoot by more.
+ */
+constexpr float PRUNE_MARGIN = 1e-4f;
+
+/// Return true if a bound of the distance excludes the neighbours.
+inline bool
+prunable(float bound, float tau, float scale)
+{
+    return bound > tau + PRUNE_MARGIN * scale;
+}
+
+/// Initial value of the descriptor fingerprints.
+constexpr std::uint64_t FINGERPRINT_BASIS = 0xCBF29CE484222325ull;
+
+/// Extend the FNV-1a fingerprint by the bin count and the values.
+inline std::uint64_t
+fingerprint_append(std::uint64_t hash, const float* values, size_t bins)
+{
+    auto add = [&](const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ull;
+        }
+    };
+
+    std::uint32_t count = static_cast<std::uint32_t>(bins);
+    add(&count, sizeof(count));
+    add(values, bins * sizeof(float));
+
+    return hash;
+}
+
+/**
+ * @brief Call fn(begin, end) on consecutive chunks of [0, count).
+ *
+ * With a pool of several workers the chunks are processed in parallel,
+ * otherwise the whole range is processed at once.
+ */
+template<typename F>
+void
+parallel_chunks(thread_pool* pool, size_t count, F&& fn)
+{
+    size_t workers = pool ? pool->size() : 1;
+    if (workers <= 1 || count < 2) {
+        fn(size_t{ 0 }, count);
+        return;
+    }
+
+    size_t chunks = std::min(count, 4 * workers);
+    std::vector<std::future<void>> results;
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t begin = count * c / chunks;
+        size_t end = count * (c + 1) / chunks;
+        results.push_back(
+          pool->submit([&fn, begin, end]() { fn(begin, end); }));
+    }
+    for (auto&& r : results)
+        r.get();
+}
+
+/// Return the index of the closest of the centroids of the dimension.
+std::uint32_t
+closest_centroid(const float* values,
+                 const std::vector<float>& centroids,
+                 size_t dims);
+
+/**
+ * @brief Group the items by their labels.
+ *
+ * Fills the order with the items sorted by their labels and returns the
+ * offsets of the groups in it.
+ */
+std::vector<std::uint32_t>
+group_by_label(const std::vector<std::uint32_t>& labels,
+               size_t groups,
+               std::vector<std::uint32_t>& order);
+
+/**
+ * @brief Cluster the points of the dimension into k clusters by k-medians.
+ *
+ * The points are assigned to the closest centroids by the L1 distance and
+ * every centroid moves to the per coordinate median of its points, which
+ * minimizes the sum of their distances. The initial centroids are chosen by
+ * k-medians++ drawing from the generator. Returns the centroids one after
+ * another, the points must not be fewer than k.
+ */
+std::vector<float>
+k_medians(const std::vector<const float*>& points,
+          size_t dims,
+          size_t k,
+          size_t iterations,
+          std::mt19937_64& rng,
+          thread_pool* pool);
+
+/// Next value of the splitmix64 sequence.
+inline std::uint64_t
+next_random(std::uint64_t& state)
+{
+    std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+}
+}
+
+#endif
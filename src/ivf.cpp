@@ -0,0 +1,294 @@
+/**
+ * @file ivf.cpp
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#ifndef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/spdlog.h"
+
+#include "image_match/ivf.hpp"
+#include "index_kernels.hpp"
+
+namespace image_match {
+
+namespace {
+
+using detail::closest_centroid;
+using detail::group_by_label;
+using detail::l1_distance_lanes;
+using detail::parallel_chunks;
+
+constexpr char IVF_MAGIC[8] = { 'I', 'M', 'I', 'V', 'F', 0, 0, 0 };
+constexpr std::uint32_t IVF_VERSION = 1;
+
+/**
+ * @brief Header of a persisted ivf index.
+ *
+ * The header is followed by the centroids, the offsets of the lists, the
+ * positions of the descriptors and their values in the stored format.
+ */
+struct ivf_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t bins;
+    std::uint32_t storage;
+    std::uint32_t lists;
+    std::uint64_t size;
+    std::uint64_t fingerprint;
+};
+
+/// Return the value rounded to the 8-bit format.
+inline std::uint8_t
+encode(float value)
+{
+    return static_cast<std::uint8_t>(
+      std::lround(std::clamp(value, 0.0f, 1.0f) * 255));
+}
+
+/// Return the L1 distance of values in the 8-bit format, in the steps.
+inline std::uint32_t
+l1_distance_codes(const std::uint8_t* codes1,
+                  const std::uint8_t* codes2,
+                  size_t bins)
+{
+    std::uint32_t acc = 0;
+    for (size_t i = 0; i < bins; ++i)
+        acc += static_cast<std::uint32_t>(std::abs(codes1[i] - codes2[i]));
+
+    return acc;
+}
+
+[[noreturn]] void
+invalid_index(const std::filesystem::path& file)
+{
+    throw std::runtime_error("Invalid index " + file.string() + "!");
+}
+
+}
+
+ivf::ivf(const descriptor_refs& descriptors,
+         const ivf_options& options,
+         thread_pool* pool)
+  : storage_{ options.storage }
+{
+    if (descriptors.empty())
+        throw std::invalid_argument("No descriptors to index.");
+    if (descriptors.size() >= std::numeric_limits<std::uint32_t>::max())
+        throw std::invalid_argument("Too many descriptors to index.");
+    type_ = descriptors.front()->type;
+    bins_ = bin_count(type_);
+    for (auto&& desc : descriptors)
+        if (desc->type != type_)
+            throw std::invalid_argument("Non-matching descriptor types.");
+
+    fingerprint_ = descriptor_fingerprint(descriptors);
+    train(descriptors, options, pool);
+
+    // Assign all the descriptors and store the lists contiguously
+    std::vector<std::uint32_t> labels(descriptors.size());
+    parallel_chunks(pool, descriptors.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            labels[i] = closest_centroid(
+              descriptors[i]->data.data(), centroids_, bins_);
+    });
+    offsets_ = group_by_label(labels, centroids_.size() / bins_, ids_);
+
+    if (storage_ == ivf_storage::float32) {
+        values_.resize(ids_.size() * bins_);
+        for (size_t i = 0; i < ids_.size(); ++i)
+            std::copy(descriptors[ids_[i]]->data.begin(),
+                      descriptors[ids_[i]]->data.end(),
+                      values_.begin() + i * bins_);
+    } else {
+        codes_.resize(ids_.size() * bins_);
+        for (size_t i = 0; i < ids_.size(); ++i)
+            std::transform(descriptors[ids_[i]]->data.begin(),
+                           descriptors[ids_[i]]->data.end(),
+                           codes_.begin() + i * bins_,
+                           encode);
+    }
+}
+
+void
+ivf::train(const descriptor_refs& descriptors,
+           const ivf_options& options,
+           thread_pool* pool)
+{
+    size_t n = descriptors.size();
+    size_t lists = options.lists
+                     ? options.lists
+                     : static_cast<size_t>(std::lround(std::sqrt(double(n))));
+    lists = std::clamp<size_t>(lists, 1, n);
+
+    // Train on a random sample of the descriptors
+    std::mt19937_64 rng{ options.seed };
+    std::vector<const float*> sample;
+    size_t wanted = std::min(n, std::max<size_t>(1, options.training) * lists);
+    for (size_t i = 0, left = wanted; i < n && left; ++i)
+        if (std::uniform_int_distribution<size_t>(0, n - i - 1)(rng) < left) {
+            sample.push_back(descriptors[i]->data.data());
+            --left;
+        }
+
+    SPDLOG_DEBUG("Training {} ivf centroids on {} descriptors",
+                 lists,
+                 sample.size());
+
+    centroids_ =
+      detail::k_medians(sample, bins_, lists, options.iterations, rng, pool);
+}
+
+std::vector<neighbor>
+ivf::search(const CSD& query,
+            size_t k,
+            size_t nprobe,
+            search_stats* stats) const
+{
+    if (query.type != type_)
+        throw std::invalid_argument("Non-matching descriptor types.");
+
+    const float* q = query.data.data();
+    std::vector<neighbor> probes;
+    for (size_t c = 0; c < lists(); ++c)
+        probes.push_back(
+          { l1_distance_lanes(q, &centroids_[c * bins_], bins_), c });
+    nprobe = std::min(nprobe, probes.size());
+    std::partial_sort(probes.begin(),
+                      probes.begin() + nprobe,
+                      probes.end(),
+                      detail::closer);
+
+    size_t scanned = 0;
+    detail::knn_heap heap(k);
+    std::vector<std::uint8_t> codes;
+    if (storage_ == ivf_storage::uint8)
+        std::transform(query.data.begin(),
+                       query.data.end(),
+                       std::back_inserter(codes),
+                       encode);
+
+    // The lists are scanned with the faster distances, the neighbours are
+    // identified by their positions in the lists meanwhile
+    for (size_t p = 0; p < nprobe; ++p) {
+        auto list = probes[p].id;
+        for (auto i = offsets_[list]; i < offsets_[list + 1]; ++i) {
+            float d;
+            if (storage_ == ivf_storage::float32)
+                d = l1_distance_lanes(q, &values_[size_t(i) * bins_], bins_);
+            else
+                d = l1_distance_codes(
+                      codes.data(), &codes_[size_t(i) * bins_], bins_) /
+                    255.0f;
+            heap.push({ d, i });
+        }
+        scanned += offsets_[list + 1] - offsets_[list];
+    }
+
+    if (stats)
+        stats->distances += lists() + scanned;
+
+    auto neighbors = heap.sorted();
+    for (auto&& n : neighbors) {
+        if (storage_ == ivf_storage::float32)
+            n.distance =
+              detail::l1_distance(q, &values_[n.id * bins_], bins_);
+        n.id = ids_[n.id];
+    }
+    std::sort(neighbors.begin(), neighbors.end(), detail::closer);
+
+    return neighbors;
+}
+
+void
+ivf::save(const std::filesystem::path& file) const
+{
+    ivf_header header{};
+    std::memcpy(header.magic, IVF_MAGIC, sizeof(header.magic));
+    header.version = IVF_VERSION;
+    header.bins = static_cast<std::uint32_t>(bins_);
+    header.storage = static_cast<std::uint32_t>(storage_);
+    header.lists = static_cast<std::uint32_t>(lists());
+    header.size = size();
+    header.fingerprint = fingerprint_;
+
+    std::ofstream ofs{ file, std::ios::binary };
+    auto write = [&](const auto& v) {
+        ofs.write(reinterpret_cast<const char*>(v.data()),
+                  v.size() * sizeof(v[0]));
+    };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write(centroids_);
+    write(offsets_);
+    write(ids_);
+    write(values_);
+    write(codes_);
+    if (!ofs)
+        throw std::runtime_error("Could not write index " + file.string() +
+                                 "!");
+}
+
+ivf
+ivf::load(const std::filesystem::path& file)
+{
+    std::ifstream ifs{ file, std::ios::binary };
+    if (!ifs)
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+
+    ivf_header header{};
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, IVF_MAGIC, 8) != 0 ||
+        header.version != IVF_VERSION || header.lists == 0 ||
+        header.size >= std::numeric_limits<std::uint32_t>::max() ||
+        header.storage > static_cast<std::uint32_t>(ivf_storage::uint8))
+        invalid_index(file);
+
+    ivf index;
+    try {
+        index.type_ = csd_from_int(static_cast<int>(header.bins));
+    } catch (std::invalid_argument&) {
+        invalid_index(file);
+    }
+    index.bins_ = header.bins;
+    index.storage_ = static_cast<ivf_storage>(header.storage);
+    index.fingerprint_ = header.fingerprint;
+
+    auto read = [&](auto& v, size_t size) {
+        v.resize(size);
+        ifs.read(reinterpret_cast<char*>(v.data()), size * sizeof(v[0]));
+    };
+    read(index.centroids_, size_t(header.lists) * header.bins);
+    read(index.offsets_, size_t(header.lists) + 1);
+    read(index.ids_, header.size);
+    if (index.storage_ == ivf_storage::float32)
+        read(index.values_, header.size * header.bins);
+    else
+        read(index.codes_, header.size * header.bins);
+    if (!ifs)
+        invalid_index(file);
+
+    // Reject corrupted structure rather than read out of bounds
+    if (index.offsets_.front() != 0 || index.offsets_.back() != header.size)
+        invalid_index(file);
+    for (size_t l = 0; l < header.lists; ++l)
+        if (index.offsets_[l] > index.offsets_[l + 1])
+            invalid_index(file);
+    for (auto&& id : index.ids_)
+        if (id >= header.size)
+            invalid_index(file);
+
+    return index;
+}
+
+}
@@ -0,0 +1,273 @@
+/**
+ * @file pivots.cpp
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#ifndef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/spdlog.h"
+
+#include "image_match/pivots.hpp"
+#include "index_kernels.hpp"
+
+namespace image_match {
+
+namespace {
+
+using detail::knn_heap;
+using detail::l1_distance;
+
+constexpr float INFINITE = std::numeric_limits<float>::infinity();
+
+/// Number of the steps the distances to the pivots are quantized to.
+constexpr float STEPS = std::numeric_limits<std::uint16_t>::max();
+
+/// Number of the descriptors whose bounds are computed together.
+constexpr size_t BOUNDS_BLOCK = 1024;
+
+constexpr char PIVOTS_MAGIC[8] = { 'I', 'M', 'P', 'I', 'V', 'O', 'T', 'S' };
+constexpr std::uint32_t PIVOTS_VERSION = 1;
+
+/**
+ * @brief Header of a persisted pivot_table.
+ *
+ * The header is followed by the pivots and the quantized distances.
+ */
+struct pivots_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t bins;
+    std::uint32_t pivots;
+    float step;
+    std::uint64_t size;
+    std::uint64_t fingerprint;
+};
+
+[[noreturn]] void
+invalid_index(const std::filesystem::path& file)
+{
+    throw std::runtime_error("Invalid index " + file.string() + "!");
+}
+
+}
+
+pivot_table::pivot_table(const descriptor_refs& descriptors,
+                         size_t pivots,
+                         std::uint64_t seed)
+  : descriptors_{ descriptors }
+{
+    if (descriptors.size() >= std::numeric_limits<std::uint32_t>::max())
+        throw std::invalid_argument("Too many descriptors to index.");
+    for (auto&& desc : descriptors)
+        if (desc->type != descriptors.front()->type)
+            throw std::invalid_argument("Non-matching descriptor types.");
+
+    size_t n = descriptors.size();
+    gather_values();
+    pivots = std::min(pivots, n);
+
+    SPDLOG_DEBUG("Choosing {} pivots of {} descriptors", pivots, n);
+
+    // The distance to the closest pivot, negative for the pivots themselves
+    std::vector<float> nearest(n, INFINITE);
+    std::vector<float> distances(pivots * n);
+    size_t next = n ? detail::next_random(seed) % n : 0;
+    for (size_t p = 0; p < pivots; ++p) {
+        pivots_.push_back(static_cast<std::uint32_t>(next));
+        nearest[next] = -1;
+
+        const float* pivot = &values_[next * bins_];
+        float* column = &distances[p * n];
+        for (size_t i = 0; i < n; ++i) {
+            column[i] = l1_distance(pivot, &values_[i * bins_], bins_);
+            nearest[i] = std::min(nearest[i], column[i]);
+        }
+        next = std::max_element(nearest.begin(), nearest.end()) -
+               nearest.begin();
+    }
+
+    // The distances are rounded down to the steps, so that a distance lies
+    // within a step above its stored value
+    float farthest = distances.empty()
+                       ? 0
+                       : *std::max_element(distances.begin(), distances.end());
+    step_ = std::max(farthest, 1.0f) / STEPS;
+    table_.reserve(distances.size());
+    for (auto&& d : distances)
+        table_.push_back(static_cast<std::uint16_t>(
+          std::min(std::floor(double(d) / step_), double(STEPS))));
+}
+
+void
+pivot_table::gather_values()
+{
+    bins_ = descriptors_.empty() ? 0 : descriptors_.front()->data.size();
+    values_.resize(descriptors_.size() * bins_);
+    for (size_t i = 0; i < descriptors_.size(); ++i)
+        std::copy(descriptors_[i]->data.begin(),
+                  descriptors_[i]->data.end(),
+                  values_.begin() + i * bins_);
+}
+
+std::vector<neighbor>
+pivot_table::search(const CSD& query, size_t k, search_stats* stats) const
+{
+    knn_heap heap(k);
+    if (descriptors_.empty() || k == 0)
+        return heap.sorted();
+    if (query.type != descriptors_.front()->type)
+        throw std::invalid_argument("Non-matching descriptor types.");
+
+    const float* q = query.data.data();
+    auto distance = [&](size_t i) {
+        return l1_distance(q, &values_[i * bins_], bins_);
+    };
+
+    // The pivots are descriptors too, their distances are the first results
+    size_t n = size();
+    size_t distances = pivots();
+    std::vector<float> to_pivots;
+    float reach = 0;
+    for (auto&& pivot : pivots_) {
+        to_pivots.push_back(distance(pivot));
+        heap.push({ to_pivots.back(), pivot });
+        reach = std::max(reach, to_pivots.back());
+    }
+
+    // The bounds are computed pivot by pivot, so that consecutive
+    // descriptors are processed together in the vector registers, in blocks
+    // staying in the cache meanwhile. A descriptor stored as s steps from
+    // the pivot lies between s and s + 1 steps from it.
+    std::vector<float> bounds(n, 0.0f);
+    for (size_t begin = 0; begin < n; begin += BOUNDS_BLOCK) {
+        size_t end = std::min(n, begin + BOUNDS_BLOCK);
+        for (size_t p = 0; p < pivots(); ++p) {
+            const std::uint16_t* column = &table_[p * n];
+            float d = to_pivots[p];
+            float below = d - step_;
+            for (size_t i = begin; i < end; ++i) {
+                float lower = column[i] * step_;
+                bounds[i] = std::max(
+                  bounds[i], std::max(lower - d, below - lower));
+            }
+        }
+    }
+    for (auto&& pivot : pivots_)
+        bounds[pivot] = INFINITE;
+
+    // The descriptors with the lowest bounds are likely the nearest ones,
+    // comparing them first makes the k-th distance tight early
+    knn_heap seeds(k);
+    float worst = INFINITE;
+    for (size_t i = 0; i < n; ++i)
+        if (bounds[i] < worst) {
+            seeds.push({ bounds[i], i });
+            worst = seeds.bound();
+        }
+    for (auto&& s : seeds.sorted()) {
+        heap.push({ distance(s.id), s.id });
+        bounds[s.id] = INFINITE;
+        ++distances;
+    }
+
+    // The bounds were computed from two distances up to the reach plus the
+    // k-th distance apart, their rounding is covered by the margin
+    auto limit = [&]() {
+        float tau = heap.bound();
+        return tau + detail::PRUNE_MARGIN * (2 * reach + tau);
+    };
+    float excluded = limit();
+    for (size_t i = 0; i < n; ++i)
+        if (bounds[i] <= excluded && bounds[i] != INFINITE) {
+            heap.push({ distance(i), i });
+            excluded = limit();
+            ++distances;
+        }
+
+    if (stats)
+        stats->distances += distances;
+
+    return heap.sorted();
+}
+
+void
+pivot_table::save(const std::filesystem::path& file) const
+{
+    pivots_header header{};
+    std::memcpy(header.magic, PIVOTS_MAGIC, sizeof(header.magic));
+    header.version = PIVOTS_VERSION;
+    header.bins = descriptors_.empty()
+                    ? 0
+                    : static_cast<std::uint32_t>(
+                        bin_count(descriptors_.front()->type));
+    header.pivots = static_cast<std::uint32_t>(pivots());
+    header.step = step_;
+    header.size = size();
+    header.fingerprint = descriptor_fingerprint(descriptors_);
+
+    std::ofstream ofs{ file, std::ios::binary };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(pivots_.data()),
+              pivots_.size() * sizeof(std::uint32_t));
+    ofs.write(reinterpret_cast<const char*>(table_.data()),
+              table_.size() * sizeof(std::uint16_t));
+    if (!ofs)
+        throw std::runtime_error("Could not write index " + file.string() +
+                                 "!");
+}
+
+pivot_table
+pivot_table::load(const std::filesystem::path& file,
+                  const descriptor_refs& descriptors)
+{
+    std::ifstream ifs{ file, std::ios::binary };
+    if (!ifs)
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+
+    pivots_header header{};
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, PIVOTS_MAGIC, 8) != 0 ||
+        header.version != PIVOTS_VERSION || header.pivots > header.size ||
+        !(header.step > 0))
+        invalid_index(file);
+
+    std::uint32_t bins = descriptors.empty()
+                           ? 0
+                           : static_cast<std::uint32_t>(
+                               bin_count(descriptors.front()->type));
+    if (header.size != descriptors.size() || header.bins != bins ||
+        header.fingerprint != descriptor_fingerprint(descriptors))
+        throw std::runtime_error("Index " + file.string() +
+                                 " does not match the database!");
+
+    pivot_table table;
+    table.descriptors_ = descriptors;
+    table.step_ = header.step;
+    table.pivots_.resize(header.pivots);
+    table.table_.resize(header.pivots * header.size);
+    ifs.read(reinterpret_cast<char*>(table.pivots_.data()),
+             table.pivots_.size() * sizeof(std::uint32_t));
+    ifs.read(reinterpret_cast<char*>(table.table_.data()),
+             table.table_.size() * sizeof(std::uint16_t));
+    if (!ifs)
+        invalid_index(file);
+
+    // Reject corrupted pivots rather than read out of bounds
+    for (auto&& pivot : table.pivots_)
+        if (pivot >= header.size)
+            invalid_index(file);
+
+    table.gather_values();
+
+    return table;
+}
+
+}
@@ -0,0 +1,289 @@
+/**
+ * @file pq.cpp
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#ifndef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/spdlog.h"
+
+#include "image_match/pq.hpp"
+#include "index_kernels.hpp"
+
+namespace image_match {
+
+namespace {
+
+using detail::closest_centroid;
+using detail::parallel_chunks;
+
+/// Number of the centroids of a subspace, the values of a byte.
+constexpr size_t PQ_CENTROIDS = 256;
+
+constexpr char PQ_MAGIC[8] = { 'I', 'M', 'P', 'Q', 0, 0, 0, 0 };
+constexpr std::uint32_t PQ_VERSION = 2;
+
+/**
+ * @brief Header of a persisted product quantizer.
+ *
+ * The header is followed by the codebooks, the codes and, if there are
+ * labels, their offsets and the labels one after another.
+ */
+struct pq_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t bins;
+    std::uint32_t subspaces;
+    std::uint32_t centroids;
+    std::uint64_t size;
+    std::uint64_t fingerprint;
+    std::uint64_t labels; ///< Number of the labels, 0 or the size.
+    std::uint64_t label_bytes;
+};
+
+[[noreturn]] void
+invalid_index(const std::filesystem::path& file)
+{
+    throw std::runtime_error("Invalid index " + file.string() + "!");
+}
+
+}
+
+product_quantizer::product_quantizer(const descriptor_refs& descriptors,
+                                     const pq_options& options,
+                                     thread_pool* pool)
+  : subspaces_{ options.subspaces }
+{
+    if (descriptors.empty())
+        throw std::invalid_argument("No descriptors to index.");
+    if (descriptors.size() >= std::numeric_limits<std::uint32_t>::max())
+        throw std::invalid_argument("Too many descriptors to index.");
+    type_ = descriptors.front()->type;
+    bins_ = bin_count(type_);
+    for (auto&& desc : descriptors)
+        if (desc->type != type_)
+            throw std::invalid_argument("Non-matching descriptor types.");
+    if (subspaces_ == 0 || bins_ % subspaces_ != 0)
+        throw std::invalid_argument(
+          "The subspaces must divide the bins of the descriptors.");
+
+    fingerprint_ = descriptor_fingerprint(descriptors);
+
+    // Train on a random sample of the descriptors
+    size_t n = descriptors.size();
+    centroids_ = std::min(PQ_CENTROIDS, n);
+    std::mt19937_64 rng{ options.seed };
+    std::vector<const float*> sample;
+    size_t wanted =
+      std::min(n, std::max<size_t>(1, options.training) * centroids_);
+    for (size_t i = 0, left = wanted; i < n && left; ++i)
+        if (std::uniform_int_distribution<size_t>(0, n - i - 1)(rng) < left) {
+            sample.push_back(descriptors[i]->data.data());
+            --left;
+        }
+
+    SPDLOG_DEBUG("Training {} codebooks of {} centroids on {} descriptors",
+                 subspaces_,
+                 centroids_,
+                 sample.size());
+
+    // The codebooks are independent, each is trained by a single worker
+    size_t dims = bins_ / subspaces_;
+    std::uint64_t seed = rng();
+    std::vector<std::vector<float>> codebooks(subspaces_);
+    parallel_chunks(pool, subspaces_, [&](size_t begin, size_t end) {
+        std::vector<const float*> points(sample.size());
+        for (size_t m = begin; m < end; ++m) {
+            for (size_t i = 0; i < sample.size(); ++i)
+                points[i] = sample[i] + m * dims;
+            std::mt19937_64 codebook_rng{ seed + m };
+            codebooks[m] = detail::k_medians(points,
+                                             dims,
+                                             centroids_,
+                                             options.iterations,
+                                             codebook_rng,
+                                             nullptr);
+        }
+    });
+    for (auto&& codebook : codebooks)
+        codebooks_.insert(codebooks_.end(), codebook.begin(), codebook.end());
+
+    codes_.resize(n * subspaces_);
+    parallel_chunks(pool, n, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            for (size_t m = 0; m < subspaces_; ++m)
+                codes_[i * subspaces_ + m] =
+                  static_cast<std::uint8_t>(closest_centroid(
+                    descriptors[i]->data.data() + m * dims,
+                    codebooks[m],
+                    dims));
+    });
+}
+
+void
+product_quantizer::set_labels(const std::vector<std::string>& labels)
+{
+    if (labels.size() != size())
+        throw std::invalid_argument("A label is needed for every descriptor.");
+
+    labels_.clear();
+    label_offsets_.assign(1, 0);
+    for (auto&& label : labels) {
+        labels_ += label;
+        label_offsets_.push_back(labels_.size());
+    }
+}
+
+std::vector<neighbor>
+product_quantizer::search(const CSD& query,
+                          size_t k,
+                          size_t rerank,
+                          const descriptor_refs* store,
+                          search_stats* stats) const
+{
+    if (query.type != type_)
+        throw std::invalid_argument("Non-matching descriptor types.");
+
+    // Distances of the sub-vectors of the query to all the centroids
+    size_t dims = bins_ / subspaces_;
+    std::vector<float> table(subspaces_ * centroids_);
+    for (size_t m = 0; m < subspaces_; ++m)
+        for (size_t c = 0; c < centroids_; ++c)
+            table[m * centroids_ + c] =
+              detail::l1_distance(query.data.data() + m * dims,
+                                  &codebooks_[(m * centroids_ + c) * dims],
+                                  dims);
+
+    // The lookups are summed in four lanes, so that the additions of a code
+    // don't wait for each other
+    bool exact = store && rerank;
+    detail::knn_heap heap(exact ? std::max(k, rerank) : k);
+    const std::uint8_t* code = codes_.data();
+    for (size_t i = 0; i < size(); ++i, code += subspaces_) {
+        float acc[4] = {};
+        const float* t = table.data();
+        size_t m = 0;
+        for (; m + 4 <= subspaces_; m += 4, t += 4 * centroids_)
+            for (size_t j = 0; j < 4; ++j)
+                acc[j] += t[j * centroids_ + code[m + j]];
+        for (; m < subspaces_; ++m, t += centroids_)
+            acc[0] += t[code[m]];
+        float d = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+        if (d <= heap.bound())
+            heap.push({ d, i });
+    }
+
+    auto neighbors = heap.sorted();
+    if (stats)
+        stats->distances += size() + (exact ? neighbors.size() : 0);
+
+    if (exact) {
+        for (auto&& n : neighbors)
+            n.distance = detail::l1_distance(
+              query.data.data(), (*store)[n.id]->data.data(), bins_);
+        std::sort(neighbors.begin(), neighbors.end(), detail::closer);
+        neighbors.resize(std::min(neighbors.size(), k));
+    }
+
+    return neighbors;
+}
+
+void
+product_quantizer::save(const std::filesystem::path& file) const
+{
+    pq_header header{};
+    std::memcpy(header.magic, PQ_MAGIC, sizeof(header.magic));
+    header.version = PQ_VERSION;
+    header.bins = static_cast<std::uint32_t>(bins_);
+    header.subspaces = static_cast<std::uint32_t>(subspaces_);
+    header.centroids = static_cast<std::uint32_t>(centroids_);
+    header.size = size();
+    header.fingerprint = fingerprint_;
+    header.labels = labeled() ? size() : 0;
+    header.label_bytes = labels_.size();
+
+    std::ofstream ofs{ file, std::ios::binary };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(codebooks_.data()),
+              codebooks_.size() * sizeof(float));
+    ofs.write(reinterpret_cast<const char*>(codes_.data()), codes_.size());
+    ofs.write(reinterpret_cast<const char*>(label_offsets_.data()),
+              label_offsets_.size() * sizeof(std::uint64_t));
+    ofs.write(labels_.data(), labels_.size());
+    if (!ofs)
+        throw std::runtime_error("Could not write index " + file.string() +
+                                 "!");
+}
+
+product_quantizer
+product_quantizer::load(const std::filesystem::path& file)
+{
+    std::ifstream ifs{ file, std::ios::binary };
+    if (!ifs)
+        throw std::runtime_error("Could not read index " + file.string() +
+                                 "!");
+
+    pq_header header{};
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, PQ_MAGIC, 8) != 0 ||
+        header.version != PQ_VERSION || header.subspaces == 0 ||
+        header.bins % header.subspaces != 0 || header.centroids == 0 ||
+        header.centroids > PQ_CENTROIDS ||
+        header.size >= std::numeric_limits<std::uint32_t>::max() ||
+        (header.labels != 0 && header.labels != header.size) ||
+        (header.labels == 0 && header.label_bytes != 0))
+        invalid_index(file);
+
+    product_quantizer quantizer;
+    try {
+        quantizer.type_ = csd_from_int(static_cast<int>(header.bins));
+    } catch (std::invalid_argument&) {
+        invalid_index(file);
+    }
+    quantizer.bins_ = header.bins;
+    quantizer.subspaces_ = header.subspaces;
+    quantizer.centroids_ = header.centroids;
+    quantizer.fingerprint_ = header.fingerprint;
+
+    // The centroids of all the subspaces together have the bins of one
+    quantizer.codebooks_.resize(size_t(header.centroids) * header.bins);
+    quantizer.codes_.resize(header.size * header.subspaces);
+    ifs.read(reinterpret_cast<char*>(quantizer.codebooks_.data()),
+             quantizer.codebooks_.size() * sizeof(float));
+    ifs.read(reinterpret_cast<char*>(quantizer.codes_.data()),
+             quantizer.codes_.size());
+    if (!ifs)
+        invalid_index(file);
+
+    // Reject corrupted codes rather than read out of bounds
+    for (auto&& code : quantizer.codes_)
+        if (code >= header.centroids)
+            invalid_index(file);
+
+    if (header.labels) {
+        auto& offsets = quantizer.label_offsets_;
+        offsets.resize(header.labels + 1);
+        ifs.read(reinterpret_cast<char*>(offsets.data()),
+                 offsets.size() * sizeof(std::uint64_t));
+        if (!ifs || offsets.front() != 0 ||
+            offsets.back() != header.label_bytes ||
+            !std::is_sorted(offsets.begin(), offsets.end()))
+            invalid_index(file);
+
+        quantizer.labels_.resize(header.label_bytes);
+        ifs.read(quantizer.labels_.data(), quantizer.labels_.size());
+        if (!ifs)
+            invalid_index(file);
+    }
+
+    return quantizer;
+}
+
+}
@@ -0,0 +1,262 @@
+/**
+ * @file stats.cpp
+ */
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+#include "image_match/stats.hpp"
+
+namespace image_match {
+namespace stats {
+
+namespace {
+
+/// Number of the buckets each power of two of the durations is split into.
+constexpr unsigned SUB_BUCKETS_BITS = 4;
+constexpr std::uint64_t SUB_BUCKETS = 1 << SUB_BUCKETS_BITS;
+
+/// Buckets of durations up to the largest nanoseconds of 64 bits.
+constexpr size_t BUCKETS = (64 - SUB_BUCKETS_BITS + 1) * SUB_BUCKETS;
+
+/// Return the bucket of the duration in nanoseconds.
+size_t
+bucket_of(std::uint64_t ns)
+{
+    if (ns < SUB_BUCKETS)
+        return ns;
+
+    unsigned shift = 0;
+    while ((ns >> shift) >= 2 * SUB_BUCKETS)
+        ++shift;
+    return (shift + 1) * SUB_BUCKETS + ((ns >> shift) - SUB_BUCKETS);
+}
+
+/// Return the middle of the durations of the bucket, in nanoseconds.
+double
+bucket_middle(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    double lower = double(SUB_BUCKETS + bucket % SUB_BUCKETS) *
+                   double(std::uint64_t{ 1 } << shift);
+    return lower + double((std::uint64_t{ 1 } << shift) - 1) / 2;
+}
+
+/**
+ * @brief Durations of a stage counted in logarithmic buckets.
+ *
+ * The memory doesn't grow with the number of the durations, the percentiles
+ * are known within a sixteenth of their value.
+ */
+struct histogram
+{
+    std::array<std::uint64_t, BUCKETS> buckets{};
+    std::uint64_t count{ 0 };
+    std::uint64_t total{ 0 };
+    std::uint64_t min{ std::numeric_limits<std::uint64_t>::max() };
+    std::uint64_t max{ 0 };
+
+    void add(std::uint64_t ns)
+    {
+        ++buckets[bucket_of(ns)];
+        ++count;
+        total += ns;
+        min = std::min(min, ns);
+        max = std::max(max, ns);
+    }
+
+    void merge(const histogram& other)
+    {
+        for (size_t b = 0; b < BUCKETS; ++b)
+            buckets[b] += other.buckets[b];
+        count += other.count;
+        total += other.total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+};
+
+/// Durations and counters recorded by a single thread.
+struct thread_record
+{
+    histogram durations[STAGE_COUNT];
+    std::uint64_t counters[COUNTER_COUNT]{};
+    std::uint64_t busy{ 0 };
+};
+
+std::atomic<bool> recording{ false };
+
+/// Number of the timed stages the calling thread is within.
+thread_local size_t depth = 0;
+
+/// Records of all the threads, kept after the threads exit.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<thread_record>> registry;
+
+/// Return the record of the calling thread, registered on the first use.
+thread_record&
+local_record()
+{
+    thread_local thread_record* record = nullptr;
+    if (!record) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(std::make_unique<thread_record>());
+        record = registry.back().get();
+    }
+
+    return *record;
+}
+
+/**
+ * @brief Return the duration below which the given fraction of the
+ * durations lie, in seconds.
+ *
+ * The duration is the middle of its bucket, kept within the recorded range.
+ */
+double
+percentile(const histogram& h, double fraction)
+{
+    auto rank = static_cast<std::uint64_t>(fraction * (h.count - 1) + 0.5);
+    std::uint64_t below = 0;
+    size_t b = 0;
+    for (; b + 1 < BUCKETS; ++b) {
+        below += h.buckets[b];
+        if (below > rank)
+            break;
+    }
+
+    return std::clamp(bucket_middle(b), double(h.min), double(h.max)) * 1e-9;
+}
+
+}
+
+const char*
+stage_name(stage s)
+{
+    switch (s) {
+        case stage::probe:
+            return "probe";
+        case stage::decode:
+            return "decode";
+        case stage::subsample:
+            return "subsample";
+        case stage::hmmd:
+            return "hmmd";
+        case stage::quantize:
+            return "quantize";
+        case stage::scan:
+            return "scan";
+        case stage::extract:
+            return "extract";
+        case stage::write:
+            return "write";
+    }
+
+    return "unknown";
+}
+
+void
+set_enabled(bool enabled)
+{
+    recording.store(enabled, std::memory_order_relaxed);
+}
+
+bool
+enabled()
+{
+    return recording.load(std::memory_order_relaxed);
+}
+
+void
+record(stage s, std::chrono::nanoseconds duration)
+{
+    if (!enabled())
+        return;
+
+    local_record().durations[static_cast<size_t>(s)].add(duration.count());
+}
+
+void
+enter_stage()
+{
+    ++depth;
+}
+
+void
+leave_stage(stage s, std::chrono::nanoseconds duration)
+{
+    --depth;
+    if (!enabled())
+        return;
+
+    auto& record = local_record();
+    record.durations[static_cast<size_t>(s)].add(duration.count());
+    if (depth == 0)
+        record.busy += duration.count();
+}
+
+void
+add(counter c, std::uint64_t value)
+{
+    if (!enabled())
+        return;
+
+    local_record().counters[static_cast<size_t>(c)] += value;
+}
+
+summary
+collect()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    summary result;
+    result.threads = registry.size();
+    for (size_t s = 0; s < STAGE_COUNT; ++s) {
+        histogram durations;
+        for (auto&& record : registry)
+            durations.merge(record->durations[s]);
+        if (durations.count == 0)
+            continue;
+
+        stage_summary stage_result;
+        stage_result.id = static_cast<stage>(s);
+        stage_result.count = durations.count;
+        stage_result.total = durations.total * 1e-9;
+        stage_result.mean = stage_result.total / durations.count;
+        stage_result.p50 = percentile(durations, 0.5);
+        stage_result.p90 = percentile(durations, 0.9);
+        stage_result.p99 = percentile(durations, 0.99);
+        stage_result.max = durations.max * 1e-9;
+        result.stages.push_back(stage_result);
+    }
+
+    for (auto&& record : registry) {
+        for (size_t c = 0; c < COUNTER_COUNT; ++c)
+            result.counters[c] += record->counters[c];
+        result.busy.push_back(record->busy * 1e-9);
+    }
+
+    return result;
+}
+
+void
+reset()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto&& record : registry) {
+        for (auto&& durations : record->durations)
+            durations = histogram{};
+        std::fill(
+          std::begin(record->counters), std::end(record->counters), 0);
+        record->busy = 0;
+    }
+}
+
+}
+}
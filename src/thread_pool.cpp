@@ -0,0 +1,53 @@
+/**
+ * @file thread_pool.cpp
+ */
+#include <algorithm>
+
+#include "image_match/thread_pool.hpp"
+
+namespace image_match {
+
+thread_pool::thread_pool(size_t threads)
+{
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back(&thread_pool::work, this);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    task_added_.notify_all();
+
+    for (auto&& worker : workers_)
+        worker.join();
+}
+
+void
+thread_pool::work()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            task_added_.wait(lock,
+                             [this]() { return stop_ || !tasks_.empty(); });
+
+            // Finish the remaining tasks before stopping
+            if (tasks_.empty())
+                return;
+
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+
+        task();
+    }
+}
+
+}